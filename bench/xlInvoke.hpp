@@ -0,0 +1,123 @@
+/// @file xlInvoke.hpp
+///
+/// @brief Thunks for calling registered functions from the load generator
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLINVOKE_HPP
+#define XLKIT_XLINVOKE_HPP
+
+// The Makefile force-includes this header ahead of the add-in sources
+// which are linked into bench/xlkitLoad. It defines XLKIT_REGISTER_HOOK so
+// that every registered function gets a thunk which calls it with raw
+// argument values, as Excel would. Add-ins built for Excel don't include it
+// and so have no thunks.
+
+#define XLKIT_REGISTER_HOOK(FUNC, INFO) \
+			static const xlmock::InvokeEntry theInvoke##FUNC( \
+				&INFO, &xlmock::Invoke<decltype(&FUNC)>::template call<&FUNC>); \
+			/**/
+
+#include <xlkit/xlkit.hpp>
+
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <string.h>
+
+namespace xlmock {
+
+/// Calls a function with args[i] pointing to the value of argument i as
+/// Excel passes it, and stores the returned value as Excel receives it into
+/// result, which must hold at least a double
+typedef void (*InvokeFn)(const void* const* args, void* result);
+
+// Thunks of the registered functions, filled in by InvokeEntry during
+// static initialization
+inline std::vector< std::pair<const xlkit::FunctionInfo*, InvokeFn> >&
+invokeTable() {
+	static std::vector< std::pair<const xlkit::FunctionInfo*, InvokeFn> > table;
+	return table;
+}
+
+/// Thunk of the registered function with the given FunctionInfo, or NULL if
+/// it was not compiled with this header
+inline InvokeFn
+findInvoke(const xlkit::FunctionInfo* info) {
+	for (size_t i = 0; i < invokeTable().size(); ++i) {
+		if (invokeTable()[i].first == info)
+			return invokeTable()[i].second;
+	}
+	return NULL;
+}
+
+// Adds the thunk of a registered function to invokeTable()
+struct InvokeEntry {
+	InvokeEntry(const xlkit::FunctionInfo* info, InvokeFn fn) {
+		invokeTable().push_back(std::make_pair(info, fn));
+	}
+};
+
+// Compile-time list of the argument indices I
+template <int... I>
+struct Indices { };
+template <int N, int... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...> { };
+template <int... I>
+struct MakeIndices<0, I...> {
+	typedef Indices<I...> type;
+};
+
+// InvokeFn thunks for functions of type F
+template <typename F>
+struct Invoke;
+template <typename R, typename... ARGS>
+struct Invoke<R (__stdcall *)(ARGS...)> {
+	typedef R (__stdcall *Function)(ARGS...);
+
+	template <Function FUNC>
+	static void call(const void* const* args, void* result) {
+		call<FUNC>(args, result, typename MakeIndices<sizeof...(ARGS)>::type(),
+				   std::is_void<R>());
+	}
+
+	// Excel passes every argument and result type in a single register,
+	// so the result is stored as raw bits
+	template <Function FUNC, int... I>
+	static void call(const void* const* args, void* result, Indices<I...>,
+					 std::false_type) {
+		static_assert(std::is_trivially_copyable<R>::value && sizeof(R) <= sizeof(double),
+					  "Result must be passed to Excel in a single register");
+		R r = FUNC(*static_cast<const ARGS*>(args[I])...);
+		::memcpy(result, &r, sizeof(R));
+	}
+	template <Function FUNC, int... I>
+	static void call(const void* const* args, void* result, Indices<I...>,
+					 std::true_type) {
+		FUNC(*static_cast<const ARGS*>(args[I])...);
+	}
+};
+
+} // namespace xlmock
+
+#endif // XLKIT_XLINVOKE_HPP
@@ -0,0 +1,210 @@
+/// @file xlMockExcel.cpp
+///
+/// @brief In-process stand-in for Excel's XLCALL32 callbacks
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "xlMockExcel.hpp"
+
+#include <xlkit/xlutil.hpp>
+
+#include <atomic>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace xlmock {
+
+namespace {
+
+// Counts of calls indexed by command, special function and worksheet
+// function numbers
+std::atomic<uint64_t> theCalls[3][0x1000];
+
+std::atomic<int> theRegisterId(0);
+
+// Each thread calculates a cell of its own, as Excel never calculates the
+// same cell on two threads at once
+std::atomic<int> theCallerRows(0);
+XLKIT_THREAD_LOCAL int theCallerRow = -1;
+
+int
+callerRow() {
+	if (theCallerRow < 0)
+		theCallerRow = theCallerRows.fetch_add(1, std::memory_order_relaxed);
+	return theCallerRow;
+}
+
+std::atomic<uint64_t>&
+callCounter(int xlfn) {
+	int kind = (xlfn & xlCommand) ? 0 : (xlfn & xlSpecial) ? 1 : 2;
+	return theCalls[kind][xlfn & 0x0FFF];
+}
+
+// Set x to a string allocated by the mock, released by xlFree
+template <typename XLOPER_T, typename CHAR_T>
+void
+setString(XLOPER_T& x, const char* s) {
+	size_t len = strlen(s);
+	CHAR_T* str = static_cast<CHAR_T*>(malloc((len + 1) * sizeof(CHAR_T)));
+	str[0] = CHAR_T(len);
+	for (size_t i = 0; i < len; ++i)
+		str[i + 1] = CHAR_T(s[i]);
+	x.xltype = xltypeStr;
+	x.val.str = str;
+}
+
+template <typename XLOPER_T>
+void
+freeOper(XLOPER_T& x) {
+	switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+		case xltypeStr:
+			free(x.val.str);
+			break;
+		case xltypeMulti:
+			for (size_t i = 0, n = size_t(x.val.array.rows) * x.val.array.columns; i < n; ++i)
+				freeOper(x.val.array.lparray[i]);
+			free(x.val.array.lparray);
+			break;
+	}
+	x.xltype = xltypeNil;
+}
+
+// Value of the cell at row, col in every sheet of the mock
+inline double
+cellValue(int row, int col) {
+	return double(row) * 1000.0 + double(col);
+}
+
+// Coerce the reference ref into a matrix of cellValue()s allocated by the
+// mock, returning false if ref isn't a reference to a single area
+template <typename XLOPER_T, typename XLREF_T>
+bool
+coerceArea(const XLREF_T& area, XLOPER_T& res) {
+	int rows = int(area.rwLast - area.rwFirst) + 1;
+	int cols = int(area.colLast - area.colFirst) + 1;
+	XLOPER_T* cells = static_cast<XLOPER_T*>(malloc(size_t(rows) * cols * sizeof(XLOPER_T)));
+	for (int i = 0; i < rows; ++i) {
+		for (int j = 0; j < cols; ++j) {
+			XLOPER_T& x = cells[size_t(i) * cols + j];
+			x.xltype = xltypeNum;
+			x.val.num = cellValue(int(area.rwFirst) + i, int(area.colFirst) + j);
+		}
+	}
+	res.xltype = xltypeMulti;
+	res.val.array.lparray = cells;
+	res.val.array.rows = rows;
+	res.val.array.columns = cols;
+	return true;
+}
+template <typename XLOPER_T>
+bool
+coerceRef(const XLOPER_T& ref, XLOPER_T& res) {
+	switch (ref.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+		case xltypeSRef:
+			return coerceArea(ref.val.sref.ref, res);
+		case xltypeRef:
+			if (!ref.val.mref.lpmref || ref.val.mref.lpmref->count != 1)
+				return false;
+			return coerceArea(ref.val.mref.lpmref->reftbl[0], res);
+	}
+	return false;
+}
+
+template <typename XLOPER_T, typename CHAR_T>
+int
+dispatch(int xlfn, int count, XLOPER_T* opers[], XLOPER_T* res) {
+	callCounter(xlfn).fetch_add(1, std::memory_order_relaxed);
+	if (xlfn == xlFree) {
+		for (int i = 0; i < count; ++i)
+			freeOper(*opers[i]);
+		return xlretSuccess;
+	}
+	if (!res)
+		return xlretSuccess;
+	switch (xlfn) {
+		case xlGetName:
+			setString<XLOPER_T, CHAR_T>(*res, "xlkitBench.xll");
+			break;
+		case xlfRegister:
+			res->xltype = xltypeNum;
+			res->val.num = double(++theRegisterId);
+			break;
+		case xlCoerce:
+			if (count < 1 || !coerceRef(*opers[0], *res))
+				return xlretInvXloper;
+			break;
+		case xlfCaller:
+			res->xltype = xltypeSRef;
+			res->val.sref.count = 1;
+			res->val.sref.ref.rwFirst = res->val.sref.ref.rwLast = callerRow();
+			res->val.sref.ref.colFirst = res->val.sref.ref.colLast = 0;
+			break;
+		default:
+			res->xltype = xltypeBool;
+			res->val.xbool = 1;
+			break;
+	}
+	return xlretSuccess;
+}
+
+} // namespace
+
+uint64_t
+calls(int xlfn) {
+	return callCounter(xlfn).load(std::memory_order_relaxed);
+}
+
+void
+resetCalls() {
+	for (int kind = 0; kind < 3; ++kind)
+		for (int i = 0; i < 0x1000; ++i)
+			theCalls[kind][i].store(0, std::memory_order_relaxed);
+}
+
+} // namespace xlmock
+
+extern "C" {
+
+int _cdecl
+Excel4(int xlfn, LPXLOPER operRes, int count, ...) {
+	LPXLOPER opers[255];
+	va_list args;
+	va_start(args, count);
+	for (int i = 0; i < count && i < 255; ++i)
+		opers[i] = va_arg(args, LPXLOPER);
+	va_end(args);
+	return xlmock::dispatch<XLOPER, char>(xlfn, count, opers, operRes);
+}
+
+int __stdcall
+Excel4v(int xlfn, LPXLOPER operRes, int count, LPXLOPER opers[]) {
+	return xlmock::dispatch<XLOPER, char>(xlfn, count, opers, operRes);
+}
+
+int __stdcall
+MdCallBack12(int xlfn, int count, LPXLOPER12 opers[], LPXLOPER12 operRes) {
+	return xlmock::dispatch<XLOPER12, XCHAR>(xlfn, count, opers, operRes);
+}
+
+} // extern "C"
@@ -0,0 +1,59 @@
+/// @file xlMockExcel.hpp
+///
+/// @brief In-process stand-in for Excel's XLCALL32 callbacks
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLMOCKEXCEL_HPP
+#define XLKIT_XLMOCKEXCEL_HPP
+
+#include <xlkit/xlcall.hpp>
+
+#include <stdint.h>
+
+// The mock defines the callbacks that XLCALL.H declares and that xlkit looks
+// up in XLCALL32.DLL on Windows, so that xlkit can be built and measured
+// without Excel:
+//   - Excel4() and Excel4v() for XLOPER calls
+//   - MdCallBack12() for XLOPER12 calls
+//
+// Results of xlGetName and xlfCaller are allocated like Excel does and
+// released through xlFree. xlfCaller gives each thread a cell of its own.
+// xlCoerce of a reference returns a matrix holding row * 1000 + col in each
+// cell. xlfRegister returns increasing register ids. Other functions
+// succeed and return TRUE, so their cost is only that of xlkit's
+// marshalling.
+
+namespace xlmock {
+
+/// Number of calls made to the mock with the given function number
+uint64_t calls(int xlfn);
+
+/// Reset the counts of calls
+void resetCalls();
+
+} // namespace xlmock
+
+extern "C" int __stdcall MdCallBack12(int xlfn, int count, LPXLOPER12 opers[],
+							LPXLOPER12 operRes);
+
+#endif // XLKIT_XLMOCKEXCEL_HPP
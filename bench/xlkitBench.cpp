@@ -0,0 +1,423 @@
+/// @file xlkitBench.cpp
+///
+/// @brief Microbenchmarks of xlkit's hot paths, run against the mock Excel host
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Usage: xlkitBench [--filter TEXT] [--repetitions N] [--min-time SECONDS]
+//
+// Prints one JSON object per line: a header describing the build followed by
+// one line per benchmark with the nanoseconds per operation, so that the
+// output of different versions can be compared with standard tools.
+
+#include <xlkit/xlkit.hpp>
+#include <xlkit/xlRangeReader.hpp>
+
+// The benchmarks are built in one translation unit with xlkit.cpp so that
+// they can measure ExcelHost, which is internal to it
+#include <xlkit/xlkit.cpp>
+
+#include "xlMockExcel.hpp"
+
+#include <boost/preprocessor/repetition/repeat.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Number of functions registered by the attach benchmark
+#ifndef XLKIT_BENCH_FUNCTIONS
+#define XLKIT_BENCH_FUNCTIONS 100
+#endif
+
+//
+// Functions to register and call
+//
+#define XLKIT_BENCH_FUNCTION(Z, N, DATA) \
+			double XLKIT_API \
+			xlBenchFunction##N(double x, double y) \
+			{ \
+				XLKIT_BEGIN_FUNCTION \
+				return x + y + N; \
+				XLKIT_END_FUNCTION(double) \
+			} \
+			XLKIT_REGISTER_THREADSAFE(xlBenchFunction##N, "Add two numbers") \
+			/**/
+BOOST_PP_REPEAT(XLKIT_BENCH_FUNCTIONS, XLKIT_BENCH_FUNCTION, ~)
+
+namespace {
+
+using namespace xlkit;
+using namespace xlkit::detail;
+
+typedef std::chrono::steady_clock Clock;
+
+// Keep the compiler from optimizing away the computation of v
+template <typename T>
+inline void
+keep(const T& v) {
+	asm volatile("" : : "g"(&v) : "memory");
+}
+
+struct Benchmark {
+	const char* name;
+	void (*run)(size_t iterations);
+};
+
+std::vector<Benchmark>&
+benchmarks() {
+	static std::vector<Benchmark> theBenchmarks;
+	return theBenchmarks;
+}
+
+struct AddBenchmark {
+	AddBenchmark(const char* name, void (*run)(size_t iterations)) {
+		Benchmark b = { name, run };
+		benchmarks().push_back(b);
+	}
+};
+
+#define XLKIT_BENCHMARK(NAME) \
+			void bench_##NAME(size_t iterations); \
+			AddBenchmark theBenchmark_##NAME(#NAME, &bench_##NAME); \
+			void bench_##NAME(size_t iterations) \
+			/**/
+
+enum { MATRIX_ROWS = 100, MATRIX_COLS = 100 };
+
+template <typename OPER>
+OPER
+mixedMatrix() {
+	OPER m;
+	typename OPER::CellMatrixRef cells(m.setMatrix(MATRIX_ROWS, MATRIX_COLS));
+	for (int i = 0; i < MATRIX_ROWS; ++i) {
+		for (int j = 0; j < MATRIX_COLS; ++j) {
+			switch ((i + j) % 3) {
+				case 0:	cells(i, j).set(double(i * j)); break;
+				case 1:	cells(i, j).set("cell"); break;
+				case 2:	cells(i, j).set(true); break;
+			}
+		}
+	}
+	return m;
+}
+
+//
+// Construction of each type of operand
+//
+XLKIT_BENCHMARK(oper4_double) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x(1.5);
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper4_int) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x(static_cast<int>(i));
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper4_bool) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x(true);
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper4_error) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x(xlError(xlerrNA));
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper4_string) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x("A short string");
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper12_double) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand12 x(1.5);
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper12_int) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand12 x(static_cast<int>(i));
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper12_bool) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand12 x(true);
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper12_error) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand12 x(xlError(xlerrNA));
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper12_string) {
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand12 x("A short string");
+		keep(x);
+	}
+}
+
+//
+// Matrices
+//
+XLKIT_BENCHMARK(oper4_set_matrix_100x100) {
+	std::vector<double> data(MATRIX_ROWS * MATRIX_COLS, 1.0);
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x;
+		x.setMatrix(MATRIX_ROWS, MATRIX_COLS, data.data());
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper12_set_matrix_100x100) {
+	std::vector<double> data(MATRIX_ROWS * MATRIX_COLS, 1.0);
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand12 x;
+		x.setMatrix(MATRIX_ROWS, MATRIX_COLS, data.data());
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper4_deep_copy_matrix_100x100) {
+	xlOperand src(mixedMatrix<xlOperand>());
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x(src.get<xlConstCellMatrixRef>());
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper12_deep_copy_matrix_100x100) {
+	xlOperand12 src(mixedMatrix<xlOperand12>());
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand12 x(src.get<xlConstCellMatrixRef12>());
+		keep(x);
+	}
+}
+XLKIT_BENCHMARK(oper4_shared_copy_matrix_100x100) {
+	xlOperand src(mixedMatrix<xlOperand>());
+	for (size_t i = 0; i < iterations; ++i) {
+		xlOperand x(src);
+		keep(x);
+	}
+}
+
+//
+// Conversions through castValue()
+//
+XLKIT_BENCHMARK(oper4_cast_string_to_double) {
+	xlOperand x("12345.678");
+	for (size_t i = 0; i < iterations; ++i) {
+		double v = x.get<double>();
+		keep(v);
+	}
+}
+XLKIT_BENCHMARK(oper4_cast_double_to_string) {
+	xlOperand x(12345.678);
+	for (size_t i = 0; i < iterations; ++i) {
+		std::string v = x.get<std::string>();
+		keep(v);
+	}
+}
+XLKIT_BENCHMARK(oper4_cast_double_to_bool) {
+	xlOperand x(1.0);
+	for (size_t i = 0; i < iterations; ++i) {
+		bool v = x.get<bool>();
+		keep(v);
+	}
+}
+XLKIT_BENCHMARK(oper12_cast_string_to_double) {
+	xlOperand12 x("12345.678");
+	for (size_t i = 0; i < iterations; ++i) {
+		double v = x.get<double>();
+		keep(v);
+	}
+}
+XLKIT_BENCHMARK(oper12_cast_double_to_wstring) {
+	xlOperand12 x(12345.678);
+	for (size_t i = 0; i < iterations; ++i) {
+		std::wstring v = x.get<std::wstring>();
+		keep(v);
+	}
+}
+
+//
+// Results returned to Excel
+//
+XLKIT_BENCHMARK(result_operand_ptr_double) {
+	for (size_t i = 0; i < iterations; ++i) {
+		ResultOperandPtr result;
+		result->set(1.5);
+		keep(result);
+	}
+}
+XLKIT_BENCHMARK(result_operand12_ptr_string) {
+	for (size_t i = 0; i < iterations; ++i) {
+		ResultOperand12Ptr result;
+		result->set("A short string");
+		keep(result);
+	}
+}
+XLKIT_BENCHMARK(udf_call) {
+	// Call through a volatile pointer, as Excel does, so the body is not inlined
+	double (WINAPI * volatile fn)(double, double) = &xlBenchFunction0;
+	for (size_t i = 0; i < iterations; ++i) {
+		double v = fn(1.0, 2.0);
+		keep(v);
+	}
+}
+
+//
+// Calls into Excel through ExcelHost
+//
+XLKIT_BENCHMARK(host_call_two_args) {
+	ExcelHost& host = ExcelHost::instance();
+	for (size_t i = 0; i < iterations; ++i) {
+		bool ok = host.call(xlcMessage, true, "Calculating");
+		keep(ok);
+	}
+}
+XLKIT_BENCHMARK(host_eval_call12_caller) {
+	ExcelHost& host = ExcelHost::instance();
+	for (size_t i = 0; i < iterations; ++i) {
+		ExcelHost::ExcelResult12 result;
+		bool ok = host.evalCall12(xlfCaller, result);
+		keep(ok);
+	}
+}
+
+//
+// Reading a reference to 100000 rows by 4 columns in blocks through xlCoerce
+//
+XLKIT_BENCHMARK(range_reader_100000x4) {
+	XLOPER12 ref;
+	ref.xltype = xltypeSRef;
+	ref.val.sref.count = 1;
+	ref.val.sref.ref.rwFirst = 0;
+	ref.val.sref.ref.rwLast = 99999;
+	ref.val.sref.ref.colFirst = 0;
+	ref.val.sref.ref.colLast = 3;
+	for (size_t i = 0; i < iterations; ++i) {
+		double sum = 0.0;
+		RangeReader reader(*xlOperandCast(&ref));
+		for (const RangeReader::Block& block : reader) {
+			for (const xlOperand12& x : block.cells())
+				sum += x.get<double>();
+		}
+		keep(sum);
+	}
+}
+
+//
+// Registration of all functions, XLKIT_BENCH_FUNCTIONS of them from above
+//
+XLKIT_BENCHMARK(attach) {
+	ExcelHost& host = ExcelHost::instance();
+	for (size_t i = 0; i < iterations; ++i)
+		host.attach();
+}
+
+// Nanoseconds per iteration of running b for the given iterations
+double
+measure(const Benchmark& b, size_t iterations) {
+	Clock::time_point start = Clock::now();
+	b.run(iterations);
+	double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+	return ns / double(iterations);
+}
+
+// Write s as a JSON string
+void
+printJson(const char* s) {
+	putchar('"');
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[]) {
+	const char* filter = "";
+	int repetitions = 5;
+	double min_time = 0.1;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "--repetitions") && i + 1 < argc) {
+			repetitions = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+			min_time = atof(argv[++i]);
+		} else {
+			fprintf(stderr, "Usage: %s [--filter TEXT] [--repetitions N] "
+					"[--min-time SECONDS]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("{\"xlkit_version\":\"%d.%d.%d\",\"compiler\":",
+		   XLKIT_MAJOR_VERSION, XLKIT_MINOR_VERSION, XLKIT_PATCH_VERSION);
+	printJson(__VERSION__);
+	printf(",\"bench_functions\":%d,\"repetitions\":%d}\n",
+		   XLKIT_BENCH_FUNCTIONS, repetitions);
+
+	for (const Benchmark& b : benchmarks()) {
+		if (!strstr(b.name, filter))
+			continue;
+
+		// Find the number of iterations taking min_time per repetition
+		size_t iterations = 1;
+		double ns = measure(b, iterations);
+		while (ns * double(iterations) < 1e9 * min_time) {
+			double scale = (ns > 0 ? 1e9 * min_time / (ns * double(iterations)) : 10.0);
+			iterations = size_t(double(iterations) * std::min(10.0, std::max(2.0, scale * 1.2)));
+			ns = measure(b, iterations);
+		}
+
+		std::vector<double> times;
+		for (int r = 0; r < repetitions; ++r)
+			times.push_back(measure(b, iterations));
+		std::sort(times.begin(), times.end());
+
+		printf("{\"name\":");
+		printJson(b.name);
+		printf(",\"iterations\":%zu,\"ns_per_op\":%.2f,\"min_ns_per_op\":%.2f,"
+			   "\"max_ns_per_op\":%.2f}\n",
+			   iterations, times[times.size() / 2], times.front(), times.back());
+		fflush(stdout);
+	}
+	return 0;
+}
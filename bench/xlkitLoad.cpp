@@ -0,0 +1,488 @@
+/// @file xlkitLoad.cpp
+///
+/// @brief Multithreaded recalculation load generator, run against the mock Excel host
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Usage: xlkitLoad [--threads N,N,...] [--duration SECONDS] [--rows R]
+//                  [--cols C] [--filter TEXT] [--per-function]
+//
+// Load generator which drives every thread-safe function in the Registry
+// from N threads at once, as Excel's multithreaded recalculation does. The
+// functions of an add-in are loaded by linking its sources into this
+// program (LOAD_SOURCES in the Makefile); the operands for each function
+// are synthesized from its Excel type string. The sources are compiled
+// with bench/xlInvoke.hpp force-included, which generates a thunk for
+// calling each registered function.
+//
+// Prints one JSON object per line: a header, a line for each skipped
+// function, and a line for each thread count with the throughput, the
+// latency percentiles and the scaling relative to a single thread. With
+// --per-function, the latency of each function is reported as well.
+
+#include <xlkit/xlkit.hpp>
+
+#include "xlInvoke.hpp"
+#include "xlMockExcel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Entry points of the XLL which Excel calls, defined in xlkit.cpp
+int __stdcall xlAutoOpen();
+int __stdcall xlAutoClose();
+void __stdcall xlAutoFree(LPXLOPER pxFree);
+void __stdcall xlAutoFree12(LPXLOPER12 pxFree);
+
+namespace {
+
+using namespace xlkit;
+
+typedef std::chrono::steady_clock Clock;
+
+// Histogram of latencies with 8 buckets per power of two of nanoseconds,
+// so percentiles are within 1/8 of their true value
+class Latencies {
+  public:
+	enum { SUB_BITS = 3, NUM_BUCKETS = 64 << SUB_BITS };
+
+	Latencies() : myBuckets(NUM_BUCKETS, 0), myCount(0), myMaxNs(0) { }
+
+	void add(uint64_t ns) {
+		++myBuckets[bucket(ns)];
+		++myCount;
+		myMaxNs = std::max(myMaxNs, ns);
+	}
+
+	void merge(const Latencies& other) {
+		for (int i = 0; i < NUM_BUCKETS; ++i)
+			myBuckets[i] += other.myBuckets[i];
+		myCount += other.myCount;
+		myMaxNs = std::max(myMaxNs, other.myMaxNs);
+	}
+
+	uint64_t count() const {
+		return myCount;
+	}
+	uint64_t maxNs() const {
+		return myMaxNs;
+	}
+
+	// Upper bound of the latency of the given fraction of the calls
+	uint64_t percentileNs(double fraction) const {
+		uint64_t rank = uint64_t(fraction * double(myCount));
+		uint64_t seen = 0;
+		for (int i = 0; i < NUM_BUCKETS; ++i) {
+			seen += myBuckets[i];
+			if (seen > rank)
+				return std::min(upperBound(i), myMaxNs);
+		}
+		return myMaxNs;
+	}
+
+  private:
+	static int bucket(uint64_t ns) {
+		if (ns < (1u << SUB_BITS))
+			return int(ns);
+		int exp = 63 - __builtin_clzll(ns);
+		int sub = int(ns >> (exp - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+		return ((exp - SUB_BITS + 1) << SUB_BITS) + sub;
+	}
+	static uint64_t upperBound(int i) {
+		if (i < (1 << SUB_BITS))
+			return uint64_t(i);
+		int exp = (i >> SUB_BITS) + SUB_BITS - 1;
+		uint64_t sub = uint64_t(i & ((1 << SUB_BITS) - 1));
+		return ((uint64_t(1) << SUB_BITS) + sub + 1) << (exp - SUB_BITS);
+	}
+
+	std::vector<uint64_t> myBuckets;
+	uint64_t myCount;
+	uint64_t myMaxNs;
+};
+
+// Type codes of the result and arguments of a function, parsed from its
+// Excel type string such as "QBC%$"
+std::vector<std::string>
+typeCodes(const char* types) {
+	std::vector<std::string> codes;
+	for (const char* t = types; *t && *t != '$' && *t != '#' && *t != '!'; ++t) {
+		if (*t == '%' && !codes.empty())
+			codes.back() += '%';
+		else
+			codes.push_back(std::string(1, *t));
+	}
+	return codes;
+}
+
+bool
+isThreadSafe(const char* types) {
+	return strchr(types, '$') != NULL;
+}
+
+// Reason why the arguments of a function can't be synthesized, or NULL
+const char*
+unsupportedReason(const FunctionInfo& info) {
+	if (!isThreadSafe(info.types))
+		return "not thread-safe";
+	if (!xlmock::findInvoke(&info))
+		return "not compiled with bench/xlInvoke.hpp";
+	std::vector<std::string> codes = typeCodes(info.types);
+	if (int(codes.size()) != info.numArgs + 1)
+		return "unknown type string";
+	for (size_t i = 1; i < codes.size(); ++i) {
+		const std::string& c = codes[i];
+		if (c == "X")
+			return "asynchronous";
+		if (c != "B" && c != "H" && c != "I" && c != "J" && c != "C" && c != "C%"
+				&& c != "P" && c != "Q" && c != "U" && c != "K" && c != "K%")
+			return "unsupported argument type";
+	}
+	return NULL;
+}
+
+// Argument values of one function for one thread, laid out as Excel passes
+// them to the function's xlmock::InvokeFn thunk
+class Arguments {
+  public:
+	Arguments(const FunctionInfo& info, int rows, int cols, int seed) {
+		std::vector<std::string> codes = typeCodes(info.types);
+		myValues.resize(codes.size() - 1);
+		myArgs.resize(codes.size() - 1);
+		for (size_t i = 1; i < codes.size(); ++i)
+			myArgs[i - 1] = make(codes[i], myValues[i - 1], rows, cols, seed + int(i));
+	}
+
+	const void* const* args() const {
+		return myArgs.empty() ? NULL : &myArgs[0];
+	}
+
+  private:
+	// Value of an argument passed in a single register
+	union Value {
+		double		num;
+		uint16_t	u16;
+		int16_t		i16;
+		int32_t		i32;
+		const void*	ptr;
+	};
+
+	const void* make(const std::string& code, Value& v, int rows, int cols, int seed) {
+		double x = 1.0 + double(seed % 97);
+		if (code == "B") {
+			v.num = x;
+		} else if (code == "H") {
+			v.u16 = uint16_t(seed);
+		} else if (code == "I") {
+			v.i16 = int16_t(seed);
+		} else if (code == "J") {
+			v.i32 = int32_t(seed);
+		} else if (code == "C") {
+			myStrings.push_back("xlkit");
+			v.ptr = myStrings.back().c_str();
+		} else if (code == "C%") {
+			myWideStrings.push_back(std::basic_string<XCHAR>(5, XCHAR('x')));
+			v.ptr = myWideStrings.back().c_str();
+		} else if (code == "P") {
+			myOpers.push_back(matrix<xlOperand>(rows, cols, x));
+			v.ptr = &myOpers.back();
+		} else if (code == "Q" || code == "U") {
+			myOpers12.push_back(matrix<xlOperand12>(rows, cols, x));
+			v.ptr = &myOpers12.back();
+		} else if (code == "K") {
+			v.ptr = fpArray<FP>(rows, cols, x);
+		} else if (code == "K%") {
+			v.ptr = fpArray<FP12>(rows, cols, x);
+		}
+		return &v;
+	}
+
+	template <typename OPER>
+	static OPER matrix(int rows, int cols, double x) {
+		if (rows == 1 && cols == 1)
+			return OPER(x);
+		OPER m;
+		typename OPER::CellMatrixRef cells(m.setMatrix(rows, cols));
+		for (int i = 0; i < rows; ++i)
+			for (int j = 0; j < cols; ++j)
+				cells(i, j).set(x + double(i * cols + j));
+		return m;
+	}
+
+	template <typename FP_T>
+	FP_T* fpArray(int rows, int cols, double x) {
+		size_t bytes = xlFpArrayT<FP_T>::byteSize(rows, cols);
+		myArrays.push_back(std::vector<double>((bytes + sizeof(double) - 1) / sizeof(double)));
+		FP_T* fp = reinterpret_cast<FP_T*>(&myArrays.back()[0]);
+		fp->rows = rows;
+		fp->columns = cols;
+		for (int i = 0; i < rows * cols; ++i)
+			fp->array[i] = x + double(i);
+		return fp;
+	}
+
+	std::vector<Value> myValues;
+	std::vector<const void*> myArgs;
+	// Storage of the values which are passed by pointer
+	std::deque<std::string> myStrings;
+	std::deque< std::basic_string<XCHAR> > myWideStrings;
+	std::deque<xlOperand> myOpers;
+	std::deque<xlOperand12> myOpers12;
+	std::deque< std::vector<double> > myArrays;
+};
+
+// Function driven by the load generator
+struct Target {
+	const FunctionInfo* info;
+	xlmock::InvokeFn invoke;
+	std::string result;		// type code of the result
+};
+
+// Results of one worker thread
+struct WorkerResult {
+	Latencies all;
+	std::vector<Latencies> functions;
+	uint64_t errors;
+};
+
+// Release the result of a call like Excel does, returning true if it is an
+// Excel error value
+template <typename XLOPER_T>
+bool
+releaseResult(XLOPER_T* x, void (__stdcall *autoFree)(XLOPER_T*)) {
+	if (!x)
+		return true;
+	bool error = ((x->xltype & ~(xlbitDLLFree | xlbitXLFree)) == xltypeErr);
+	if (x->xltype & xlbitDLLFree)
+		autoFree(x);
+	return error;
+}
+
+void
+runWorker(const std::vector<Target>& targets, int index, int rows, int cols,
+		  const std::atomic<bool>& start, const std::atomic<bool>& stop,
+		  WorkerResult& out) {
+	// Like Excel's recalculation threads, each thread has its own operands
+	std::vector< std::unique_ptr<Arguments> > args;
+	for (size_t f = 0; f < targets.size(); ++f)
+		args.emplace_back(new Arguments(*targets[f].info, rows, cols, index * 31 + int(f)));
+	out.functions.assign(targets.size(), Latencies());
+	out.errors = 0;
+
+	while (!start.load(std::memory_order_acquire))
+		std::this_thread::yield();
+
+	size_t f = size_t(index) % targets.size();
+	while (!stop.load(std::memory_order_relaxed)) {
+		const Target& t = targets[f];
+		double result[2] = { 0.0, 0.0 };
+
+		Clock::time_point begin = Clock::now();
+		t.invoke(args[f]->args(), result);
+		uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+								   Clock::now() - begin).count());
+		out.all.add(ns);
+		out.functions[f].add(ns);
+
+		void* ptr;
+		memcpy(&ptr, result, sizeof(ptr));
+		if (t.result == "P")
+			out.errors += releaseResult(static_cast<LPXLOPER>(ptr), &xlAutoFree);
+		else if (t.result == "Q")
+			out.errors += releaseResult(static_cast<LPXLOPER12>(ptr), &xlAutoFree12);
+		else if (t.result == "K" || t.result == "K%")
+			out.errors += (ptr == NULL);
+
+		if (++f == targets.size())
+			f = 0;
+	}
+}
+
+// Write s as a JSON string
+void
+printJson(const char* s) {
+	putchar('"');
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+void
+printLatencies(const Latencies& l) {
+	printf("\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+		   "\"max_ns\":%llu",
+		   (unsigned long long)l.percentileNs(0.5),
+		   (unsigned long long)l.percentileNs(0.9),
+		   (unsigned long long)l.percentileNs(0.99),
+		   (unsigned long long)l.percentileNs(0.999),
+		   (unsigned long long)l.maxNs());
+}
+
+std::vector<int>
+parseThreads(const char* s) {
+	std::vector<int> threads;
+	while (*s) {
+		char* end;
+		long n = strtol(s, &end, 10);
+		if (end == s)
+			break;
+		if (n > 0)
+			threads.push_back(int(n));
+		s = (*end == ',') ? end + 1 : end;
+	}
+	return threads;
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[]) {
+	std::vector<int> threads;
+	double duration = 1.0;
+	int rows = 10, cols = 10;
+	const char* filter = "";
+	bool per_function = false;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = parseThreads(argv[++i]);
+		} else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+			duration = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--rows") && i + 1 < argc) {
+			rows = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--cols") && i + 1 < argc) {
+			cols = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (!strcmp(argv[i], "--per-function")) {
+			per_function = true;
+		} else {
+			fprintf(stderr, "Usage: %s [--threads N,N,...] [--duration SECONDS] "
+					"[--rows R] [--cols C] [--filter TEXT] [--per-function]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads.empty()) {
+		int cores = std::max(1, int(std::thread::hardware_concurrency()));
+		for (int n = 1; n < cores; n *= 2)
+			threads.push_back(n);
+		threads.push_back(cores);
+	}
+
+	// Excel opens the XLL on its main thread before calculating
+	xlAutoOpen();
+
+	std::vector<Target> targets;
+	std::vector< std::pair<const FunctionInfo*, const char*> > skipped;
+	for (const FunctionInfo* info : Registry::instance().functionInfos()) {
+		if (!strstr(info->excelName, filter))
+			continue;
+		if (const char* reason = unsupportedReason(*info)) {
+			skipped.push_back(std::make_pair(info, reason));
+			continue;
+		}
+		Target t = { info, xlmock::findInvoke(info), typeCodes(info->types)[0] };
+		targets.push_back(t);
+	}
+
+	printf("{\"xlkit_version\":\"%d.%d.%d\",\"compiler\":",
+		   XLKIT_MAJOR_VERSION, XLKIT_MINOR_VERSION, XLKIT_PATCH_VERSION);
+	printJson(__VERSION__);
+	printf(",\"functions\":%d,\"skipped\":%d,\"duration_s\":%g,\"rows\":%d,\"cols\":%d}\n",
+		   int(targets.size()), int(skipped.size()), duration, rows, cols);
+	for (size_t i = 0; i < skipped.size(); ++i) {
+		printf("{\"skipped\":");
+		printJson(skipped[i].first->excelName);
+		printf(",\"reason\":");
+		printJson(skipped[i].second);
+		printf("}\n");
+	}
+	if (targets.empty()) {
+		xlAutoClose();
+		return 0;
+	}
+
+	double base_throughput = 0.0;
+	for (int n : threads) {
+		std::atomic<bool> start(false), stop(false);
+		std::vector<WorkerResult> results(n);
+		std::vector<std::thread> workers;
+		for (int i = 0; i < n; ++i) {
+			workers.emplace_back(runWorker, std::cref(targets), i, rows, cols,
+								 std::cref(start), std::cref(stop), std::ref(results[i]));
+		}
+
+		Clock::time_point begin = Clock::now();
+		start.store(true, std::memory_order_release);
+		std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+		stop.store(true, std::memory_order_relaxed);
+		for (std::thread& w : workers)
+			w.join();
+		double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+		Latencies all;
+		std::vector<Latencies> functions(targets.size());
+		uint64_t errors = 0;
+		for (const WorkerResult& r : results) {
+			all.merge(r.all);
+			for (size_t f = 0; f < targets.size(); ++f)
+				functions[f].merge(r.functions[f]);
+			errors += r.errors;
+		}
+
+		double throughput = double(all.count()) / elapsed;
+		if (base_throughput == 0.0)
+			base_throughput = throughput / double(n);
+		printf("{\"threads\":%d,\"calls\":%llu,\"errors\":%llu,\"calls_per_s\":%.0f,"
+			   "\"scaling\":%.3f,",
+			   n, (unsigned long long)all.count(), (unsigned long long)errors,
+			   throughput, throughput / (base_throughput * double(n)));
+		printLatencies(all);
+		printf("}\n");
+
+		if (per_function) {
+			for (size_t f = 0; f < targets.size(); ++f) {
+				printf("{\"threads\":%d,\"function\":", n);
+				printJson(targets[f].info->excelName);
+				printf(",\"calls\":%llu,", (unsigned long long)functions[f].count());
+				printLatencies(functions[f]);
+				printf("}\n");
+			}
+		}
+		fflush(stdout);
+	}
+
+	xlAutoClose();
+	return 0;
+}
@@ -74,7 +74,13 @@ For more information, please refer to <http://unlicense.org>
 #include <xlkit/xlkit.hpp>
 
 // Includes used by example function code
+#include <xlkit/xlChangeTracker.hpp>
+#include <xlkit/xlRangeReader.hpp>
+#include <xlkit/xlReduce.hpp>
+#include <chrono>
+#include <memory>
 #include <stdio.h>
+#include <thread>
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -97,8 +103,10 @@ xlCirc(double diameter)
 	XLKIT_END_FUNCTION(double)
 }
 
-// Register your function for the XLL
-XLKIT_REGISTER(xlCirc, "Compute circle circumference")
+// Register your function for the XLL. Functions which don't keep shared
+// state can use XLKIT_REGISTER_THREADSAFE() instead so that Excel may call
+// them from multiple threads during recalculation.
+XLKIT_REGISTER_THREADSAFE(xlCirc, "Compute circle circumference")
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -128,32 +136,28 @@ xlStats(xlParmDataRange cells)
 	// to Excel.
 	xlResultOperandPtr result;
 
-	double sum = 0.0;
-	double sum_of_squares = 0.0;
-
-	// Iterate over the cells in the incoming matrix.
+	// Every cell in the incoming matrix must be a number, including blank
+	// cells. xlkit::moments() skips the cells which aren't numbers, like
+	// Excel's AVERAGE() and VAR.P(), so check them first.
 	xlConstCellMatrixRef src(cells.value()->get<xlConstCellMatrixRef>());
-	for (int i = 0; i < src.rows(); ++i)
-	{
-		for (int j = 0; j < src.cols(); ++j)
-		{
-			double x = src(i, j).get<double>();
-			sum += x;
-			sum_of_squares += x*x;
-		}
+	for (const xlOperand& cell : src) {
+		if (!cell.isDouble() && !cell.isInteger())
+			XLKIT_THROW("All cells must be numbers");
 	}
 
+	// The reductions in xlReduce.hpp are vectorized and give the same result
+	// regardless of the CPU or number of threads used.
+	xlkit::Moments stats = xlkit::moments(src);
+
 	// Avoid divide by zero
-	int num_items = src.rows() * src.cols();
-	if (num_items == 0)
+	if (stats.count == 0)
 		XLKIT_THROW("Can't calculate stats on empty range");
 
 	// Create reference to an output results matrix of size 1x2
 	xlCellMatrixRef mat(result->setMatrix(1, 2));
 
-	double average = sum / num_items;
-	mat(0, 0).set(average);
-	mat(0, 1).set(sum_of_squares / num_items - average * average);
+	mat(0, 0).set(stats.mean);
+	mat(0, 1).set(stats.variance());
 
 	return result;
 
@@ -179,3 +183,156 @@ xlMatrixRef(xlParmDataRange cells)
 	XLKIT_END_FUNCTION(xlResultOperandPtr)
 }
 XLKIT_REGISTER(xlMatrixRef, "Reference a cell range")
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Same as xlMatrixRef, but using XLOPER12 operands which are available from
+// Excel 2007 onwards. These support up to the full 1048576x16384 grid and
+// strings with up to 32767 characters.
+//
+XLKIT_PARM(const xlOperand12*, DataRange12, "Cell range")
+
+xlOperand12* XLKIT_API
+xlMatrixRef12(xlParmDataRange12 cells)
+{
+	XLKIT_BEGIN_FUNCTION
+
+	xlResultOperand12Ptr result;
+	result->set(cells.value()->get<xlConstCellMatrixRef12>());
+	return result;
+
+	XLKIT_END_FUNCTION(xlResultOperand12Ptr)
+}
+XLKIT_REGISTER(xlMatrixRef12, "Reference a cell range using XLOPER12")
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Same as xlStats, but taking and returning arrays of numbers. Excel converts
+// the input range directly into a contiguous array of doubles, which avoids
+// any per-cell type checking. The result is returned as an FP*, which must be
+// provided by an xlResultFpArrayPtr.
+//
+XLKIT_PARM(xlFpArray, NumberRange, "Cell range of numbers")
+
+FP* XLKIT_API
+xlStatsFp(xlParmNumberRange numbers)
+{
+	XLKIT_BEGIN_FUNCTION
+
+	const xlFpArray& src = numbers.value();
+	if (src.empty())
+		XLKIT_THROW("Can't calculate stats on empty range");
+
+	xlkit::Moments stats = xlkit::moments(src);
+
+	// Create the 1x2 output array
+	xlResultFpArrayPtr result(1, 2);
+
+	(*result)(0, 0) = stats.mean;
+	(*result)(0, 1) = stats.variance();
+
+	return result;
+
+	XLKIT_END_FUNCTION(xlResultFpArrayPtr)
+}
+XLKIT_REGISTER(xlStatsFp, "Compute mean and variance of an array of numbers")
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Sum of a large range that only rescans the blocks of rows which changed
+// since the last call from the same cell. The ChangeTracker keeps a hash and
+// the partial sum of each block of rows for every calling cell.
+//
+static xlkit::ChangeTracker<double> theSumTracker;
+
+double XLKIT_API
+xlTrackedSum(xlParmNumberRange numbers)
+{
+	XLKIT_BEGIN_FUNCTION
+
+	const xlFpArray& src = numbers.value();
+	xlkit::ChangeTracker<double>::Changes changes;
+	theSumTracker.update(0, src, changes);
+
+	// Update the partial sums of the changed blocks
+	for (int b : changes.blocks()) {
+		size_t first = size_t(changes.rowBegin(b)) * src.cols();
+		size_t last = size_t(changes.rowEnd(b)) * src.cols();
+		changes.data(b) = xlkit::sum(src.data() + first, last - first);
+	}
+	changes.commit();
+
+	double total = 0.0;
+	for (int b = 0; b < changes.numBlocks(); ++b)
+		total += changes.data(b);
+	return total;
+
+	XLKIT_END_FUNCTION(double)
+}
+XLKIT_REGISTER_THREADSAFE(xlTrackedSum, "Sum an array of numbers, rescanning only changed rows")
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Count the numbers in a range reference of any size, such as whole columns.
+// An xlRefOperand12Ptr receives the reference itself, and xlRangeReader
+// reads its values from Excel in blocks of rows so that only one block is
+// held at a time. The reader refers to the argument, so it must not be kept
+// beyond the call.
+//
+// If the range refers to cells which are not calculated yet, reading throws
+// and the function returns an error. Excel calls it again once those cells
+// are calculated, so the error may only show during the first recalculation.
+//
+XLKIT_PARM(xlRefOperand12Ptr, Range, "Cell range reference")
+
+double XLKIT_API
+xlCountNumbers(xlParmRange range)
+{
+	XLKIT_BEGIN_FUNCTION
+
+	double count = 0;
+	xlRangeReader reader(*range.value());
+	for (const xlRangeReader::Block& block : reader) {
+		for (const xlOperand12& x : block.cells())
+			count += x.isDouble();
+	}
+	return count;
+
+	XLKIT_END_FUNCTION(double)
+}
+XLKIT_REGISTER(xlCountNumbers, "Count the numbers in a range reference. The first "
+			   "recalculation may show an error until the referenced cells are calculated")
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Example of an asynchronous function (Excel 2010+). It returns void and
+// takes an xlAsyncHandle. The work is submitted to xlkit's worker threads,
+// and Excel keeps calculating other cells until the result is returned.
+//
+XLKIT_PARM(double, Seconds, "Number of seconds to wait")
+XLKIT_PARM(const xlOperand12*, Value, "Value to return after waiting")
+
+void XLKIT_API
+xlAsyncWait(xlParmSeconds seconds, xlParmValue value, xlAsyncHandle handle)
+{
+	XLKIT_BEGIN_FUNCTION
+
+	// The task runs after this function returns, so capture inputs by value.
+	// submit() copies the captured operands out of the call arena, but the
+	// value is shared through a pointer so that copies of the task don't
+	// copy it, and must be promoted first.
+	double secs = seconds.value();
+	std::shared_ptr<xlOperand12> result_value = std::make_shared<xlOperand12>(*value.value());
+	result_value->promote();
+	handle.submit([secs, result_value](xlOperand12& result) {
+		std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+		result = *result_value;
+	});
+
+	// Errors are returned through the handle instead of the return value
+	XLKIT_END_ASYNC_FUNCTION(handle)
+}
+XLKIT_REGISTER(xlAsyncWait, "Wait for the given number of seconds")
@@ -0,0 +1,120 @@
+/// @file xlArena.hpp
+///
+/// @brief Per-call arena allocator used for temporary operand memory
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLARENA_HPP
+#define XLKIT_XLARENA_HPP
+
+#include <xlkit/xlException.hpp>
+#include <xlkit/xlversion.hpp>
+
+#include <stddef.h>
+
+/// Maximum number of bytes the call arena of each thread keeps allocated
+/// between calls. A call that needs more frees the excess when the next
+/// call starts.
+#ifndef XLKIT_ARENA_MAX_RETAINED_BYTES
+#define XLKIT_ARENA_MAX_RETAINED_BYTES (1024 * 1024)
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// Thread-local bump allocator for memory that only needs to live until the
+/// next Excel function call on the same thread.
+///
+/// When XLKIT_USE_CALL_ARENA is defined before including xlkit.hpp, the
+/// XLKIT_BEGIN_FUNCTION macro activates the arena for the duration of the
+/// function. Entering an outermost function call rewinds the arena, releasing
+/// everything allocated by the previous call in one step. While the arena is
+/// active, strings and cell matrices created by xlOperand allocate from it
+/// instead of using ::malloc. Such values are not marked with xlbitDLLFree,
+/// so Excel will not call xlAutoFree on results that use them.
+///
+/// @note Operands that must outlive the current call (eg. those stored in
+/// static variables) must be promoted to durable memory with
+/// xlOper4::promote() after being set.
+class CallArena {
+  public:
+	/// Returns true if allocations are currently being made from the arena
+	static bool active();
+
+	/// Allocate bytes from the arena, aligned to 16 bytes. Returns NULL if
+	/// the arena is not active.
+	static void* allocate(size_t bytes);
+
+	/// Allocate scratch memory for n objects of type T, which must be
+	/// trivially destructible as no destructors will be run.
+	template <typename T>
+	static T* allocateArray(size_t n) {
+		void* p = allocate(n * sizeof(T));
+		if (!p)
+			XLKIT_THROW("Call arena is not active");
+		return reinterpret_cast<T*>(p);
+	}
+
+	/// Allocate bytes from the arena if owner points into memory owned by it,
+	/// even while it is paused. Returns NULL otherwise. Values stored inside
+	/// arena memory, like the cells of arena matrices, allocate with this as
+	/// nothing would ever free them individually.
+	static void* allocateFor(const void* owner, size_t bytes);
+
+	/// Returns true if p points into memory owned by this thread's arena
+	static bool owns(const void* p);
+
+	/// Number of bytes allocated from the arena since it was last rewound
+	static size_t bytesUsed();
+
+	/// Temporarily allocate from ::malloc while this object is in scope.
+	/// Values stored in arena memory, eg. cells of arena matrices, still
+	/// allocate from the arena.
+	class Pause {
+	  public:
+		Pause();
+		~Pause();
+	  private:
+		Pause(const Pause&);
+		Pause& operator=(const Pause&);
+	};
+};
+
+namespace detail {
+
+// Scope for a function call, see XLKIT_BEGIN_FUNCTION
+class CallArenaScope {
+  public:
+	CallArenaScope();
+	~CallArenaScope();
+  private:
+	CallArenaScope(const CallArenaScope&);
+	CallArenaScope& operator=(const CallArenaScope&);
+};
+
+} // namespace detail
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+#endif // XLKIT_XLARENA_HPP
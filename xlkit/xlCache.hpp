@@ -0,0 +1,515 @@
+/// @file xlCache.hpp
+///
+/// @brief Memoization of the results of pure XLL functions
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLCACHE_HPP
+#define XLKIT_XLCACHE_HPP
+
+#include <xlkit/xlkit.hpp>
+
+#include <boost/unordered_map.hpp>
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+#include <stdint.h>
+#include <string.h>
+
+/// Default maximum number of results cached for each function
+#ifndef XLKIT_CACHE_ENTRIES
+#define XLKIT_CACHE_ENTRIES 4096
+#endif
+
+/// Default maximum number of bytes of keys and results cached for each
+/// function
+#ifndef XLKIT_CACHE_BYTES
+#define XLKIT_CACHE_BYTES (64u << 20)
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// Counters of a ResultCache
+struct CacheStats {
+	uint64_t	hits;		///< Calls answered from the cache
+	uint64_t	misses;		///< Calls that ran the function
+	uint64_t	evictions;	///< Results dropped to stay within the limits
+	size_t		entries;	///< Results currently cached
+	size_t		bytes;		///< Bytes currently used by keys and results
+};
+
+namespace detail {
+
+// Tags identifying the type of each value in a cache key
+enum CacheKeyTag {
+	KEY_NUM = 1, KEY_INT, KEY_BOOL, KEY_ERR, KEY_STR, KEY_MISSING, KEY_NIL,
+	KEY_MATRIX, KEY_FP, KEY_NULL
+};
+
+// Append the bytes of a trivially copyable value to key
+template <typename T>
+inline void
+appendRaw(std::string& key, const T& v) {
+	key.append(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+inline void
+appendTag(std::string& key, CacheKeyTag tag) {
+	key.push_back(char(tag));
+}
+
+inline void
+appendString(std::string& key, const void* str, size_t len, size_t char_size) {
+	appendTag(key, KEY_STR);
+	appendRaw(key, uint32_t(len));
+	key.append(static_cast<const char*>(str), len * char_size);
+}
+
+inline xlStringRef
+operandString(const xlOperand& x) {
+	return x.get<xlStringRef>();
+}
+inline xlStringRef12
+operandString(const xlOperand12& x) {
+	return x.get<xlStringRef12>();
+}
+
+// Append the value of a cell. Returns false for references and other values
+// whose result may change without the operand changing.
+template <typename OPERAND_T>
+inline bool
+appendCell(std::string& key, const OPERAND_T& x) {
+	if (x.isDouble()) {
+		appendTag(key, KEY_NUM);
+		appendRaw(key, x.template get<double>());
+	} else if (x.isString()) {
+		auto str = operandString(x);
+		appendString(key, str.data(), str.size(), sizeof(str[0]));
+	} else if (x.isInteger()) {
+		appendTag(key, KEY_INT);
+		appendRaw(key, int32_t(x.template get<int>()));
+	} else if (x.isBool()) {
+		appendTag(key, KEY_BOOL);
+		key.push_back(x.template get<bool>() ? 1 : 0);
+	} else if (x.isError()) {
+		appendTag(key, KEY_ERR);
+		appendRaw(key, int32_t(x.template get<xlError>().num));
+	} else if (x.isMissing()) {
+		appendTag(key, KEY_MISSING);
+	} else if (x.isNil()) {
+		appendTag(key, KEY_NIL);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+template <typename OPERAND_T>
+inline bool
+appendOperand(std::string& key, const OPERAND_T* x) {
+	if (!x) {
+		appendTag(key, KEY_NULL);
+		return true;
+	}
+	if (!x->isCellMatrix())
+		return appendCell(key, *x);
+	typename OPERAND_T::ConstCellMatrixRef m
+		= x->template get<typename OPERAND_T::ConstCellMatrixRef>();
+	appendTag(key, KEY_MATRIX);
+	appendRaw(key, int32_t(m.rows()));
+	appendRaw(key, int32_t(m.cols()));
+	for (const OPERAND_T& cell : m) {
+		if (!appendCell(key, cell))
+			return false;
+	}
+	return true;
+}
+
+template <typename FP_T>
+inline bool
+appendFpArray(std::string& key, const xlFpArrayT<FP_T>& a) {
+	appendTag(key, KEY_FP);
+	appendRaw(key, int32_t(a.rows()));
+	appendRaw(key, int32_t(a.cols()));
+	if (!a.empty())
+		key.append(reinterpret_cast<const char*>(a.data()), a.size() * sizeof(double));
+	return true;
+}
+
+// Append a function argument to key, returning false if the call can't be
+// cached
+template <typename T>
+inline typename std::enable_if<std::is_arithmetic<T>::value, bool>::type
+appendKey(std::string& key, T v) {
+	appendRaw(key, v);
+	return true;
+}
+inline bool
+appendKey(std::string& key, const char* str) {
+	if (!str)
+		appendTag(key, KEY_NULL);
+	else
+		appendString(key, str, ::strlen(str), 1);
+	return true;
+}
+inline bool
+appendKey(std::string& key, const XCHAR* str) {
+	if (!str) {
+		appendTag(key, KEY_NULL);
+	} else {
+		size_t len = 0;
+		while (str[len])
+			++len;
+		appendString(key, str, len, sizeof(XCHAR));
+	}
+	return true;
+}
+inline bool
+appendKey(std::string& key, const xlOperand* x) {
+	return appendOperand(key, x);
+}
+inline bool
+appendKey(std::string& key, const xlOperand12* x) {
+	return appendOperand(key, x);
+}
+inline bool
+appendKey(std::string& key, const RefOperand12Ptr& x) {
+	return appendOperand(key, static_cast<const xlOperand12*>(x));
+}
+inline bool
+appendKey(std::string& key, FP* fp) {
+	return appendFpArray(key, xlFpArray(fp));
+}
+inline bool
+appendKey(std::string& key, FP12* fp) {
+	return appendFpArray(key, xlFpArray12(fp));
+}
+template <typename FP_T>
+inline bool
+appendKey(std::string& key, const xlFpArrayT<FP_T>& a) {
+	return appendFpArray(key, a);
+}
+template <typename T, typename PARM_HELP>
+inline bool
+appendKey(std::string& key, const Parm<T, PARM_HELP>& parm) {
+	return appendKey(key, parm.value());
+}
+
+inline bool
+appendKeys(std::string&) {
+	return true;
+}
+template <typename T, typename... REST>
+inline bool
+appendKeys(std::string& key, const T& arg, const REST&... rest) {
+	return appendKey(key, arg) && appendKeys(key, rest...);
+}
+
+// Approximate number of bytes owned by an operand
+template <typename OPERAND_T>
+inline size_t
+operandBytes(const OPERAND_T& x) {
+	size_t bytes = sizeof(OPERAND_T);
+	if (x.isString()) {
+		bytes += (operandString(x).size() + 1) * sizeof(operandString(x)[0]);
+	} else if (x.isCellMatrix()) {
+		for (const OPERAND_T& cell : x.template get<typename OPERAND_T::ConstCellMatrixRef>())
+			bytes += operandBytes(cell);
+	}
+	return bytes;
+}
+
+// How results of type R are kept in the cache
+template <typename R, typename ENABLE = void>
+struct CachedResult {
+	static_assert(unimplemented<R>::value,
+				  "Only number and cell results can be cached");
+};
+template <typename R>
+struct CachedResult<R, typename std::enable_if<std::is_arithmetic<R>::value>::type> {
+	typedef R Value;
+	static bool store(R result, Value& value, size_t& bytes) {
+		value = result;
+		bytes = sizeof(R);
+		return true;
+	}
+	static R load(const Value& value) {
+		return value;
+	}
+};
+// Cell results are copied from and to the thread-local ResultOperandPtr
+template <typename R, typename RESULT_PTR, typename OPERAND_T>
+struct CachedOperandResult {
+	typedef OPERAND_T Value;
+	// The copy must not use the CallArena as it outlives the call
+	static bool store(R result, Value& value, size_t& bytes) {
+		const OPERAND_T* x = result;
+		if (!x)
+			return false;
+		CallArena::Pause pause;
+		value = *x;
+		value.promote();
+		bytes = operandBytes(value);
+		return true;
+	}
+	// Large matrices are shared with the result instead of being copied
+	static R load(const Value& value) {
+		RESULT_PTR result(value);
+		return result;
+	}
+};
+template <>
+struct CachedResult<xlOperand*>
+	: public CachedOperandResult<xlOperand*, ResultOperandPtr, xlOperand> {
+};
+template <>
+struct CachedResult<ResultOperandPtr>
+	: public CachedOperandResult<ResultOperandPtr, ResultOperandPtr, xlOperand> {
+};
+template <>
+struct CachedResult<xlOperand12*>
+	: public CachedOperandResult<xlOperand12*, ResultOperand12Ptr, xlOperand12> {
+};
+template <>
+struct CachedResult<ResultOperand12Ptr>
+	: public CachedOperandResult<ResultOperand12Ptr, ResultOperand12Ptr, xlOperand12> {
+};
+
+} // namespace detail
+
+/// Bounded LRU cache of the results of a function returning R, keyed by the
+/// values of its arguments. All methods are thread-safe.
+/// @see XLKIT_REGISTER_CACHED
+template <typename R>
+class ResultCache {
+  public:
+	typedef detail::CachedResult<R> Traits;
+
+	/// Construct a cache holding at most max_entries results and max_bytes
+	/// bytes of keys and results
+	explicit ResultCache(size_t max_entries = XLKIT_CACHE_ENTRIES,
+						 size_t max_bytes = XLKIT_CACHE_BYTES)
+		: myMaxEntries(max_entries)
+		, myMaxBytes(max_bytes)
+		, myBytes(0)
+		, myHits(0)
+		, myMisses(0)
+		, myEvictions(0) {
+	}
+
+	/// Set the limits, evicting the least recently used results as needed
+	void setLimits(size_t max_entries, size_t max_bytes) {
+		std::lock_guard<std::mutex> lock(myMutex);
+		myMaxEntries = max_entries;
+		myMaxBytes = max_bytes;
+		evict();
+	}
+
+	/// Remove all results
+	void clear() {
+		std::lock_guard<std::mutex> lock(myMutex);
+		myIndex.clear();
+		myLru.clear();
+		myBytes = 0;
+	}
+
+	/// Current counters
+	CacheStats stats() const {
+		std::lock_guard<std::mutex> lock(myMutex);
+		CacheStats s;
+		s.hits = myHits;
+		s.misses = myMisses;
+		s.evictions = myEvictions;
+		s.entries = myLru.size();
+		s.bytes = myBytes;
+		return s;
+	}
+
+	/// Look up the result for key with the given hash. Returns true and sets
+	/// result on a hit.
+	bool find(uint64_t hash, const std::string& key, R& result) {
+		std::lock_guard<std::mutex> lock(myMutex);
+		typename Index::iterator it = myIndex.find(hash);
+		// Entries are indexed by hash alone, so compare the full key. On a
+		// 64-bit hash collision, insert() replaces the other key's entry,
+		// which only costs that key a miss.
+		if (it == myIndex.end() || it->second->key != key) {
+			++myMisses;
+			return false;
+		}
+		++myHits;
+		myLru.splice(myLru.begin(), myLru, it->second);
+		result = Traits::load(it->second->value);
+		return true;
+	}
+
+	/// Store the result for key with the given hash
+	/// @note This replaces any entry with the same hash, even if its key is
+	/// different.
+	void insert(uint64_t hash, std::string&& key, R result) {
+		Entry entry;
+		entry.hash = hash;
+		entry.key = std::move(key);
+		if (!Traits::store(result, entry.value, entry.bytes))
+			return;
+		entry.bytes += sizeof(Entry) + entry.key.size();
+
+		std::lock_guard<std::mutex> lock(myMutex);
+		if (entry.bytes > myMaxBytes || myMaxEntries == 0)
+			return;
+		typename Index::iterator it = myIndex.find(hash);
+		if (it != myIndex.end()) {
+			myBytes -= it->second->bytes;
+			myLru.erase(it->second);
+			myIndex.erase(it);
+		}
+		myBytes += entry.bytes;
+		myLru.push_front(std::move(entry));
+		myIndex[hash] = myLru.begin();
+		evict();
+	}
+
+  private:
+	struct Entry {
+		uint64_t					hash;
+		std::string					key;
+		typename Traits::Value		value;
+		size_t						bytes;
+	};
+	typedef std::list<Entry> List;
+	typedef boost::unordered_map<uint64_t, typename List::iterator> Index;
+
+	// Called with myMutex locked
+	void evict() {
+		while (!myLru.empty()
+				&& (myLru.size() > myMaxEntries || myBytes > myMaxBytes)) {
+			Entry& last = myLru.back();
+			myBytes -= last.bytes;
+			myIndex.erase(last.hash);
+			myLru.pop_back();
+			++myEvictions;
+		}
+	}
+
+	size_t				myMaxEntries;
+	size_t				myMaxBytes;
+	size_t				myBytes;
+	uint64_t			myHits;
+	uint64_t			myMisses;
+	uint64_t			myEvictions;
+	List				myLru;
+	Index				myIndex;
+	mutable std::mutex	myMutex;
+
+	ResultCache(const ResultCache&);
+	ResultCache& operator=(const ResultCache&);
+};
+
+namespace detail {
+
+// Call func with args through cache. Calls with arguments that can't be
+// keyed, such as range references, always call func.
+template <typename R, typename... ARGS>
+R
+callCached(ResultCache<R>& cache, R (__stdcall *func)(ARGS...), ARGS... args) {
+	std::string key;
+	if (!appendKeys(key, args...))
+		return func(args...);
+	uint64_t hash = hashBytes(key.data(), key.size());
+	R result;
+	if (cache.find(hash, key, result))
+		return result;
+	result = func(args...);
+	cache.insert(hash, std::move(key), result);
+	return result;
+}
+
+} // namespace detail
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+/// @addtogroup macros Main Macros
+/// @{
+
+/// Define the ResultCache xlkit_cache_##FUNC and a function exported as
+/// FUNC##Cached which calls FUNC through it
+#define XLKIT_DEFINE_CACHED(FUNC) \
+			xlkit::ResultCache<xlkit::detail::Signature<decltype(&FUNC)>::Result> \
+				xlkit_cache_##FUNC; \
+			template <typename F> \
+			struct FUNC##CachedCall; \
+			template <typename R, typename... ARGS> \
+			struct FUNC##CachedCall<R (XLKIT_API *)(ARGS...)> { \
+				static R XLKIT_API call(ARGS... args) { \
+					XLKIT_PRAGMA_DLL_EXPORT_AS(#FUNC "Cached") \
+					XLKIT_TRACE_SCOPE(#FUNC "Cached") \
+					XLKIT_CALL_METRICS_SCOPE(#FUNC "Cached") \
+					XLKIT_CALL_ARENA_SCOPE \
+					try { \
+						return xlkit::detail::callCached(xlkit_cache_##FUNC, \
+														 &FUNC, args...); \
+					XLKIT_END_FUNCTION(R) \
+				} \
+			}; \
+			template struct FUNC##CachedCall<decltype(&FUNC)>; \
+			/**/
+
+/// Macro to register the given pure function with xlkit so that calls with
+/// the same argument values as a recent call return a copy of its result
+/// without calling the function. The results are held in the ResultCache
+/// xlkit_cache_##FUNC, limited by XLKIT_CACHE_ENTRIES and XLKIT_CACHE_BYTES.
+/// @note Calls with range reference arguments are never cached since the
+/// referenced cells may change.
+#define XLKIT_REGISTER_CACHED(FUNC, HELP) \
+			XLKIT_REGISTER_CACHED_AS(#FUNC, FUNC, HELP) \
+			/**/
+
+/// Macro to register the given pure function with xlkit with a different
+/// name from the C++ function name. See XLKIT_REGISTER_CACHED().
+#define XLKIT_REGISTER_CACHED_AS(XLNAME, FUNC, HELP) \
+			XLKIT_DEFINE_CACHED(FUNC) \
+			XLKIT_REGISTER_INFO(XLNAME, FUNC, #FUNC "Cached", HELP, Types) \
+			/**/
+
+/// Macro to register the given pure function with xlkit as thread-safe. See
+/// XLKIT_REGISTER_CACHED() and XLKIT_REGISTER_THREADSAFE().
+#define XLKIT_REGISTER_CACHED_THREADSAFE(FUNC, HELP) \
+			XLKIT_REGISTER_CACHED_THREADSAFE_AS(#FUNC, FUNC, HELP) \
+			/**/
+
+/// Macro to register the given pure function with xlkit as thread-safe with
+/// a different name from the C++ function name. See
+/// XLKIT_REGISTER_CACHED_THREADSAFE().
+#define XLKIT_REGISTER_CACHED_THREADSAFE_AS(XLNAME, FUNC, HELP) \
+			XLKIT_DEFINE_CACHED(FUNC) \
+			XLKIT_REGISTER_INFO(XLNAME, FUNC, #FUNC "Cached", HELP, ThreadSafeTypes) \
+			/**/
+
+/// @}
+
+#endif // XLKIT_XLCACHE_HPP
@@ -0,0 +1,385 @@
+/// @file xlChangeTracker.hpp
+///
+/// @brief Detects which row blocks of range arguments changed between calls
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLCHANGETRACKER_HPP
+#define XLKIT_XLCHANGETRACKER_HPP
+
+#include <xlkit/xlkit.hpp>
+#include <xlkit/xlutil.hpp>
+
+#include <boost/unordered_map.hpp>
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+/// Default number of rows hashed together by ChangeTracker
+#ifndef XLKIT_CHANGE_BLOCK_ROWS
+#define XLKIT_CHANGE_BLOCK_ROWS 1024
+#endif
+
+/// Default maximum number of callers remembered by ChangeTracker
+#ifndef XLKIT_CHANGE_CALLERS
+#define XLKIT_CHANGE_CALLERS 4096
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+namespace detail {
+
+inline xlStringRef
+cellString(const xlOperand& x) {
+	return x.get<xlStringRef>();
+}
+inline xlStringRef12
+cellString(const xlOperand12& x) {
+	return x.get<xlStringRef12>();
+}
+
+// Mix the value of cell x into the running hash h. Numbers take a single
+// step, other types are tagged so that eg. TRUE and 1 differ.
+template <typename OPERAND_T>
+inline uint64_t
+hashCell(uint64_t h, const OPERAND_T& x) {
+	if (x.isDouble()) {
+		double v = x.template get<double>();
+		uint64_t k;
+		::memcpy(&k, &v, sizeof(k));
+		return hashMix(h, k);
+	}
+	if (x.isString()) {
+		auto str = cellString(x);
+		return hashMix(h, hashBytes(str.data(), str.size() * sizeof(str[0]), 1));
+	}
+	uint64_t k;
+	if (x.isInteger())
+		k = (uint64_t(2) << 32) | uint32_t(x.template get<int>());
+	else if (x.isBool())
+		k = (uint64_t(3) << 32) | uint32_t(x.template get<bool>());
+	else if (x.isError())
+		k = (uint64_t(4) << 32) | uint32_t(x.template get<xlError>().num);
+	else if (x.isNil())
+		k = (uint64_t(5) << 32);
+	else
+		k = (uint64_t(6) << 32);
+	return hashMix(h, k);
+}
+
+} // namespace detail
+
+/// Detects which blocks of rows of range arguments changed since the
+/// previous call from the same worksheet cells, so that functions over
+/// large ranges can update their results incrementally.
+///
+/// Each block of blockRows() rows of an argument is summarized by a 64-bit
+/// hash, which is kept per caller and argument along with a BLOCK_T value
+/// that the function may use to keep eg. a partial result for the block.
+/// At most maxCallers() callers are remembered, forgetting the least
+/// recently used ones. The new hashes are only stored by Changes::commit(),
+/// so blocks are reported again if the function fails before updating them.
+///
+/// The tracker may be used from several threads, but the Changes of one
+/// caller's argument must only be used by one thread at a time. Calls from
+/// worksheet cells satisfy this as Excel calculates each cell on one thread.
+///
+/// @code
+/// static xlkit::ChangeTracker<double> theTracker;
+/// xlkit::ChangeTracker<double>::Changes changes;
+/// theTracker.update(0, range, changes);
+/// for (int b : changes.blocks())
+///     changes.data(b) = sumRows(range, changes.rowBegin(b), changes.rowEnd(b));
+/// changes.commit();
+/// @endcode
+template <typename BLOCK_T = detail::empty_>
+class ChangeTracker {
+	// Hashes and user data for one argument of one caller
+	struct State {
+		int						rows;
+		int						cols;
+		std::vector<uint64_t>	hashes;
+		std::vector<BLOCK_T>	data;
+	};
+	typedef std::shared_ptr<State> StatePtr;
+	typedef std::pair<CallerId, int> Key;
+
+  public:
+
+	/// Changes found by update()
+	class Changes {
+	  public:
+		Changes()
+			: myAll(true)
+			, myRows(0)
+			, myBlockRows(1)
+			, myTracker(NULL) {
+		}
+
+		/// Returns true if every block changed because this is the first
+		/// call from the caller or the size of the range changed. The
+		/// data() of all blocks is then default constructed.
+		bool all() const {
+			return myAll;
+		}
+		/// Indices of the changed blocks in ascending order
+		const std::vector<int>& blocks() const {
+			return myBlocks;
+		}
+		/// Returns true if nothing changed
+		bool empty() const {
+			return myBlocks.empty();
+		}
+
+		/// Number of blocks in the range
+		int numBlocks() const {
+			return myState ? int(myState->hashes.size()) : 0;
+		}
+		/// First row of block b
+		int rowBegin(int b) const {
+			return b * myBlockRows;
+		}
+		/// One past the last row of block b
+		int rowEnd(int b) const {
+			return std::min(myRows, (b + 1) * myBlockRows);
+		}
+
+		/// Data kept for block b of this caller's argument
+		BLOCK_T& data(int b) {
+			return myState->data[b];
+		}
+
+		/// Store the hashes of the changed blocks once their data() has been
+		/// updated. Until then, the next call reports them as changed again.
+		void commit() {
+			if (!myState)
+				return;
+			for (size_t i = 0; i < myBlocks.size(); ++i)
+				myState->hashes[myBlocks[i]] = myHashes[i];
+			myHashes.clear();
+			if (myTracker) {
+				myTracker->insert(myKey, myState);
+				myTracker = NULL;
+			}
+		}
+
+	  private:
+		friend class ChangeTracker;
+
+		bool					myAll;
+		int						myRows;
+		int						myBlockRows;
+		std::vector<int>		myBlocks;
+		std::vector<uint64_t>	myHashes;	// new hashes of myBlocks
+		StatePtr				myState;
+		ChangeTracker*			myTracker;	// set if myState is new
+		Key						myKey;
+	};
+
+	/// Construct a tracker hashing block_rows rows together and remembering
+	/// at most max_callers callers
+	explicit ChangeTracker(int block_rows = XLKIT_CHANGE_BLOCK_ROWS,
+						   size_t max_callers = XLKIT_CHANGE_CALLERS)
+		: myBlockRows(std::max(1, block_rows))
+		, myMaxCallers(max_callers) {
+	}
+
+	int blockRows() const {
+		return myBlockRows;
+	}
+	size_t maxCallers() const {
+		return myMaxCallers;
+	}
+
+	/// Find the blocks of argument number arg that changed since the last
+	/// call from the current caller given by getCaller(). If there is no
+	/// caller, everything is reported as changed. Call changes.commit()
+	/// after updating the data() of the changed blocks.
+	/// @{
+	void update(int arg, const xlOperand* x, Changes& changes) {
+		CallerId caller;
+		update(getCaller(caller) ? &caller : NULL, arg, x, changes);
+	}
+	void update(int arg, const xlOperand12* x, Changes& changes) {
+		CallerId caller;
+		update(getCaller(caller) ? &caller : NULL, arg, x, changes);
+	}
+	template <typename FP_T>
+	void update(int arg, const xlFpArrayT<FP_T>& x, Changes& changes) {
+		CallerId caller;
+		update(getCaller(caller) ? &caller : NULL, arg, x, changes);
+	}
+	/// @}
+
+	/// Find the blocks of argument number arg that changed since the last
+	/// call from the given caller, which may be NULL.
+	/// @{
+	void update(const CallerId* caller, int arg, const xlOperand* x,
+				Changes& changes) {
+		updateOperand(caller, arg, x, changes);
+	}
+	void update(const CallerId* caller, int arg, const xlOperand12* x,
+				Changes& changes) {
+		updateOperand(caller, arg, x, changes);
+	}
+	template <typename FP_T>
+	void update(const CallerId* caller, int arg, const xlFpArrayT<FP_T>& x,
+				Changes& changes) {
+		int rows = x.rows();
+		int cols = x.cols();
+		const double* data = x.empty() ? NULL : x.data();
+		compare(caller, arg, rows, cols, changes, [=](int b0, int b1) {
+			return detail::hashBytes(data + size_t(b0) * cols,
+									 size_t(b1 - b0) * cols * sizeof(double));
+		});
+	}
+	/// @}
+
+	/// Forget all callers
+	void clear() {
+		std::lock_guard<std::mutex> lock(myMutex);
+		myStates.clear();
+		myLru.clear();
+	}
+
+	/// Number of caller arguments currently remembered
+	size_t size() const {
+		std::lock_guard<std::mutex> lock(myMutex);
+		return myStates.size();
+	}
+
+  private:
+	typedef std::list<Key> List;
+	typedef boost::unordered_map<Key, std::pair<StatePtr, typename List::iterator>,
+			boost::hash<Key> > Map;
+
+	template <typename OPERAND_T>
+	void updateOperand(const CallerId* caller, int arg, const OPERAND_T* x,
+					   Changes& changes) {
+		typedef typename OPERAND_T::ConstCellMatrixRef MatrixRef;
+		if (x && x->isCellMatrix()) {
+			MatrixRef m = x->template get<MatrixRef>();
+			int cols = m.cols();
+			const OPERAND_T* cells = m.begin();
+			compare(caller, arg, m.rows(), cols, changes, [=](int b0, int b1) {
+				uint64_t h = 0;
+				const OPERAND_T* end = cells + size_t(b1) * cols;
+				for (const OPERAND_T* c = cells + size_t(b0) * cols; c != end; ++c)
+					h = detail::hashCell(h, *c);
+				return detail::hashFinish(h);
+			});
+		} else {
+			// A single value is a 1x1 range
+			compare(caller, arg, (x ? 1 : 0), 1, changes, [=](int, int) {
+				return detail::hashFinish(x ? detail::hashCell(0, *x) : 0);
+			});
+		}
+	}
+
+	// Compare the block hashes given by hash_block(row_begin, row_end)
+	// against the state for the caller. A new state is only remembered by
+	// changes.commit().
+	template <typename HASH_BLOCK>
+	void compare(const CallerId* caller, int arg, int rows, int cols,
+				Changes& changes, const HASH_BLOCK& hash_block) {
+		int num_blocks = (rows + myBlockRows - 1) / myBlockRows;
+		StatePtr state = caller ? find(Key(*caller, arg)) : StatePtr();
+		bool all = !state || state->rows != rows || state->cols != cols;
+		changes.myTracker = NULL;
+		if (all) {
+			state = std::make_shared<State>();
+			state->rows = rows;
+			state->cols = cols;
+			state->hashes.resize(num_blocks);
+			state->data.resize(num_blocks);
+			if (caller) {
+				changes.myTracker = this;
+				changes.myKey = Key(*caller, arg);
+			}
+		}
+
+		changes.myAll = all;
+		changes.myRows = rows;
+		changes.myBlockRows = myBlockRows;
+		changes.myBlocks.clear();
+		changes.myHashes.clear();
+		for (int b = 0; b < num_blocks; ++b) {
+			int r0 = b * myBlockRows;
+			uint64_t h = hash_block(r0, std::min(rows, r0 + myBlockRows));
+			if (all || h != state->hashes[b]) {
+				changes.myBlocks.push_back(b);
+				changes.myHashes.push_back(h);
+			}
+		}
+		changes.myState = state;
+	}
+
+	StatePtr find(const Key& key) {
+		std::lock_guard<std::mutex> lock(myMutex);
+		typename Map::iterator it = myStates.find(key);
+		if (it == myStates.end())
+			return StatePtr();
+		myLru.splice(myLru.begin(), myLru, it->second.second);
+		return it->second.first;
+	}
+
+	void insert(const Key& key, const StatePtr& state) {
+		std::lock_guard<std::mutex> lock(myMutex);
+		typename Map::iterator it = myStates.find(key);
+		if (it != myStates.end()) {
+			it->second.first = state;
+			myLru.splice(myLru.begin(), myLru, it->second.second);
+			return;
+		}
+		if (myMaxCallers == 0)
+			return;
+		while (myStates.size() >= myMaxCallers) {
+			myStates.erase(myLru.back());
+			myLru.pop_back();
+		}
+		myLru.push_front(key);
+		myStates.emplace(key, std::make_pair(state, myLru.begin()));
+	}
+
+	int					myBlockRows;
+	size_t				myMaxCallers;
+	Map					myStates;
+	List				myLru;
+	mutable std::mutex	myMutex;
+
+	ChangeTracker(const ChangeTracker&);
+	ChangeTracker& operator=(const ChangeTracker&);
+};
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+#endif // XLKIT_XLCHANGETRACKER_HPP
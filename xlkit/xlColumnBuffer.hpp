@@ -0,0 +1,165 @@
+/// @file xlColumnBuffer.hpp
+///
+/// @brief xlkit::ColumnBuffer class for typed columns with validity masks
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLCOLUMNBUFFER_HPP
+#define XLKIT_XLCOLUMNBUFFER_HPP
+
+#include <xlkit/xlutil.hpp>
+#include <xlkit/xlversion.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// Contiguous buffer of values of type T, together with a bitmask marking
+/// which rows hold a valid value. This is filled in a single pass from a
+/// cell matrix by ConstCellMatrixRef::getColumn(), without throwing on cells
+/// that are missing, errors or of the wrong type. Invalid rows hold T().
+template <typename T>
+class ColumnBuffer {
+  public:
+	ColumnBuffer()
+		: mySize(0)
+		, myValidCount(0) {
+	}
+	ColumnBuffer(const ColumnBuffer&) = delete;
+	ColumnBuffer& operator=(const ColumnBuffer&) = delete;
+	/// Moves are noexcept so that std::vector moves rather than copies
+	/// buffers when it grows
+	/// @{
+	ColumnBuffer(ColumnBuffer&& other) XLKIT_NOEXCEPT
+		: myValues(std::move(other.myValues))
+		, myValid(std::move(other.myValid))
+		, mySize(other.mySize)
+		, myValidCount(other.myValidCount) {
+		other.mySize = 0;
+		other.myValidCount = 0;
+	}
+	ColumnBuffer& operator=(ColumnBuffer&& other) XLKIT_NOEXCEPT {
+		if (this != &other) {
+			myValues = std::move(other.myValues);
+			myValid = std::move(other.myValid);
+			mySize = other.mySize;
+			myValidCount = other.myValidCount;
+			other.mySize = 0;
+			other.myValidCount = 0;
+		}
+		return *this;
+	}
+	/// @}
+
+	/// Resize to n rows, all marked invalid. Existing storage is reused if
+	/// the size is unchanged.
+	void resize(int n) {
+		if (n != mySize) {
+			myValues.reset(n > 0 ? new T[n] : NULL);
+			mySize = n;
+			myValid.resize((size_t(n) + 63) / 64);
+		}
+		std::fill(myValid.begin(), myValid.end(), uint64_t(0));
+		myValidCount = 0;
+	}
+
+	/// Number of rows
+	int size() const {
+		return mySize;
+	}
+
+	/// Contiguous values
+	/// @{
+	T* data() {
+		return myValues.get();
+	}
+	const T* data() const {
+		return myValues.get();
+	}
+	T& operator[](int i) {
+		return myValues[i];
+	}
+	const T& operator[](int i) const {
+		return myValues[i];
+	}
+	/// @}
+
+	/// Returns true if row i holds a valid value
+	bool isValid(int i) const {
+		return ((myValid[i >> 6] >> (i & 63)) & 1) != 0;
+	}
+	/// Mark row i as holding a valid value
+	void setValid(int i) {
+		uint64_t bit = uint64_t(1) << (i & 63);
+		if (!(myValid[i >> 6] & bit)) {
+			myValid[i >> 6] |= bit;
+			++myValidCount;
+		}
+	}
+	/// Mark all rows as valid
+	void setAllValid() {
+		std::fill(myValid.begin(), myValid.end(), ~uint64_t(0));
+		if (mySize & 63)
+			myValid.back() = (uint64_t(1) << (mySize & 63)) - 1;
+		myValidCount = mySize;
+	}
+
+	/// Number of valid rows
+	int validCount() const {
+		return myValidCount;
+	}
+	/// Returns true if every row is valid
+	bool allValid() const {
+		return (myValidCount == mySize);
+	}
+	/// Validity bits, where row i is bit (i % 64) of word (i / 64)
+	const uint64_t* validMask() const {
+		return myValid.data();
+	}
+
+  private:
+	std::unique_ptr<T[]> myValues;
+	std::vector<uint64_t> myValid;
+	int mySize;
+	int myValidCount;
+};
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+/// @addtogroup aliases
+/// @{
+
+/// Typed column with validity mask. See @ref xlkit::XLKIT_VERSION_NAME::ColumnBuffer "ColumnBuffer"
+template <typename T>
+using xlColumnBuffer = xlkit::ColumnBuffer<T>;
+
+/// @}
+
+#endif // XLKIT_XLCOLUMNBUFFER_HPP
@@ -0,0 +1,498 @@
+/// @file xlConvert.hpp
+///
+/// @brief Conversions between numbers and strings without allocation
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLCONVERT_HPP
+#define XLKIT_XLCONVERT_HPP
+
+#include <xlkit/xlutil.hpp>
+#include <xlkit/xlversion.hpp>
+
+#include <limits>
+#include <system_error>
+#include <type_traits>
+
+#include <stddef.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// @defgroup convert Number Conversion
+/// Number to string conversions that work directly on character ranges,
+/// such as the contents of a string operand, without any allocation. The
+/// results never depend on the C locale, which always has '.' as the
+/// decimal point. These are used by the xlOperand type coercions.
+/// @{
+
+/// Size of the buffer needed by formatNumber()
+static const size_t FORMAT_NUMBER_SIZE = 32;
+
+namespace detail {
+
+// Exactly representable powers of 10
+inline double
+exactPow10(int e) {
+	static const double theTable[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	return theTable[e];
+}
+
+template <typename CHAR_T>
+inline bool
+isSpace(CHAR_T c) {
+	return (c == CHAR_T(' ') || c == CHAR_T('\t'));
+}
+
+template <typename CHAR_T>
+inline bool
+isDigit(CHAR_T c) {
+	return (c >= CHAR_T('0') && c <= CHAR_T('9'));
+}
+
+template <typename CHAR_T>
+inline void
+trimSpaces(const CHAR_T*& first, const CHAR_T*& last) {
+	while (first != last && isSpace(*first))
+		++first;
+	while (first != last && isSpace(*(last - 1)))
+		--last;
+}
+
+// Significant digits kept by parseDoubleSlow(). Deciding how to round a
+// decimal to a double needs at most 768 significant digits, so the digits
+// after these only matter in whether any of them is non-zero.
+static const int PARSE_MAX_DIGITS = 780;
+
+// Correctly rounded parse of text that has already been validated by
+// parseDouble(), for the cases where the fast path is not exact. The text
+// is rewritten as an integer of significant digits and a power of 10 so
+// that neither its length nor the locale's decimal point matter. Values too
+// small for a double become zero, the same as subnormals are rounded.
+template <typename CHAR_T>
+inline bool
+parseDoubleSlow(const CHAR_T* first, const CHAR_T* last, double& value) {
+	char buf[PARSE_MAX_DIGITS + 16];
+	char* end = buf;
+	const CHAR_T* p = first;
+	bool negative = false;
+	if (*p == CHAR_T('+') || *p == CHAR_T('-')) {
+		negative = (*p == CHAR_T('-'));
+		++p;
+	}
+	if (negative)
+		*end++ = '-';
+
+	// The value is digits * 10^exponent
+	int num_digits = 0;
+	long exponent = 0;
+	bool sticky = false;
+	bool after_point = false;
+	for (; p != last && *p != CHAR_T('e') && *p != CHAR_T('E'); ++p) {
+		if (*p == CHAR_T('.')) {
+			after_point = true;
+			continue;
+		}
+		if (num_digits == 0 && *p == CHAR_T('0')) {
+			exponent -= after_point;
+		} else if (num_digits < PARSE_MAX_DIGITS) {
+			*end++ = char(*p);
+			++num_digits;
+			exponent -= after_point;
+		} else {
+			sticky |= (*p != CHAR_T('0'));
+			exponent += !after_point;
+		}
+	}
+	if (sticky) {
+		// Stands in for the non-zero digits that were dropped
+		*end++ = '1';
+		++num_digits;
+		--exponent;
+	}
+	if (p != last) {
+		++p;
+		bool negative_exp = false;
+		if (*p == CHAR_T('+') || *p == CHAR_T('-')) {
+			negative_exp = (*p == CHAR_T('-'));
+			++p;
+		}
+		long e = 0;
+		for (; p != last; ++p) {
+			if (e < 100000)
+				e = e * 10 + long(*p - CHAR_T('0'));
+		}
+		exponent += negative_exp ? -e : e;
+	}
+	if (num_digits == 0) {
+		value = negative ? -0.0 : 0.0;
+		return true;
+	}
+
+	// The value is at least 10^(num_digits - 1 + exponent) and less than
+	// 10^(num_digits + exponent)
+	const long magnitude = num_digits + exponent;
+	if (magnitude - 1 > std::numeric_limits<double>::max_exponent10)
+		return false;
+	if (magnitude < std::numeric_limits<double>::min_exponent10 - 17) {
+		// Below half of the smallest subnormal
+		value = negative ? -0.0 : 0.0;
+		return true;
+	}
+	end += strnprintf(end, size_t(buf + sizeof(buf) - end), "e%ld", exponent);
+#if defined(__cpp_lib_to_chars)
+	double x;
+	std::from_chars_result r = std::from_chars(buf, end, x);
+	if (r.ec == std::errc::result_out_of_range && magnitude <= 0)
+		x = negative ? -0.0 : 0.0;
+	else if (r.ec != std::errc() || r.ptr != end)
+		return false;
+#else
+	char* parsed;
+	XLKIT_PUSH_DISABLE_WARN_DEPRECATION
+	double x = strtod(buf, &parsed);
+	XLKIT_POP_DISABLE_WARN_DEPRECATION
+	if (parsed != end || x == HUGE_VAL || x == -HUGE_VAL)
+		return false;
+#endif
+	value = x;
+	return true;
+}
+
+template <typename CHAR_T>
+inline bool
+parseDouble(const CHAR_T* first, const CHAR_T* last, double& value) {
+	trimSpaces(first, last);
+	const CHAR_T* p = first;
+	bool negative = false;
+	if (p != last && (*p == CHAR_T('+') || *p == CHAR_T('-'))) {
+		negative = (*p == CHAR_T('-'));
+		++p;
+	}
+
+	// Mantissa, keeping up to 19 significant digits
+	uint64_t mantissa = 0;
+	int num_digits = 0;
+	int exponent = 0;
+	bool truncated = false;
+	bool any_digits = false;
+	for (; p != last && isDigit(*p); ++p) {
+		any_digits = true;
+		if (num_digits < 19) {
+			mantissa = mantissa * 10 + unsigned(*p - CHAR_T('0'));
+			num_digits += (mantissa != 0);
+		} else {
+			truncated |= (*p != CHAR_T('0'));
+			++exponent;
+		}
+	}
+	if (p != last && *p == CHAR_T('.')) {
+		++p;
+		for (; p != last && isDigit(*p); ++p) {
+			any_digits = true;
+			if (num_digits < 19) {
+				mantissa = mantissa * 10 + unsigned(*p - CHAR_T('0'));
+				num_digits += (mantissa != 0);
+				--exponent;
+			} else {
+				truncated |= (*p != CHAR_T('0'));
+			}
+		}
+	}
+	if (!any_digits)
+		return false;
+
+	// Exponent
+	if (p != last && (*p == CHAR_T('e') || *p == CHAR_T('E'))) {
+		++p;
+		bool negative_exp = false;
+		if (p != last && (*p == CHAR_T('+') || *p == CHAR_T('-'))) {
+			negative_exp = (*p == CHAR_T('-'));
+			++p;
+		}
+		if (p == last || !isDigit(*p))
+			return false;
+		int e = 0;
+		for (; p != last && isDigit(*p); ++p) {
+			if (e < 100000)
+				e = e * 10 + int(*p - CHAR_T('0'));
+		}
+		exponent += negative_exp ? -e : e;
+	}
+	if (p != last)
+		return false;
+
+	// When both the mantissa and power of 10 are exact, a single multiply or
+	// divide is correctly rounded (Clinger's fast path).
+	if (!truncated && mantissa <= (uint64_t(1) << 53)
+			&& exponent >= -22 && exponent <= 22) {
+		double x = double(mantissa);
+		x = (exponent < 0) ? x / exactPow10(-exponent) : x * exactPow10(exponent);
+		value = negative ? -x : x;
+		return true;
+	}
+	if (mantissa == 0 && !truncated) {
+		value = negative ? -0.0 : 0.0;
+		return true;
+	}
+	return parseDoubleSlow(first, last, value);
+}
+
+template <typename CHAR_T>
+inline bool
+parseInteger(const CHAR_T* first, const CHAR_T* last, bool& negative, uint64_t& magnitude) {
+	trimSpaces(first, last);
+	const CHAR_T* p = first;
+	negative = false;
+	if (p != last && (*p == CHAR_T('+') || *p == CHAR_T('-'))) {
+		negative = (*p == CHAR_T('-'));
+		++p;
+	}
+	if (p == last)
+		return false;
+	magnitude = 0;
+	for (; p != last; ++p) {
+		if (!isDigit(*p))
+			return false;
+		unsigned d = unsigned(*p - CHAR_T('0'));
+		if (magnitude > (std::numeric_limits<uint64_t>::max() - d) / 10)
+			return false;
+		magnitude = magnitude * 10 + d;
+	}
+	return true;
+}
+
+template <typename CHAR_T, typename T>
+inline bool
+parseNumberImpl(const CHAR_T* first, const CHAR_T* last, T& value, std::true_type /*is_integral*/) {
+	bool negative;
+	uint64_t magnitude;
+	if (!parseInteger(first, last, negative, magnitude))
+		return false;
+	if (negative) {
+		if (!std::numeric_limits<T>::is_signed && magnitude != 0)
+			return false;
+		uint64_t limit = uint64_t(-(std::numeric_limits<T>::min() + 1)) + 1;
+		if (magnitude > limit)
+			return false;
+		value = (magnitude == 0) ? T(0) : T(-T(magnitude - 1) - 1);
+	} else {
+		if (magnitude > uint64_t(std::numeric_limits<T>::max()))
+			return false;
+		value = T(magnitude);
+	}
+	return true;
+}
+
+template <typename CHAR_T, typename T>
+inline bool
+parseNumberImpl(const CHAR_T* first, const CHAR_T* last, T& value, std::false_type /*is_integral*/) {
+	double x;
+	if (!parseDouble(first, last, x))
+		return false;
+	value = T(x);
+	return true;
+}
+
+} // namespace detail
+
+/// Parse all of [first, last) as a number, ignoring leading and trailing
+/// spaces. Integral types only accept integers that are in range, while
+/// floating point types accept decimal numbers with an optional exponent,
+/// always using '.' as the decimal point. Numbers too large for a double
+/// are not valid, while those too small become zero. Returns false if the
+/// text is not a valid number, leaving value unchanged.
+template <typename CHAR_T, typename T>
+inline bool
+parseNumber(const CHAR_T* first, const CHAR_T* last, T& value) {
+	static_assert(std::is_arithmetic<T>::value, "T must be arithmetic");
+	return detail::parseNumberImpl(first, last, value,
+								   typename std::is_integral<T>::type());
+}
+
+namespace detail {
+
+// Shortest round trip formatting for when std::to_chars is missing. The
+// significant digits come from printf's correctly rounded "%.*e", which is
+// unaffected by the locale apart from the decimal point, which is skipped.
+// The digits are then laid out the same way as std::to_chars.
+inline size_t
+formatShortest(double value, char* buf) {
+	size_t len = 0;
+	if (value != value) {
+		buf[len++] = 'n'; buf[len++] = 'a'; buf[len++] = 'n';
+		return len;
+	}
+	if (value < 0 || (value == 0 && 1 / value < 0)) {
+		buf[len++] = '-';
+		value = -value;
+	}
+	if (value == 0) {
+		buf[len++] = '0';
+		return len;
+	}
+	if (value == std::numeric_limits<double>::infinity()) {
+		buf[len++] = 'i'; buf[len++] = 'n'; buf[len++] = 'f';
+		return len;
+	}
+
+	// Any decimal with up to 15 significant digits survives a round trip
+	// through a normal double, so when 15 digits round trip the shortest
+	// digits are those less the trailing zeros. Subnormals have less
+	// precision and start from 1 digit.
+	char digits[24];
+	int num_digits = 0;
+	int exponent = 0;
+	const int min_precision = (value < std::numeric_limits<double>::min()) ? 1 : 15;
+	for (int precision = min_precision; precision <= 17; ++precision) {
+		char text[40];
+		strnprintf(text, sizeof(text), "%.*e", precision - 1, value);
+		num_digits = 0;
+		const char* p = text;
+		for (; *p != 'e'; ++p) {
+			if (isDigit(*p))
+				digits[num_digits++] = *p;
+		}
+		bool negative_exp = (*++p == '-');
+		exponent = 0;
+		for (++p; isDigit(*p); ++p)
+			exponent = exponent * 10 + (*p - '0');
+		if (negative_exp)
+			exponent = -exponent;
+
+		// Parse back as digits * 10^e, which has no decimal point
+		char round_trip[40];
+		memcpy(round_trip, digits, num_digits);
+		int n = num_digits + strnprintf(round_trip + num_digits,
+										sizeof(round_trip) - num_digits, "e%d",
+										exponent - (num_digits - 1));
+		double x;
+		if (parseDouble(round_trip, round_trip + n, x) && x == value)
+			break;
+	}
+	while (num_digits > 1 && digits[num_digits - 1] == '0')
+		--num_digits;
+
+	// The value is d.ddd * 10^exponent. Use fixed notation unless it's
+	// longer than scientific notation.
+	int abs_exp = (exponent < 0) ? -exponent : exponent;
+	int sci_len = num_digits + (num_digits > 1) + 2 + (abs_exp >= 100 ? 3 : 2);
+	int fixed_len;
+	if (exponent >= num_digits - 1)
+		fixed_len = exponent + 1;
+	else if (exponent >= 0)
+		fixed_len = num_digits + 1;
+	else
+		fixed_len = 1 - exponent + num_digits;
+	if (fixed_len <= sci_len) {
+		if (exponent >= num_digits - 1) {
+			// Integers are written with all of their exact digits
+			len += strnprintf(buf + len, FORMAT_NUMBER_SIZE - len, "%.0f", value);
+		} else if (exponent >= 0) {
+			memcpy(buf + len, digits, exponent + 1);
+			len += exponent + 1;
+			buf[len++] = '.';
+			memcpy(buf + len, digits + exponent + 1, num_digits - exponent - 1);
+			len += num_digits - exponent - 1;
+		} else {
+			buf[len++] = '0';
+			buf[len++] = '.';
+			for (int i = -1; i > exponent; --i)
+				buf[len++] = '0';
+			memcpy(buf + len, digits, num_digits);
+			len += num_digits;
+		}
+	} else {
+		buf[len++] = digits[0];
+		if (num_digits > 1) {
+			buf[len++] = '.';
+			memcpy(buf + len, digits + 1, num_digits - 1);
+			len += num_digits - 1;
+		}
+		buf[len++] = 'e';
+		buf[len++] = (exponent < 0) ? '-' : '+';
+		if (abs_exp >= 100)
+			buf[len++] = char('0' + abs_exp / 100);
+		buf[len++] = char('0' + abs_exp / 10 % 10);
+		buf[len++] = char('0' + abs_exp % 10);
+	}
+	return len;
+}
+
+} // namespace detail
+
+/// Write the shortest decimal string which parses back to exactly the same
+/// double, choosing between fixed and scientific notation like
+/// std::to_chars. Returns the number of characters written to buf, which
+/// must have room for FORMAT_NUMBER_SIZE characters. The result is not
+/// null-terminated.
+inline size_t
+formatNumber(double value, char* buf) {
+#if defined(__cpp_lib_to_chars)
+	std::to_chars_result r = std::to_chars(buf, buf + FORMAT_NUMBER_SIZE, value);
+	return size_t(r.ptr - buf);
+#else
+	return detail::formatShortest(value, buf);
+#endif
+}
+
+/// Write an integer in decimal. Returns the number of characters written to
+/// buf, which must have room for FORMAT_NUMBER_SIZE characters. The result
+/// is not null-terminated.
+inline size_t
+formatNumber(int value, char* buf) {
+	char digits[16];
+	int n = 0;
+	unsigned int magnitude = (value < 0) ? 0u - unsigned(value) : unsigned(value);
+	do {
+		digits[n++] = char('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude != 0);
+	size_t len = 0;
+	if (value < 0)
+		buf[len++] = '-';
+	while (n > 0)
+		buf[len++] = digits[--n];
+	return len;
+}
+
+/// @}
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+#endif // XLKIT_XLCONVERT_HPP
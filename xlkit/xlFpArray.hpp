@@ -0,0 +1,141 @@
+/// @file xlFpArray.hpp
+///
+/// @brief xlkit::xlFpArray class for FP/FP12 arrays of numbers
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLFPARRAY_HPP
+#define XLKIT_XLFPARRAY_HPP
+
+#include <xlkit/xlcall.hpp>
+#include <xlkit/xlException.hpp>
+#include <xlkit/xlversion.hpp>
+
+#include <stddef.h>
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// Non-owning view of an FP or FP12 struct, which is a contiguous row-major
+/// matrix of doubles. As a function parameter, Excel converts the incoming
+/// range directly into this form so no per-cell type dispatch is needed.
+/// @note xlFpArrayT must *not* contain any data other than the pointer so
+/// that it is passed to us identically to an FP*.
+template <typename FP_T>
+class xlFpArrayT {
+  public:
+	typedef double* iterator;
+	typedef const double* const_iterator;
+
+	/// Construct a view of the given FP struct
+	explicit xlFpArrayT(FP_T* fp = NULL)
+		: myArray(fp) { }
+
+	/// Rows in matrix
+	int rows() const {
+		return myArray ? int(myArray->rows) : 0;
+	}
+	/// Columns in matrix
+	int cols() const {
+		return myArray ? int(myArray->columns) : 0;
+	}
+	/// Total number of elements
+	size_t size() const {
+		return size_t(rows()) * size_t(cols());
+	}
+	/// Returns true if there are no elements
+	bool empty() const {
+		return (size() == 0);
+	}
+
+	/// Contiguous row-major elements
+	/// @{
+	double* data() {
+		return myArray->array;
+	}
+	const double* data() const {
+		return myArray->array;
+	}
+	/// @}
+
+	/// (row,col) value in matrix
+	/// @{
+	double& operator()(int i, int j) {
+		return myArray->array[size_t(i) * myArray->columns + j];
+	}
+	const double& operator()(int i, int j) const {
+		return myArray->array[size_t(i) * myArray->columns + j];
+	}
+	/// @}
+
+	/// Iteration over all elements in row-major order
+	/// @{
+	iterator begin() {
+		return myArray ? myArray->array : NULL;
+	}
+	iterator end() {
+		return begin() + size();
+	}
+	const_iterator begin() const {
+		return myArray ? myArray->array : NULL;
+	}
+	const_iterator end() const {
+		return begin() + size();
+	}
+	/// @}
+
+	/// Underlying struct
+	FP_T* fp() const {
+		return myArray;
+	}
+
+	/// Number of bytes needed for an FP_T struct of the given size
+	static size_t byteSize(int rows, int cols) {
+		size_t n = size_t(rows) * size_t(cols);
+		return offsetof(FP_T, array) + (n > 0 ? n : 1) * sizeof(double);
+	}
+
+  private:
+	FP_T* myArray;
+};
+
+/// View of an FP struct, registered with type code K
+typedef xlFpArrayT<FP>		xlFpArray;
+/// View of an FP12 struct, registered with type code K% (Excel 2007+)
+typedef xlFpArrayT<FP12>	xlFpArray12;
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+/// @addtogroup aliases
+/// @{
+
+/// View of an FP array of numbers. See @ref xlkit::XLKIT_VERSION_NAME::xlFpArrayT "xlFpArrayT"
+typedef xlkit::xlFpArray xlFpArray;
+
+/// View of an FP12 array of numbers. See @ref xlkit::XLKIT_VERSION_NAME::xlFpArrayT "xlFpArrayT"
+typedef xlkit::xlFpArray12 xlFpArray12;
+
+/// @}
+
+#endif // XLKIT_XLFPARRAY_HPP
@@ -0,0 +1,151 @@
+/// @file xlMetrics.hpp
+///
+/// @brief Per-function call counters and latency histograms
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLMETRICS_HPP
+#define XLKIT_XLMETRICS_HPP
+
+#include <xlkit/xlversion.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Maximum number of functions and Excel callbacks whose calls are counted
+#ifndef XLKIT_METRICS_FUNCTIONS
+#define XLKIT_METRICS_FUNCTIONS 4096
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// Snapshot of the calls made to a function, see callStats().
+///
+/// When XLKIT_USE_CALL_METRICS is defined before including xlkit.hpp, every
+/// function using XLKIT_BEGIN_FUNCTION and every Excel callback made through
+/// xlkit is counted. The counters are kept separately for each thread so
+/// that recording a call doesn't contend with other threads.
+struct CallStats {
+	/// Number of latency buckets. Bucket 0 counts calls under 1 microsecond
+	/// and bucket i counts calls taking [2^(i-1), 2^i) microseconds, with
+	/// the last bucket also counting all slower calls.
+	enum { NUM_BUCKETS = 24 };
+
+	std::string	name;			///< Function name
+	bool		callback;		///< True for callbacks into Excel
+	uint64_t	calls;			///< Number of calls
+	uint64_t	failures;		///< Calls that threw or were failed by Excel
+	uint64_t	totalNs;		///< Total time of the calls
+	uint64_t	maxNs;			///< Time of the slowest call
+	uint64_t	resultCells;	///< Cells returned, counting scalars as one
+	uint64_t	histogram[NUM_BUCKETS];	///< Number of calls by latency
+
+	/// Average time of a call
+	double meanMs() const {
+		return (calls ? 1e-6 * double(totalNs) / double(calls) : 0.0);
+	}
+
+	/// Upper bound of the time taken by the given fraction of the calls,
+	/// eg. 0.95 for the 95th percentile
+	double percentileMs(double fraction) const;
+};
+
+/// Take a snapshot of the calls made since the last resetCallStats(),
+/// ordered from the function with the largest total time
+std::vector<CallStats> callStats();
+
+/// Restart counting calls from zero
+void resetCallStats();
+
+namespace detail {
+
+// Counts calls in per-thread shards, see CallStats
+class CallMetrics {
+  public:
+	typedef std::chrono::steady_clock Clock;
+
+	// Kinds of result noted with noteResult()
+	enum ResultKind { RESULT_NONE, RESULT_OPER, RESULT_OPER12, RESULT_FP, RESULT_FP12 };
+
+	// Get the id of the function for the given slot, assigning it the next
+	// id for name if the slot is still 0. Slots hold the id + 1, or -1 when
+	// there is no room for more functions.
+	static int functionId(std::atomic<int>& slot, const char* name);
+
+	// Get the id for calls to the Excel callback xlfn
+	static int callbackId(int xlfn);
+
+	// Note the result returned by the current function call on this thread
+	static void noteResult(ResultKind kind, const void* result);
+
+	// Number of cells in the noted result, clearing it for the next call
+	static uint64_t takeResultCells();
+
+	// Record a call to function id that started at start
+	static void record(int id, Clock::time_point start, bool failed, uint64_t cells);
+};
+
+// Records a call to the enclosing function, see XLKIT_CALL_METRICS_SCOPE
+class CallMetricsScope {
+  public:
+	CallMetricsScope(std::atomic<int>& slot, const char* name)
+		: myId(slot.load(std::memory_order_relaxed) - 1)
+		, myFailed(false) {
+		if (myId == -1)
+			myId = CallMetrics::functionId(slot, name);
+		CallMetrics::noteResult(CallMetrics::RESULT_NONE, NULL);
+		myStart = CallMetrics::Clock::now();
+	}
+	~CallMetricsScope() {
+		if (myId >= 0) {
+			uint64_t cells = CallMetrics::takeResultCells();
+			CallMetrics::record(myId, myStart, myFailed, myFailed ? 0 : cells);
+		}
+	}
+
+	// Mark the call as failed
+	void fail() {
+		myFailed = true;
+	}
+
+  private:
+	CallMetricsScope(const CallMetricsScope&);
+	CallMetricsScope& operator=(const CallMetricsScope&);
+
+	int myId;
+	bool myFailed;
+	CallMetrics::Clock::time_point myStart;
+};
+
+} // namespace detail
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+#endif // XLKIT_XLMETRICS_HPP
@@ -26,18 +26,30 @@
 #ifndef XLKIT_XLOPERAND_HPP
 #define XLKIT_XLOPERAND_HPP
 
+#include <xlkit/xlArena.hpp>
 #include <xlkit/xlcall.hpp>
+#include <xlkit/xlColumnBuffer.hpp>
+#include <xlkit/xlConvert.hpp>
 #include <xlkit/xlException.hpp>
 #include <xlkit/xlutil.hpp>
 #include <xlkit/xlversion.hpp>
 
-#include <boost/lexical_cast.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/utility/string_ref.hpp>
 
+#include <atomic>
+#include <cmath>
+#include <new>
+#include <type_traits>
 #include <utility>
 #include <string>
+#include <vector>
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 namespace xlkit {
@@ -49,9 +61,239 @@ namespace detail {
 template<typename T>
 struct unimplemented : std::false_type {};
 
+// Tag for selecting the overloads implementing get<T>() and castValue<T>()
+template <typename T>
+struct type_ { };
+
+// Random access iterator over every stride'th element starting from ptr
+template <typename T>
+class StridedIterator
+	: public boost::iterator_facade< StridedIterator<T>, T
+	, std::random_access_iterator_tag > {
+  public:
+	StridedIterator()
+		: myPtr(NULL), myStride(0) { }
+	StridedIterator(T* ptr, ptrdiff_t stride)
+		: myPtr(ptr), myStride(stride) { }
+
+  private:
+	friend class boost::iterator_core_access;
+
+	T& dereference() const {
+		return *myPtr;
+	}
+	bool equal(const StridedIterator& other) const {
+		return (myPtr == other.myPtr);
+	}
+	void increment() {
+		myPtr += myStride;
+	}
+	void decrement() {
+		myPtr -= myStride;
+	}
+	void advance(ptrdiff_t n) {
+		myPtr += n * myStride;
+	}
+	ptrdiff_t distance_to(const StridedIterator& other) const {
+		return (other.myPtr - myPtr) / myStride;
+	}
+
+	T* myPtr;
+	ptrdiff_t myStride;
+};
+
 
 } // namespace detail
 
+/// Non-owning view of a window of cells in a cell matrix. Sub-ranges,
+/// strided and transposed views are made without copying any cells. Use
+/// xlOperand::set() to copy a view into a new matrix.
+/// @note T is the cell type, either xlOperand or const xlOperand.
+template <typename T>
+class CellMatrixView {
+  public:
+	typedef boost::iterator_range< detail::StridedIterator<T> > Span;
+
+	CellMatrixView()
+		: myCells(NULL)
+		, myRows(0)
+		, myCols(0)
+		, myRowStride(0)
+		, myColStride(0) {
+	}
+	/// Construct from the cell at (0,0) and the distances in cells between
+	/// successive rows and columns
+	CellMatrixView(T* cells, int rows, int cols, ptrdiff_t row_stride, ptrdiff_t col_stride)
+		: myCells(cells)
+		, myRows(rows)
+		, myCols(cols)
+		, myRowStride(row_stride)
+		, myColStride(col_stride) {
+	}
+	/// Construct a const view from a mutable one
+	template <typename U>
+	CellMatrixView(const CellMatrixView<U>& other,
+				   typename std::enable_if<std::is_convertible<U*, T*>::value>::type* = NULL)
+		: myCells(other.myCells)
+		, myRows(other.myRows)
+		, myCols(other.myCols)
+		, myRowStride(other.myRowStride)
+		, myColStride(other.myColStride) {
+	}
+
+	/// Rows in view
+	int rows() const {
+		return myRows;
+	}
+	/// Columns in view
+	int cols() const {
+		return myCols;
+	}
+	/// Number of cells in view
+	size_t size() const {
+		return size_t(myRows) * myCols;
+	}
+	/// True if the cells are in row-major order without gaps
+	bool isContiguous() const {
+		return (myColStride == 1 && (myRowStride == myCols || myRows <= 1));
+	}
+
+	/// (row,col) value in view
+	T& operator()(int i, int j) const {
+		return myCells[i * myRowStride + j * myColStride];
+	}
+	/// Cells of row i
+	Span row(int i) const {
+		T* begin = myCells + i * myRowStride;
+		return Span(detail::StridedIterator<T>(begin, myColStride),
+					detail::StridedIterator<T>(begin + myCols * myColStride, myColStride));
+	}
+	/// Cells of column j
+	Span col(int j) const {
+		T* begin = myCells + j * myColStride;
+		return Span(detail::StridedIterator<T>(begin, myRowStride),
+					detail::StridedIterator<T>(begin + myRows * myRowStride, myRowStride));
+	}
+
+	/// View of the rows x cols block starting at (row,col)
+	CellMatrixView block(int row, int col, int rows, int cols) const {
+		if (row < 0 || col < 0 || rows < 0 || cols < 0
+				|| row + rows > myRows || col + cols > myCols)
+			XLKIT_THROW("Cell matrix block out of range");
+		return CellMatrixView(myCells + row * myRowStride + col * myColStride,
+							  rows, cols, myRowStride, myColStride);
+	}
+	/// View of rows [begin, end)
+	CellMatrixView rowRange(int begin, int end) const {
+		return block(begin, 0, end - begin, myCols);
+	}
+	/// View of columns [begin, end)
+	CellMatrixView colRange(int begin, int end) const {
+		return block(0, begin, myRows, end - begin);
+	}
+	/// View of every row_step'th row and col_step'th column
+	CellMatrixView strided(int row_step, int col_step) const {
+		if (row_step <= 0 || col_step <= 0)
+			XLKIT_THROW("Cell matrix steps must be positive");
+		return CellMatrixView(myCells,
+							  (myRows + row_step - 1) / row_step,
+							  (myCols + col_step - 1) / col_step,
+							  myRowStride * row_step, myColStride * col_step);
+	}
+	/// Transposed view
+	CellMatrixView transpose() const {
+		return CellMatrixView(myCells, myCols, myRows, myColStride, myRowStride);
+	}
+
+  private:
+	T* myCells;
+	int myRows;
+	int myCols;
+	ptrdiff_t myRowStride;
+	ptrdiff_t myColStride;
+
+	template <typename U> friend class CellMatrixView;
+};
+
+/// Order of the values passed to xlOperand::setMatrix()
+enum MatrixLayout {
+	ROW_MAJOR,		///< Each row is contiguous
+	COLUMN_MAJOR	///< Each column is contiguous
+};
+
+namespace detail {
+
+// Fill cells [1, n) with copies of cells[0], doubling the copied range each
+// time so that most of the work is done by large memcpy's.
+template <typename CELL_T>
+inline void
+broadcastFirstCell(CELL_T* cells, size_t n) {
+	for (size_t k = 1; k < n; ) {
+		size_t m = (k < n - k) ? k : n - k;
+		::memcpy(static_cast<void*>(cells + k), static_cast<const void*>(cells), m * sizeof(CELL_T));
+		k += m;
+	}
+}
+
+} // namespace detail
+
+/// Cell matrices with at least this many cells are shared between copies
+/// instead of being deep copied. See xlOperT::isShared().
+#ifndef XLKIT_SHARED_MATRIX_CELLS
+#define XLKIT_SHARED_MATRIX_CELLS 1024
+#endif
+
+namespace detail {
+
+// Reference count kept in front of the cells of every heap allocated cell
+// matrix so that copies can share them.
+struct MatrixHeader {
+	explicit MatrixHeader(long n) : refs(n) { }
+	std::atomic<long> refs;
+};
+static const size_t MATRIX_HEADER_SIZE = 16;
+
+inline MatrixHeader*
+matrixHeader(const void* cells) {
+	return reinterpret_cast<MatrixHeader*>(
+			   const_cast<char*>(static_cast<const char*>(cells)) - MATRIX_HEADER_SIZE);
+}
+// Allocate bytes for a matrix with a reference count of 1
+inline void*
+allocMatrixBlock(size_t bytes) {
+	char* block = static_cast<char*>(::malloc(MATRIX_HEADER_SIZE + bytes));
+	new (block) MatrixHeader(1);
+	return block + MATRIX_HEADER_SIZE;
+}
+inline void
+retainMatrixBlock(const void* cells) {
+	matrixHeader(cells)->refs.fetch_add(1, std::memory_order_relaxed);
+}
+// Returns true if this was the last reference, in which case the cells must
+// be reset and then freeMatrixBlock() called.
+inline bool
+releaseMatrixBlock(const void* cells) {
+	return (matrixHeader(cells)->refs.fetch_sub(1, std::memory_order_acq_rel) == 1);
+}
+inline bool
+isSharedMatrixBlock(const void* cells) {
+	return (matrixHeader(cells)->refs.load(std::memory_order_acquire) > 1);
+}
+inline void
+freeMatrixBlock(void* cells) {
+	MatrixHeader* header = matrixHeader(cells);
+	header->~MatrixHeader();
+	::free(header);
+}
+
+} // namespace detail
+
+/// Non-owning view of the characters in a string operand
+/// @note Use boost::hash_range(s.begin(), s.end()) to hash it.
+typedef boost::string_ref xlStringRef;
+/// Non-owning view of the characters in an XLOPER12 string operand
+typedef boost::basic_string_ref< XCHAR, std::char_traits<XCHAR> > xlStringRef12;
+
 /// An error number value
 struct xlError {
 	xlError() : num(xlerrNull) { }
@@ -79,7 +321,8 @@ struct xlError {
 			return std::string("xlerrNA");
 		if (num == xlerrGettingData)
 			return std::string("xlerrGettingData");
-		return boost::lexical_cast<std::string>(num);
+		char buf[FORMAT_NUMBER_SIZE];
+		return std::string(buf, formatNumber(num, buf));
 	}
 	/// Compatible name for XLDBG_EXCEPT() macro
 	std::string what() const {
@@ -128,15 +371,92 @@ xltypeString(unsigned int xltype) {
 	return std::string("Unknown xltype") + xlfree;
 }
 
-/// C++ methods that operate on top of an XLOPER struct
-/// @note xlOper4 must *not* contain any data so that its memory layout is
-/// identical to an XLOPER. The two direcly inherited members are the union
-/// val and the uint16_t xltype.
-class xlOper4 : private XLOPER {
+namespace detail {
+
+// Types and limits which differ between XLOPER and XLOPER12 operands
+template <typename XLOPER_T>
+struct OperTraits;
+template <>
+struct OperTraits<XLOPER> {
+	typedef short	Int;
+	static const int MAX_STR_LEN = 255;
+};
+template <>
+struct OperTraits<XLOPER12> {
+	typedef int		Int;
+	static const int MAX_STR_LEN = 32767;
+};
+
+// Copy n characters, converting between char and XCHAR as Latin-1.
+// Characters which don't fit in DST_T are replaced with '?'.
+template <typename DST_T, typename SRC_T>
+inline void
+copyChars(DST_T* dst, const SRC_T* src, size_t n) {
+	typedef typename std::make_unsigned<SRC_T>::type USRC_T;
+	typedef typename std::make_unsigned<DST_T>::type UDST_T;
+	const USRC_T max_char = USRC_T(UDST_T(~UDST_T(0)));
+	for (size_t i = 0; i < n; ++i) {
+		USRC_T c = USRC_T(src[i]);
+		dst[i] = (c <= max_char) ? DST_T(c) : DST_T('?');
+	}
+}
+template <typename CHAR_T>
+inline void
+copyChars(CHAR_T* dst, const CHAR_T* src, size_t n) {
+	::memcpy(dst, src, n * sizeof(CHAR_T));
+}
+
+// Length of a null-terminated string
+template <typename CHAR_T>
+inline size_t
+cStringLength(const CHAR_T* v) {
+	size_t len = 0;
+	while (v[len])
+		++len;
+	return len;
+}
+
+} // namespace detail
+
+/// C++ methods that operate on top of an XLOPER or XLOPER12 struct. Use it
+/// through the xlOper4 (xlOperand) and xlOper12 (xlOperand12) typedefs.
+/// @note xlOperT must *not* contain any data so that its memory layout is
+/// identical to XLOPER_T. The two direcly inherited members are the union
+/// val and the xltype.
+template <typename XLOPER_T, typename CHAR_T>
+class xlOperT : private XLOPER_T {
+
+	using XLOPER_T::xltype;
+	using XLOPER_T::val;
 
   public:
 
+	/// Maximum length of a string
+	static const int MAX_STR_LEN = detail::OperTraits<XLOPER_T>::MAX_STR_LEN;
+
+	/// Non-owning view of the characters in a string operand
+	typedef boost::basic_string_ref< CHAR_T, std::char_traits<CHAR_T> > StringRef;
+
+	/// Contiguous span of the cells in a matrix row
+	/// @{
+	typedef boost::iterator_range<xlOperT*>		RowSpan;
+	typedef boost::iterator_range<const xlOperT*>	ConstRowSpan;
+	/// @}
+	/// Strided span of the cells in a matrix column
+	/// @{
+	typedef boost::iterator_range< detail::StridedIterator<xlOperT> >			ColumnSpan;
+	typedef boost::iterator_range< detail::StridedIterator<const xlOperT> >	ConstColumnSpan;
+	/// @}
+	/// Views of a window of cells in a matrix
+	/// @{
+	typedef CellMatrixView<xlOperT>			View;
+	typedef CellMatrixView<const xlOperT>	ConstView;
+	/// @}
+
 	/// Proxy class into an operand's cell matrix (mutable)
+	/// @note xlOperT::asCellMatrixRef() copies the cells first if they are
+	/// shared with other operands, see xlOperT::isShared(). Use
+	/// ConstCellMatrixRef to read shared cells without copying them.
 	/// @{
 	class CellMatrixRef {
 	  public:
@@ -150,24 +470,89 @@ class xlOper4 : private XLOPER {
 			return myOperand->val.array.columns;
 		}
 
-		/// (row,col) value in matrix 
+		/// (row,col) value in matrix
+		/// @{
+		const xlOperT& operator()(int i, int j) const {
+			return *((xlOperT*)myOperand->val.array.lparray
+					 + (size_t(i) * myOperand->val.array.columns) + j);
+		}
+		xlOperT& operator()(int i, int j) {
+			return *((xlOperT*)myOperand->val.array.lparray
+					 + (size_t(i) * myOperand->val.array.columns) + j);
+		}
+		/// @}
+
+		/// Row-major iterators over all cells, usable with <algorithm> and
+		/// <numeric> including the parallel overloads
+		/// @{
+		typedef xlOperT*			iterator;
+		typedef const xlOperT*	const_iterator;
+		const_iterator begin() const {
+			return (const xlOperT*)myOperand->val.array.lparray;
+		}
+		const_iterator end() const {
+			return begin() + size();
+		}
+		iterator begin() {
+			return (xlOperT*)myOperand->val.array.lparray;
+		}
+		iterator end() {
+			return begin() + size();
+		}
+		/// @}
+		/// Number of cells in matrix
+		size_t size() const {
+			return size_t(myOperand->val.array.rows) * myOperand->val.array.columns;
+		}
+		/// View of all cells, which can be narrowed to a sub-range, strided
+		/// or transposed view without copying
 		/// @{
-		const xlOper4& operator()(int i, int j) const {
-			return *((xlOper4*)myOperand->val.array.lparray
-					 + (i * myOperand->val.array.columns) + j);
+		ConstView view() const {
+			return ConstView(begin(), rows(), cols(), cols(), 1);
 		}
-		xlOper4& operator()(int i, int j) {
-			return *((xlOper4*)myOperand->val.array.lparray
-					 + (i * myOperand->val.array.columns) + j);
+		View view() {
+			return View(begin(), rows(), cols(), cols(), 1);
+		}
+		/// @}
+
+		/// Cells of row i, usable with range-for and <algorithm>
+		/// @{
+		ConstRowSpan row(int i) const {
+			const xlOperT* begin = (const xlOperT*)myOperand->val.array.lparray
+								 + (size_t(i) * myOperand->val.array.columns);
+			return ConstRowSpan(begin, begin + myOperand->val.array.columns);
+		}
+		RowSpan row(int i) {
+			xlOperT* begin = (xlOperT*)myOperand->val.array.lparray
+						   + (size_t(i) * myOperand->val.array.columns);
+			return RowSpan(begin, begin + myOperand->val.array.columns);
+		}
+		/// @}
+
+		/// Cells of column j, usable with range-for and <algorithm>
+		/// @{
+		ConstColumnSpan col(int j) const {
+			typedef detail::StridedIterator<const xlOperT> Iter;
+			const xlOperT* begin = (const xlOperT*)myOperand->val.array.lparray + j;
+			ptrdiff_t stride = myOperand->val.array.columns;
+			return ConstColumnSpan(Iter(begin, stride),
+								   Iter(begin + stride * myOperand->val.array.rows, stride));
+		}
+		ColumnSpan col(int j) {
+			typedef detail::StridedIterator<xlOperT> Iter;
+			xlOperT* begin = (xlOperT*)myOperand->val.array.lparray + j;
+			ptrdiff_t stride = myOperand->val.array.columns;
+			return ColumnSpan(Iter(begin, stride),
+							  Iter(begin + stride * myOperand->val.array.rows, stride));
 		}
 		/// @}
 
 	  private:
-		explicit CellMatrixRef(xlOper4* operand)
+		explicit CellMatrixRef(xlOperT* operand)
 			: myOperand(operand) { }
 
-		xlOper4* myOperand;
-		friend class xlOper4;
+		xlOperT* myOperand;
+		friend class xlOperT;
 		friend class ConstCellMatrixRef;
 	};
 	/// Proxy class into an operand's cell matrix (non-mutable)
@@ -187,79 +572,472 @@ class xlOper4 : private XLOPER {
 			return myOperand->val.array.columns;
 		}
 
-		/// (row,col) value in matrix 
-		const xlOper4& operator()(int i, int j) const {
-			return *((xlOper4*)myOperand->val.array.lparray
-					 + (i * myOperand->val.array.columns) + j);
+		/// (row,col) value in matrix
+		const xlOperT& operator()(int i, int j) const {
+			return *((xlOperT*)myOperand->val.array.lparray
+					 + (size_t(i) * myOperand->val.array.columns) + j);
+		}
+
+		/// Row-major iterators over all cells, usable with <algorithm> and
+		/// <numeric> including the parallel overloads
+		/// @{
+		typedef const xlOperT*	iterator;
+		typedef const xlOperT*	const_iterator;
+		const_iterator begin() const {
+			return (const xlOperT*)myOperand->val.array.lparray;
+		}
+		const_iterator end() const {
+			return begin() + size();
+		}
+		/// @}
+		/// Number of cells in matrix
+		size_t size() const {
+			return size_t(myOperand->val.array.rows) * myOperand->val.array.columns;
+		}
+		/// View of all cells, which can be narrowed to a sub-range, strided
+		/// or transposed view without copying
+		ConstView view() const {
+			return ConstView(begin(), rows(), cols(), cols(), 1);
+		}
+
+		/// Cells of row i, usable with range-for and <algorithm>
+		ConstRowSpan row(int i) const {
+			const xlOperT* begin = (const xlOperT*)myOperand->val.array.lparray
+								 + (size_t(i) * myOperand->val.array.columns);
+			return ConstRowSpan(begin, begin + myOperand->val.array.columns);
+		}
+		/// Cells of column j, usable with range-for and <algorithm>
+		ConstColumnSpan col(int j) const {
+			typedef detail::StridedIterator<const xlOperT> Iter;
+			const xlOperT* begin = (const xlOperT*)myOperand->val.array.lparray + j;
+			ptrdiff_t stride = myOperand->val.array.columns;
+			return ConstColumnSpan(Iter(begin, stride),
+								   Iter(begin + stride * myOperand->val.array.rows, stride));
+		}
+
+		/// Extract column j into out in a single pass. Cells that are
+		/// missing, errors or of an incompatible type are marked as invalid
+		/// instead of throwing. Numbers and bools are valid for double and
+		/// bool columns, strings are valid for StringRef columns.
+		/// @note StringRef values refer to the strings in this matrix.
+		template <typename T>
+		void getColumn(int j, ColumnBuffer<T>& out) const {
+			const int n = rows();
+			out.resize(n);
+			if (isHomogeneous(j, fastType(detail::type_<T>()))) {
+				int i = 0;
+				for (const xlOperT& x : col(j))
+					fastGet(x, out[i++]);
+				out.setAllValid();
+				return;
+			}
+			int i = 0;
+			for (const xlOperT& x : col(j)) {
+				if (getCell(x, out[i]))
+					out.setValid(i);
+				++i;
+			}
+		}
+		/// Extract all columns in a single row-major pass. See getColumn().
+		template <typename T>
+		void getColumns(std::vector< ColumnBuffer<T> >& out) const {
+			const int n = rows();
+			const int m = cols();
+			std::vector< ColumnBuffer<T> > columns(m);
+			for (int j = 0; j < m; ++j)
+				columns[j].resize(n);
+			for (int i = 0; i < n; ++i) {
+				int j = 0;
+				for (const xlOperT& x : row(i)) {
+					if (getCell(x, columns[j][i]))
+						columns[j].setValid(i);
+					++j;
+				}
+			}
+			out.swap(columns);
+		}
+		/// Extract column j as numbers in a single pass. This is the same as
+		/// getColumn<double>() except that strings holding numbers, such as
+		/// those pasted from CSV files, are also converted using
+		/// parseNumber().
+		void parseColumn(int j, ColumnBuffer<double>& out) const {
+			const int n = rows();
+			out.resize(n);
+			int i = 0;
+			for (const xlOperT& x : col(j)) {
+				if (getCell(x, out[i]) || parseCell(x, out[i]))
+					out.setValid(i);
+				++i;
+			}
 		}
 
 	  private:
-		explicit ConstCellMatrixRef(const xlOper4* operand)
+		explicit ConstCellMatrixRef(const xlOperT* operand)
 			: myOperand(operand) { }
 
-		const xlOper4* myOperand;
-		friend class xlOper4;
+		// Returns true if every cell in column j has the given xltype. This
+		// has no data dependent branches so that it vectorizes.
+		bool isHomogeneous(int j, unsigned int type) const {
+			int count = 0;
+			for (const xlOperT& x : col(j))
+				count += (x.xltype == type);
+			return (count == rows());
+		}
+
+		// Cell accessors for the homogeneous case
+		static unsigned int fastType(detail::type_<double>) {
+			return xltypeNum;
+		}
+		static unsigned int fastType(detail::type_<bool>) {
+			return xltypeBool;
+		}
+		static unsigned int fastType(detail::type_<StringRef>) {
+			return xltypeStr;
+		}
+		static void fastGet(const xlOperT& x, double& v) {
+			v = x.val.num;
+		}
+		static void fastGet(const xlOperT& x, bool& v) {
+			v = (x.val.xbool != 0);
+		}
+		static void fastGet(const xlOperT& x, StringRef& v) {
+			v = StringRef(x.val.str + 1, strLen(x.val.str));
+		}
+
+		// Convert a cell into a column value without throwing. Returns
+		// false if the cell does not have a compatible value.
+		static bool getCell(const xlOperT& x, double& v) {
+			if (x.xltype == xltypeNum) {
+				v = x.val.num;
+				return true;
+			}
+			if (x.xltype == xltypeInt) {
+				v = x.val.w;
+				return true;
+			}
+			if (x.xltype == xltypeBool) {
+				v = (x.val.xbool != 0) ? 1.0 : 0.0;
+				return true;
+			}
+			v = 0.0;
+			return false;
+		}
+		static bool getCell(const xlOperT& x, bool& v) {
+			if (x.xltype == xltypeBool) {
+				v = (x.val.xbool != 0);
+				return true;
+			}
+			if (x.xltype == xltypeNum) {
+				v = (x.val.num != 0);
+				return true;
+			}
+			if (x.xltype == xltypeInt) {
+				v = (x.val.w != 0);
+				return true;
+			}
+			v = false;
+			return false;
+		}
+		static bool getCell(const xlOperT& x, StringRef& v) {
+			if (x.isString()) {
+				v = StringRef(x.val.str + 1, strLen(x.val.str));
+				return true;
+			}
+			v = StringRef();
+			return false;
+		}
+		static bool parseCell(const xlOperT& x, double& v) {
+			if (!x.isString())
+				return false;
+			const CHAR_T* str = x.val.str + 1;
+			return parseNumber(str, str + strLen(x.val.str), v);
+		}
+
+		const xlOperT* myOperand;
+		friend class xlOperT;
 	};
-	friend class xlOper4::CellMatrixRef;
-	friend class xlOper4::ConstCellMatrixRef;
+	friend class CellMatrixRef;
+	friend class ConstCellMatrixRef;
 	/// @}
 
+	/// Builds a cell matrix whose cells and strings share a single
+	/// allocation so that freeing it only takes one ::free(). Values are
+	/// staged first so that build() can size the block exactly. Small
+	/// matrices, such as typical 1xN results, are staged without any heap
+	/// allocation.
+	class MatrixBuilder {
+	  public:
+		/// If intern_strings is true, identical strings are stored only once
+		/// and shared by all of the cells that hold them. This is worthwhile
+		/// for columns of repeated values such as currency codes. The
+		/// shared strings are freed together with the matrix.
+		MatrixBuilder(int rows, int cols, bool intern_strings = false)
+			: myRows(rows)
+			, myCols(cols)
+			, myCells(myInlineCells)
+			, myPoolSize(0)
+			, myIntern(intern_strings)
+			, myNumInterned(0) {
+			size_t n = size_t(rows) * cols;
+			if (n > INLINE_CELLS) {
+				myHeapCells.resize(n);
+				myCells = myHeapCells.data();
+			}
+			for (size_t i = 0; i < n; ++i) {
+				myCells[i].xltype = xltypeMissing;
+				myCells[i].val.num = 0;
+			}
+		}
+
+		/// Rows in matrix
+		int rows() const {
+			return myRows;
+		}
+		/// Columns in matrix
+		int cols() const {
+			return myCols;
+		}
+
+		/// Set the (row,col) value in the matrix
+		/// @note Strings are truncated to MAX_STR_LEN characters and
+		/// converted between char and XCHAR as Latin-1.
+		/// @{
+		void set(int i, int j, double v) {
+			XLOPER_T& c = cell(i, j);
+			c.xltype = xltypeNum;
+			c.val.num = v;
+		}
+		void set(int i, int j, int v) {
+			XLOPER_T& c = cell(i, j);
+			c.xltype = xltypeInt;
+			c.val.w = typename detail::OperTraits<XLOPER_T>::Int(v);
+		}
+		void set(int i, int j, bool v) {
+			XLOPER_T& c = cell(i, j);
+			c.xltype = xltypeBool;
+			c.val.xbool = v;
+		}
+		void set(int i, int j, xlError num) {
+			XLOPER_T& c = cell(i, j);
+			c.xltype = xltypeErr;
+			c.val.err = num.num;
+		}
+		void set(int i, int j, const char* v, size_t len) {
+			setString(i, j, v, len);
+		}
+		void set(int i, int j, const std::string& v) {
+			setString(i, j, v.data(), v.size());
+		}
+		void set(int i, int j, const char* v) {
+			setString(i, j, v, ::strlen(v));
+		}
+		void set(int i, int j, const XCHAR* v, size_t len) {
+			setString(i, j, v, len);
+		}
+		void set(int i, int j, const std::wstring& v) {
+			setString(i, j, v.data(), v.size());
+		}
+		void set(int i, int j, const XCHAR* v) {
+			setString(i, j, v, detail::cStringLength(v));
+		}
+		/// @}
+
+		/// Store the built matrix into dst. A 1x1 matrix is stored as a
+		/// plain value since Excel treats both identically.
+		void build(xlOperT& dst) const {
+			size_t n = size_t(myRows) * myCols;
+			if (n == 1) {
+				dst.reset();
+				if (myCells[0].xltype == xltypeStr) {
+					const CHAR_T* src = poolData() + reinterpret_cast<uintptr_t>(myCells[0].val.str);
+					size_t bytes = (strLen(src) + 1) * sizeof(CHAR_T);
+					int xlbit;
+					dst.val.str = reinterpret_cast<CHAR_T*>(allocate(&dst, bytes, xlbit));
+					dst.xltype = xltypeStr | xlbit;
+					::memcpy(dst.val.str, src, bytes);
+				} else {
+					// Staged values other than strings own no memory
+					static_cast<XLOPER_T&>(dst) = myCells[0];
+				}
+				return;
+			}
+			char* pool;
+			dst.allocMatrix(myRows, myCols, myPoolSize * sizeof(CHAR_T), pool);
+			XLOPER_T* cells = dst.val.array.lparray;
+			CHAR_T* strings = reinterpret_cast<CHAR_T*>(pool);
+			::memcpy(cells, myCells, n * sizeof(XLOPER_T));
+			::memcpy(strings, poolData(), myPoolSize * sizeof(CHAR_T));
+			for (size_t i = 0; i < n; ++i) {
+				if (cells[i].xltype == xltypeStr)
+					cells[i].val.str = strings + reinterpret_cast<uintptr_t>(cells[i].val.str);
+			}
+		}
+
+	  private:
+		static const size_t INLINE_CELLS = 16;
+		static const size_t INLINE_POOL = 256;
+
+		XLOPER_T& cell(int i, int j) {
+			return myCells[size_t(i) * myCols + j];
+		}
+		const CHAR_T* poolData() const {
+			return myHeapPool.empty() ? myInlinePool : myHeapPool.data();
+		}
+		template <typename SRC_T>
+		void setString(int i, int j, const SRC_T* v, size_t len) {
+			if (len > size_t(MAX_STR_LEN))
+				len = MAX_STR_LEN;
+			// Store the offset into the pool until build() is called
+			size_t offset = poolAdd(v, len);
+			if (myIntern)
+				offset = intern(offset);
+			XLOPER_T& c = cell(i, j);
+			c.xltype = xltypeStr;
+			c.val.str = reinterpret_cast<CHAR_T*>(offset);
+		}
+		// Append a counted string to the pool, returning its offset
+		template <typename SRC_T>
+		size_t poolAdd(const SRC_T* v, size_t len) {
+			size_t offset = myPoolSize;
+			CHAR_T* dst = poolAppend(len + 1);
+			dst[0] = CHAR_T(len);
+			detail::copyChars(dst + 1, v, len);
+			return offset;
+		}
+		// Return the pool offset of an earlier copy of the string that was
+		// just added at offset, dropping the new copy, or else remember it.
+		// mySlots is an open addressing hash table of offset+1, where 0
+		// marks an empty slot.
+		size_t intern(size_t offset) {
+			if (mySlots.empty())
+				mySlots.resize(64, 0);
+			const CHAR_T* v = poolData() + offset;
+			size_t len = strLen(v);
+			size_t mask = mySlots.size() - 1;
+			for (size_t k = boost::hash_range(v + 1, v + 1 + len) & mask; ; k = (k + 1) & mask) {
+				if (mySlots[k] == 0) {
+					mySlots[k] = offset + 1;
+					if (++myNumInterned * 2 > mySlots.size())
+						growSlots();
+					return offset;
+				}
+				const CHAR_T* s = poolData() + mySlots[k] - 1;
+				if (strLen(s) == len && ::memcmp(s + 1, v + 1, len * sizeof(CHAR_T)) == 0) {
+					myPoolSize = offset;
+					return mySlots[k] - 1;
+				}
+			}
+		}
+		void growSlots() {
+			std::vector<size_t> slots(2 * mySlots.size(), 0);
+			size_t mask = slots.size() - 1;
+			for (size_t offset1 : mySlots) {
+				if (offset1 == 0)
+					continue;
+				const CHAR_T* s = poolData() + offset1 - 1;
+				size_t k = boost::hash_range(s + 1, s + 1 + strLen(s)) & mask;
+				while (slots[k] != 0)
+					k = (k + 1) & mask;
+				slots[k] = offset1;
+			}
+			mySlots.swap(slots);
+		}
+		// Reserve n more characters at the end of the string pool
+		CHAR_T* poolAppend(size_t n) {
+			size_t offset = myPoolSize;
+			myPoolSize += n;
+			if (myHeapPool.empty()) {
+				if (myPoolSize <= INLINE_POOL)
+					return myInlinePool + offset;
+				myHeapPool.reserve(2 * myPoolSize);
+				myHeapPool.assign(myInlinePool, myInlinePool + offset);
+			}
+			myHeapPool.resize(myPoolSize);
+			return myHeapPool.data() + offset;
+		}
+
+		MatrixBuilder(const MatrixBuilder&);
+		MatrixBuilder& operator=(const MatrixBuilder&);
+
+		int myRows;
+		int myCols;
+		XLOPER_T* myCells;
+		XLOPER_T myInlineCells[INLINE_CELLS];
+		std::vector<XLOPER_T> myHeapCells;
+		size_t myPoolSize;
+		CHAR_T myInlinePool[INLINE_POOL];
+		std::vector<CHAR_T> myHeapPool;
+		bool myIntern;
+		size_t myNumInterned;
+		std::vector<size_t> mySlots;
+	};
+
 	/// Default constructor, initializes as xltypeMissing
-	xlOper4() {
+	xlOperT() {
 		init();
 	}
-	~xlOper4() {
+	~xlOperT() {
 		reset();
 	}
-	xlOper4(const xlOper4& other) {
+	xlOperT(const xlOperT& other) {
 		init();
 		*this = other;
 	}
-	xlOper4(xlOper4&& other) {
+	xlOperT(xlOperT&& other) {
 		init();
 		*this = std::move(other);
 	}
 
 	/// Construct a double precision floating point number
-	explicit xlOper4(double v) {
+	explicit xlOperT(double v) {
 		init();
 		set(v);
 	}
 	/// Construct an integer
-	explicit xlOper4(int v) {
+	explicit xlOperT(int v) {
 		init();
 		set(v);
 	}
 	/// Construct from an std::string
-	explicit xlOper4(const std::string& v) {
+	explicit xlOperT(const std::string& v) {
 		init();
 		set(v);
 	}
 	/// Construct from a C-style null-terminated string
-	explicit xlOper4(const char* v) {
+	explicit xlOperT(const char* v) {
+		init();
+		set(v);
+	}
+	/// Construct from an std::wstring
+	explicit xlOperT(const std::wstring& v) {
+		init();
+		set(v);
+	}
+	/// Construct from a C-style null-terminated wide string
+	explicit xlOperT(const XCHAR* v) {
 		init();
 		set(v);
 	}
 	/// Construct a bool
-	explicit xlOper4(bool v) {
+	explicit xlOperT(bool v) {
 		init();
 		set(v);
 	}
 	/// Construct an error number (xlerrValue, xlerrNA, etc..)
 	/// @note See xlcall.h
-	explicit xlOper4(xlError num) {
+	explicit xlOperT(xlError num) {
 		init();
 		set(num);
 	}
 	/// Construct a cell matrix of given size
 	/// @note If init_val, is not given, it will be set to a matrix of
 	/// of all xltypeMissing elements.
-	explicit xlOper4(int rows, int cols, xlOper4* init_val = NULL) {
+	explicit xlOperT(int rows, int cols, xlOperT* init_val = NULL) {
 		init();
 		setMatrix(rows, cols, init_val);
 	}
 	/// Construct a copy of a cell matrix
-	explicit xlOper4(ConstCellMatrixRef cell_ref) {
+	explicit xlOperT(ConstCellMatrixRef cell_ref) {
 		init();
 		set(cell_ref);
 	}
@@ -274,31 +1052,95 @@ class xlOper4 : private XLOPER {
 		} else if (xltype & xltypeMulti) {
 			if (xltype & xlbitXLFree)
 				XLKIT_THROW("Cannot reset memory allocated by Excel!");
-			else if (xltype & xlbitDLLFree)
-				::free(reinterpret_cast<void*>(val.array.lparray));
+			else if (xltype & xlbitDLLFree) {
+				if (detail::releaseMatrixBlock(val.array.lparray)) {
+					// Elements may own memory separately from the matrix
+					xlOperT* cells = reinterpret_cast<xlOperT*>(val.array.lparray);
+					for (size_t i = 0, n = size_t(val.array.rows) * val.array.columns; i < n; ++i)
+						cells[i].reset();
+					detail::freeMatrixBlock(val.array.lparray);
+				}
+			}
 		}
 		init();
 	}
 
+	/// Ensure that the value does not reference CallArena memory so that it
+	/// can outlive the current function call
+	void promote() {
+		if (isString()) {
+			if (CallArena::owns(val.str)) {
+				CallArena::Pause pause;
+				set(get<String>());
+			}
+		} else if (isCellMatrix()) {
+			if (CallArena::owns(val.array.lparray)) {
+				CallArena::Pause pause;
+				xlOperT copy(get<ConstCellMatrixRef>());
+				*this = std::move(copy);
+			} else if (referencesArena()) {
+				// Only unshare the cells when some of them need promoting
+				CellMatrixRef dst(asCellMatrixRef());
+				for (xlOperT& cell : dst)
+					cell.promote();
+			}
+		}
+	}
+
+	/// Returns true if this is a cell matrix whose cells are shared with
+	/// copies of it. Copying a heap allocated matrix with at least
+	/// XLKIT_SHARED_MATRIX_CELLS cells shares them instead of copying.
+	/// asCellMatrixRef() unshares the cells, so that modifications through
+	/// the CellMatrixRef it returns only affect this operand.
+	/// @note A CellMatrixRef, cell reference or iterator obtained before
+	/// copying still points into the shared cells, so get a new one from
+	/// asCellMatrixRef() after copying to modify them.
+	bool isShared() const {
+		return (isCellMatrix() && (xltype & xlbitDLLFree)
+				&& detail::isSharedMatrixBlock(val.array.lparray));
+	}
+	/// Make the cells of a shared cell matrix private to this operand
+	void unshare() {
+		if (isShared()) {
+			CallArena::Pause pause;
+			xlOperT copy;
+			copy.set(get<ConstCellMatrixRef>());
+			*this = std::move(copy);
+		}
+	}
+
 	/// Assignment operator
-	xlOper4& operator=(const xlOper4& other) {
+	xlOperT& operator=(const xlOperT& other) {
 		if (this != &other) {
 			if (other.isString()) {
-				set(other.get<std::string>());
+				set(other.get<String>());
 			} else if (other.isCellMatrix()) {
-				set(other.get<ConstCellMatrixRef>());
+				if ((other.xltype & xlbitDLLFree)
+						&& other.get<ConstCellMatrixRef>().size() >= XLKIT_SHARED_MATRIX_CELLS
+						&& !CallArena::owns(this)) {
+					// Share the cells until one of the copies is modified
+					detail::retainMatrixBlock(other.val.array.lparray);
+					reset();
+					static_cast<XLOPER_T&>(*this) = static_cast<const XLOPER_T&>(other);
+				} else {
+					set(other.get<ConstCellMatrixRef>());
+				}
 			} else {
 				reset();
-				::memcpy(this, &other, sizeof(*this));
+				static_cast<XLOPER_T&>(*this) = static_cast<const XLOPER_T&>(other);
 			}
 		}
 		return *this;
 	}
 	/// Assignment move operator
-	xlOper4& operator=(xlOper4&& other) {
+	/// @note Heap memory is copied rather than moved into an operand that
+	/// lives in CallArena memory, eg. a cell of a matrix allocated from it.
+	xlOperT& operator=(xlOperT&& other) {
+		if ((other.xltype & xlbitDLLFree) && CallArena::owns(this))
+			return *this = static_cast<const xlOperT&>(other);
 		if (this != &other) {
 			reset();
-			::memcpy(this, &other, sizeof(*this));
+			static_cast<XLOPER_T&>(*this) = static_cast<const XLOPER_T&>(other);
 			other.init();
 		}
 		return *this;
@@ -326,6 +1168,9 @@ class xlOper4 : private XLOPER {
 	inline bool isMissing() const {
 		return (xltype == xltypeMissing);
 	}
+	inline bool isNil() const {
+		return (xltype == xltypeNil);
+	}
 	inline bool isCellMatrix() const {
 		return (   xltype ==  xltypeMulti
 				   || xltype == (xltypeMulti|xlbitXLFree)
@@ -334,43 +1179,56 @@ class xlOper4 : private XLOPER {
 	/// @}
 
 	template <typename T> T get() const {
+		return get(detail::type_<T>());
+	}
+	template <typename T> T get(detail::type_<T>) const {
 		static_assert( detail::unimplemented<T>::value
-					   , "Only specializations of get<>() const may be used" );
+					   , "Only the types overloaded for get() const may be used" );
 	}
 
-	template <>
-	double get<double>() const {
+	double get(detail::type_<double>) const {
 		if (!isDouble())
 			return castValue<double>();
 		return val.num;
 	}
-	template <>
-	int get<int>() const {
+	int get(detail::type_<int>) const {
 		if (!isInteger())
 			return castValue<int>();
 		return val.w;
 	}
-	template <>
-	std::string get<std::string>() const {
+	/// @note For xlOper12, characters outside of Latin-1 are replaced
+	/// with '?'
+	std::string get(detail::type_<std::string>) const {
 		if (!isString())
 			return castValue<std::string>();
-		uint8_t* blen = reinterpret_cast<uint8_t*>(&val.str[0]);
-		return std::string(reinterpret_cast<char *>(val.str + 1), *blen);
+		std::string str(strLen(val.str), '\0');
+		detail::copyChars(&str[0], val.str + 1, str.size());
+		return str;
 	}
-	template <>
-	bool get<bool>() const {
+	std::wstring get(detail::type_<std::wstring>) const {
+		if (!isString())
+			return castValue<std::wstring>();
+		std::wstring str(strLen(val.str), L'\0');
+		detail::copyChars(&str[0], val.str + 1, str.size());
+		return str;
+	}
+	/// @note The view is only valid for as long as the operand is unchanged
+	StringRef get(detail::type_<StringRef>) const {
+		if (!isString())
+			XLKIT_THROW("Cannot cast to StringRef from " + xltypeString(xltype));
+		return StringRef(val.str + 1, strLen(val.str));
+	}
+	bool get(detail::type_<bool>) const {
 		if (!isBool())
 			return castValue<bool>();
 		return (val.xbool != 0);
 	}
-	template <>
-	xlError get<xlError>() const {
+	xlError get(detail::type_<xlError>) const {
 		if (!isError())
 			XLKIT_THROW("Cannot cast to xlError from " + xltypeString(xltype));
 		return xlError(val.err);
 	}
-	template <>
-	ConstCellMatrixRef get<ConstCellMatrixRef>() const {
+	ConstCellMatrixRef get(detail::type_<ConstCellMatrixRef>) const {
 		if (!isCellMatrix())
 			XLKIT_THROW("Cannot cast to ConstCellMatrixRef from " + xltypeString(xltype));
 		return ConstCellMatrixRef(this);
@@ -378,35 +1236,100 @@ class xlOper4 : private XLOPER {
 
 	/// Make a matrix of the given size and return a ref to it.
 	/// @note If init_val, is not given, all elements will be xltypeMissing.
+	/// A string init_val is stored once and shared by all the cells.
 	CellMatrixRef
-	setMatrix(int rows, int cols, xlOper4* init_val = NULL) {
-		reset();
-		xltype = xltypeMulti | xlbitDLLFree;
-		val.array.rows = rows;
-		val.array.columns = cols;
-		val.array.lparray = reinterpret_cast<XLOPER*>(
-								::malloc(rows * cols * sizeof(xlOper4)));
-		CellMatrixRef dst(this);
-		if (init_val) {
-			for (int i = 0; i < rows; ++i) {
-				for (int j = 0; j < cols; ++j) {
-					dst(i, j) = *init_val;
+	setMatrix(int rows, int cols, xlOperT* init_val = NULL) {
+		const size_t n = size_t(rows) * cols;
+		if (init_val && init_val->isCellMatrix()) {
+			char* unused;
+			CellMatrixRef dst(allocMatrix(rows, cols, 0, unused));
+			for (size_t k = 0; k < n; ++k) {
+				dst.begin()[k].init();
+				dst.begin()[k] = *init_val;
+			}
+			return CellMatrixRef(this);
+		}
+
+		// Set up the first cell and then replicate it
+		const bool is_string = (init_val && init_val->isString());
+		size_t pool_size = is_string ? (init_val->stringLength() + 1) * sizeof(CHAR_T) : 0;
+		char* pool;
+		CellMatrixRef dst(allocMatrix(rows, cols, pool_size, pool));
+		if (n == 0)
+			return CellMatrixRef(this);
+		xlOperT& first = dst.begin()[0];
+		if (is_string) {
+			::memcpy(pool, init_val->val.str, pool_size);
+			first.xltype = xltypeStr;
+			first.val.str = reinterpret_cast<CHAR_T*>(pool);
+		} else if (init_val) {
+			static_cast<XLOPER_T&>(first) = static_cast<const XLOPER_T&>(*init_val);
+		} else {
+			first.init();
+		}
+		detail::broadcastFirstCell(dst.begin(), n);
+		return CellMatrixRef(this);
+	}
+	/// Make a rows x cols matrix from the values in data, which are in the
+	/// given layout. Numbers become xltypeNum cells, except that values
+	/// which are not finite become #NUM! errors. bool values become
+	/// xltypeBool cells. If error_mask is given, it has the same layout as
+	/// data, and cells which are true in it are set to error instead.
+	template <typename T>
+	CellMatrixRef
+	setMatrix(int rows, int cols, const T* data, MatrixLayout layout = ROW_MAJOR,
+			  const bool* error_mask = NULL, xlError error = xlError(xlerrNA)) {
+		static_assert(std::is_arithmetic<T>::value, "T must be arithmetic");
+		char* unused;
+		CellMatrixRef dst(allocMatrix(rows, cols, 0, unused));
+		xlOperT* cells = dst.begin();
+		const size_t n = size_t(rows) * cols;
+		typename std::is_same<T, bool>::type is_bool;
+		if (layout == ROW_MAJOR) {
+			for (size_t k = 0; k < n; ++k)
+				cells[k].setCellValue(data[k], is_bool);
+			if (error_mask) {
+				for (size_t k = 0; k < n; ++k) {
+					if (error_mask[k])
+						cells[k].setCellError(error);
 				}
 			}
 		} else {
-			for (int i = 0; i < rows; ++i) {
-				for (int j = 0; j < cols; ++j) {
-					dst(i, j).init();
+			// Transpose in tiles to keep both sides in cache
+			const int TILE = 32;
+			for (int j0 = 0; j0 < cols; j0 += TILE) {
+				const int j1 = (cols - j0 < TILE) ? cols : j0 + TILE;
+				for (int i0 = 0; i0 < rows; i0 += TILE) {
+					const int i1 = (rows - i0 < TILE) ? rows : i0 + TILE;
+					for (int j = j0; j < j1; ++j) {
+						for (int i = i0; i < i1; ++i) {
+							size_t k = size_t(j) * rows + i;
+							xlOperT& cell = cells[size_t(i) * cols + j];
+							cell.setCellValue(data[k], is_bool);
+							if (error_mask && error_mask[k])
+								cell.setCellError(error);
+						}
+					}
 				}
 			}
 		}
 		return CellMatrixRef(this);
 	}
+	/// Make a rows x cols matrix from the values in data. See above.
+	template <typename T>
+	CellMatrixRef
+	setMatrix(int rows, int cols, const std::vector<T>& data, MatrixLayout layout = ROW_MAJOR,
+			  const bool* error_mask = NULL, xlError error = xlError(xlerrNA)) {
+		if (data.size() != size_t(rows) * cols)
+			XLKIT_THROW("Data size does not match the matrix size");
+		return setMatrix(rows, cols, data.data(), layout, error_mask, error);
+	}
 	/// Obtain cell matrix reference
 	/// @{
 	CellMatrixRef asCellMatrixRef() {
 		if (!isCellMatrix())
 			XLKIT_THROW("Cannot cast to CellMatrixRef from " + xltypeString(xltype));
+		unshare();
 		return CellMatrixRef(this);
 	}
 	ConstCellMatrixRef asCellMatrixRef() const {
@@ -420,7 +1343,7 @@ class xlOper4 : private XLOPER {
 	int stringLength() const {
 		if (!isString())
 			XLKIT_THROW("Not a string");
-		return *(reinterpret_cast<uint8_t*>(&val.str[0]));
+		return int(strLen(val.str));
 	}
 	/// For a cell matrix, return its number of rows
 	int cellMatrixRows() const {
@@ -436,6 +1359,8 @@ class xlOper4 : private XLOPER {
 	}
 
 	/// Set a new value
+	/// @note Strings are truncated to MAX_STR_LEN characters and converted
+	/// between char and XCHAR as Latin-1.
 	/// @{
 	void set(double v) {
 		reset();
@@ -445,29 +1370,19 @@ class xlOper4 : private XLOPER {
 	void set(int v) {
 		reset();
 		xltype = xltypeInt;
-		val.w = (int16_t)v;
+		val.w = typename detail::OperTraits<XLOPER_T>::Int(v);
 	}
 	void set(const std::string& v) {
-		reset();
-		xltype = xltypeStr | xlbitDLLFree;
-		size_t len = v.size();
-		val.str = reinterpret_cast<char*>(::malloc((len+1) * sizeof(uint8_t)));
-		uint8_t* blen = reinterpret_cast<uint8_t*>(&val.str[0]);
-		*blen = uint8_t(len < 255 ? len : 255);
-		XLKIT_PUSH_DISABLE_WARN_DEPRECATION
-		::strncpy(reinterpret_cast<char *>(val.str + 1), v.data(), len);
-		XLKIT_POP_DISABLE_WARN_DEPRECATION
+		setString(v.data(), v.size());
 	}
 	void set(const char* v) {
-		reset();
-		xltype = xltypeStr | xlbitDLLFree;
-		size_t len = ::strlen(v);
-		val.str = reinterpret_cast<char*>(::malloc((len+1) * sizeof(uint8_t)));
-		uint8_t* blen = reinterpret_cast<uint8_t*>(&val.str[0]);
-		*blen = uint8_t(len < 255 ? len : 255);
-		XLKIT_PUSH_DISABLE_WARN_DEPRECATION
-		::strncpy(reinterpret_cast<char *>(val.str + 1), v, len);
-		XLKIT_POP_DISABLE_WARN_DEPRECATION
+		setString(v, ::strlen(v));
+	}
+	void set(const std::wstring& v) {
+		setString(v.data(), v.size());
+	}
+	void set(const XCHAR* v) {
+		setString(v, detail::cStringLength(v));
 	}
 	void set(bool v) {
 		reset();
@@ -479,11 +1394,81 @@ class xlOper4 : private XLOPER {
 		xltype = xltypeErr;
 		val.err = num;
 	}
+	/// @note The copied strings are stored in the same allocation as the
+	/// cells of the matrix.
 	void set(ConstCellMatrixRef src) {
-		CellMatrixRef dst(setMatrix(src.rows(), src.cols()));
-		for (int i = 0, rows = src.rows(); i < rows; ++i) {
-			for (int j = 0, cols = src.cols(); j < cols; ++j) {
-				dst(i, j) = src(i, j);
+		set(src.view());
+	}
+	/// Copy the cells of a view into a new matrix, which may be a
+	/// transposed view or a window of this operand's own matrix. The cells
+	/// are copied in tiles so that both the source and destination are
+	/// accessed with good cache locality.
+	/// @note The copied strings are stored in the same allocation as the
+	/// cells of the matrix.
+	void set(const ConstView& src) {
+		const int rows = src.rows();
+		const int cols = src.cols();
+
+		// Build into a temporary if src refers to our own cells
+		if (isCellMatrix() && src.size() > 0) {
+			const xlOperT* begin = reinterpret_cast<const xlOperT*>(val.array.lparray);
+			const xlOperT* end = begin + get<ConstCellMatrixRef>().size();
+			if (&src(0, 0) >= begin && &src(0, 0) < end) {
+				xlOperT copy;
+				copy.set(src);
+				*this = std::move(copy);
+				return;
+			}
+		}
+
+		// Size the strings up front
+		size_t pool_size = 0;
+		bool nested = false;
+		for (int i = 0; i < rows; ++i) {
+			for (int j = 0; j < cols; ++j) {
+				const xlOperT& x = src(i, j);
+				if (x.isString())
+					pool_size += (x.stringLength() + 1) * sizeof(CHAR_T);
+				else if (x.isCellMatrix())
+					nested = true;
+			}
+		}
+		if (nested) {
+			CellMatrixRef dst(setMatrix(rows, cols));
+			for (int i = 0; i < rows; ++i) {
+				for (int j = 0; j < cols; ++j) {
+					dst(i, j) = src(i, j);
+				}
+			}
+			return;
+		}
+
+		char* pool;
+		CellMatrixRef dst(allocMatrix(rows, cols, pool_size, pool));
+		const int TILE = 32;
+		for (int i0 = 0; i0 < rows; i0 += TILE) {
+			const int i1 = (rows - i0 < TILE) ? rows : i0 + TILE;
+			for (int j0 = 0; j0 < cols; j0 += TILE) {
+				const int j1 = (cols - j0 < TILE) ? cols : j0 + TILE;
+				for (int i = i0; i < i1; ++i) {
+					for (int j = j0; j < j1; ++j) {
+						const xlOperT& x = src(i, j);
+						xlOperT& y = dst(i, j);
+						if (x.isString()) {
+							size_t n = (x.stringLength() + 1) * sizeof(CHAR_T);
+							::memcpy(pool, x.val.str, n);
+							y.xltype = xltypeStr;
+							y.val.str = reinterpret_cast<CHAR_T*>(pool);
+							pool += n;
+						} else {
+							// Nested matrices were handled above, so the cell
+							// owns no memory and copying its XLOPER_T bits is
+							// a complete copy. y is uninitialized, so this
+							// must not go through operator=.
+							static_cast<XLOPER_T&>(y) = static_cast<const XLOPER_T&>(x);
+						}
+					}
+				}
 			}
 		}
 	}
@@ -491,40 +1476,160 @@ class xlOper4 : private XLOPER {
 
   private: // methods
 
+	// Owning string with the same characters as a string operand
+	typedef typename std::conditional< std::is_same<CHAR_T, char>::value
+									 , std::string, std::wstring >::type String;
+
+	// Length of a counted string
+	static size_t strLen(const CHAR_T* str) {
+		return size_t(typename std::make_unsigned<CHAR_T>::type(str[0]));
+	}
+
 	// Mimic default ctor behaviour, assumes we're uninitialized
 	inline void init() {
 		xltype = xltypeMissing;
 		val.num = 0;
 	}
 
+	// Returns true if the value or any of its cells uses CallArena memory
+	bool referencesArena() const {
+		if (isString())
+			return CallArena::owns(val.str);
+		if (isCellMatrix()) {
+			if (CallArena::owns(val.array.lparray))
+				return true;
+			for (const xlOperT& cell : get<ConstCellMatrixRef>()) {
+				if (cell.referencesArena())
+					return true;
+			}
+		}
+		return false;
+	}
+
+	// Cell setters for setMatrix(), which assume that we own no memory
+	template <typename T>
+	void setCellValue(T v, std::false_type /*is_bool*/) {
+		double x = double(v);
+		if (std::isfinite(x)) {
+			xltype = xltypeNum;
+			val.num = x;
+		} else {
+			xltype = xltypeErr;
+			val.err = xlerrNum;
+		}
+	}
+	void setCellValue(bool v, std::true_type /*is_bool*/) {
+		xltype = xltypeBool;
+		val.xbool = v;
+	}
+	void setCellError(xlError error) {
+		xltype = xltypeErr;
+		val.err = error.num;
+	}
+
+	// Allocate memory for a value stored in owner, from the CallArena if it's
+	// active or owner lives in arena memory. Nothing resets the cells of
+	// arena matrices, so they must not own heap memory.
+	// xlbit is set to the ownership bit that the value must be marked with.
+	static void* allocate(const void* owner, size_t bytes, int& xlbit) {
+		void* p = CallArena::allocate(bytes);
+		if (!p)
+			p = CallArena::allocateFor(owner, bytes);
+		if (p) {
+			xlbit = 0;
+			return p;
+		}
+		xlbit = xlbitDLLFree;
+		return ::malloc(bytes);
+	}
+
+	// Make an uninitialized rows x cols matrix. extra is set to extra_bytes
+	// of storage following the cells in the same allocation. Heap matrices
+	// are preceded by a detail::MatrixHeader.
+	CellMatrixRef allocMatrix(int rows, int cols, size_t extra_bytes, char*& extra) {
+		reset();
+		size_t cell_bytes = size_t(rows) * cols * sizeof(xlOperT);
+		char* block = reinterpret_cast<char*>(CallArena::allocate(cell_bytes + extra_bytes));
+		if (!block)
+			block = reinterpret_cast<char*>(CallArena::allocateFor(this, cell_bytes + extra_bytes));
+		if (block) {
+			xltype = xltypeMulti;
+		} else {
+			block = reinterpret_cast<char*>(detail::allocMatrixBlock(cell_bytes + extra_bytes));
+			xltype = xltypeMulti | xlbitDLLFree;
+		}
+		val.array.lparray = reinterpret_cast<XLOPER_T*>(block);
+		val.array.rows = rows;
+		val.array.columns = cols;
+		extra = block + cell_bytes;
+		return CellMatrixRef(this);
+	}
+
+	// Make a counted string from len characters of v, truncating to
+	// MAX_STR_LEN
+	template <typename SRC_T>
+	void setString(const SRC_T* v, size_t len) {
+		reset();
+		if (len > size_t(MAX_STR_LEN))
+			len = MAX_STR_LEN;
+		int xlbit;
+		val.str = reinterpret_cast<CHAR_T*>(allocate(this, (len+1) * sizeof(CHAR_T), xlbit));
+		xltype = xltypeStr | xlbit;
+		val.str[0] = CHAR_T(len);
+		detail::copyChars(val.str + 1, v, len);
+	}
+
 	template <typename T>
 	T castValue() const {
+		return castValue(detail::type_<T>());
+	}
+	template <typename T>
+	T castValue(detail::type_<T>) const {
 		// Casting to a number
 		if (isDouble())
 			return (T)(get<double>());
 		if (isInteger())
 			return (T)(get<int>());
-		if (isString())
-			return boost::lexical_cast<T>(get<std::string>());
+		if (isString()) {
+			StringRef str = get<StringRef>();
+			T value;
+			if (!parseNumber(str.begin(), str.end(), value))
+				XLKIT_THROW("Cannot convert to number from string: " + get<std::string>());
+			return value;
+		}
 		if (isBool())
 			return (T)(get<bool>());
 		XLKIT_THROW("Unsupported conversion from " + xltypeString(xltype));
 	}
-	template <>
-	std::string castValue<std::string>() const {
+	std::string castValue(detail::type_<std::string>) const {
 		// Casting to a string
+		char buf[FORMAT_NUMBER_SIZE];
 		if (isDouble())
-			return boost::lexical_cast<std::string>(get<double>());
+			return std::string(buf, formatNumber(get<double>(), buf));
 		if (isInteger())
-			return boost::lexical_cast<std::string>(get<int>());
+			return std::string(buf, formatNumber(get<int>(), buf));
 		if (isBool())
-			return boost::lexical_cast<std::string>(get<bool>());
+			return std::string(get<bool>() ? "1" : "0");
 		if (isError())
 			return xlError(val.err).str();
 		XLKIT_THROW("Cannot cast to string from " + xltypeString(xltype));
 	}
-	template <>
-	bool castValue<bool>() const {
+	std::wstring castValue(detail::type_<std::wstring>) const {
+		// Casting to a wide string
+		char buf[FORMAT_NUMBER_SIZE];
+		if (isDouble())
+			return std::wstring(buf, buf + formatNumber(get<double>(), buf));
+		if (isInteger())
+			return std::wstring(buf, buf + formatNumber(get<int>(), buf));
+		if (isBool())
+			return std::wstring(get<bool>() ? L"1" : L"0");
+		if (isError()) {
+			std::string err = xlError(val.err).str();
+			return std::wstring(err.begin(), err.end());
+		}
+		XLKIT_THROW("Cannot cast to wstring from " + xltypeString(xltype));
+	}
+	bool castValue(detail::type_<bool>) const {
 		// Casting to a bool
 		if (isDouble())
 			return (get<double>() != 0);
@@ -538,9 +1643,30 @@ class xlOper4 : private XLOPER {
 	}
 
 };
+
+/// C++ methods that operate on top of an XLOPER struct
+typedef xlOperT<XLOPER, char>	xlOper4;
+/// C++ methods that operate on top of an XLOPER12 struct (Excel 2007+).
+/// Compared to xlOper4, it has 32-bit integers, wide strings of up to 32767
+/// characters and cell matrices of up to 1048576x16384 elements.
+typedef xlOperT<XLOPER12, XCHAR>	xlOper12;
+
+static_assert(sizeof(xlOper4) == sizeof(XLOPER), "xlOper4 must have the layout of XLOPER");
+static_assert(sizeof(xlOper12) == sizeof(XLOPER12), "xlOper12 must have the layout of XLOPER12");
+
 typedef xlOper4						xlOperand;
 typedef xlOper4::CellMatrixRef		xlCellMatrixRef;
 typedef xlOper4::ConstCellMatrixRef	xlConstCellMatrixRef;
+typedef xlOper4::View				xlCellMatrixView;
+typedef xlOper4::ConstView			xlConstCellMatrixView;
+typedef xlOper4::MatrixBuilder		xlMatrixBuilder;
+
+typedef xlOper12						xlOperand12;
+typedef xlOper12::CellMatrixRef			xlCellMatrixRef12;
+typedef xlOper12::ConstCellMatrixRef	xlConstCellMatrixRef12;
+typedef xlOper12::View					xlCellMatrixView12;
+typedef xlOper12::ConstView				xlConstCellMatrixView12;
+typedef xlOper12::MatrixBuilder			xlMatrixBuilder12;
 
 } // namespace XLKIT_VERSION_NAME
 } // namespace xlkit
@@ -548,15 +1674,48 @@ typedef xlOper4::ConstCellMatrixRef	xlConstCellMatrixRef;
 /// @addtogroup aliases
 /// @{
 
-/// C++ wrapper for XLOPER struct. See @ref xlkit::XLKIT_VERSION_NAME::xlOper4 "xlOper4"
+/// C++ wrapper for XLOPER struct. See @ref xlkit::XLKIT_VERSION_NAME::xlOperT "xlOperT"
 typedef xlkit::xlOperand xlOperand;
 
-/// Proxy class into an operand's cell matrix (mutable). See @ref xlkit::XLKIT_VERSION_NAME::xlOper4::CellMatrixRef "CellMatrixRef"
+/// Proxy class into an operand's cell matrix (mutable). See @ref xlkit::XLKIT_VERSION_NAME::xlOperT::CellMatrixRef "CellMatrixRef"
 typedef xlkit::xlCellMatrixRef xlCellMatrixRef;
 
-/// Proxy class into an operand's cell matrix (non-mutable).  See @ref xlkit::XLKIT_VERSION_NAME::xlOper4::ConstCellMatrixRef "ConstCellMatrixRef"
+/// Proxy class into an operand's cell matrix (non-mutable).  See @ref xlkit::XLKIT_VERSION_NAME::xlOperT::ConstCellMatrixRef "ConstCellMatrixRef"
 typedef xlkit::xlConstCellMatrixRef xlConstCellMatrixRef;
 
+/// Window of cells in an operand's cell matrix (mutable). See @ref xlkit::XLKIT_VERSION_NAME::CellMatrixView "CellMatrixView"
+typedef xlkit::xlCellMatrixView xlCellMatrixView;
+
+/// Window of cells in an operand's cell matrix (non-mutable). See @ref xlkit::XLKIT_VERSION_NAME::CellMatrixView "CellMatrixView"
+typedef xlkit::xlConstCellMatrixView xlConstCellMatrixView;
+
+/// Non-owning view of a string operand. See @ref xlkit::XLKIT_VERSION_NAME::xlStringRef "xlStringRef"
+typedef xlkit::xlStringRef xlStringRef;
+
+/// Non-owning view of an XLOPER12 string operand. See @ref xlkit::XLKIT_VERSION_NAME::xlStringRef12 "xlStringRef12"
+typedef xlkit::xlStringRef12 xlStringRef12;
+
+/// Builder for a cell matrix in a single allocation. See @ref xlkit::XLKIT_VERSION_NAME::xlOperT::MatrixBuilder "MatrixBuilder"
+typedef xlkit::xlMatrixBuilder xlMatrixBuilder;
+
+/// C++ wrapper for XLOPER12 struct. See @ref xlkit::XLKIT_VERSION_NAME::xlOperT "xlOperT"
+typedef xlkit::xlOperand12 xlOperand12;
+
+/// Proxy class into an XLOPER12 operand's cell matrix (mutable). See @ref xlkit::XLKIT_VERSION_NAME::xlOperT::CellMatrixRef "CellMatrixRef"
+typedef xlkit::xlCellMatrixRef12 xlCellMatrixRef12;
+
+/// Proxy class into an XLOPER12 operand's cell matrix (non-mutable).  See @ref xlkit::XLKIT_VERSION_NAME::xlOperT::ConstCellMatrixRef "ConstCellMatrixRef"
+typedef xlkit::xlConstCellMatrixRef12 xlConstCellMatrixRef12;
+
+/// Window of cells in an XLOPER12 operand's cell matrix (mutable). See @ref xlkit::XLKIT_VERSION_NAME::CellMatrixView "CellMatrixView"
+typedef xlkit::xlCellMatrixView12 xlCellMatrixView12;
+
+/// Window of cells in an XLOPER12 operand's cell matrix (non-mutable). See @ref xlkit::XLKIT_VERSION_NAME::CellMatrixView "CellMatrixView"
+typedef xlkit::xlConstCellMatrixView12 xlConstCellMatrixView12;
+
+/// Builder for an XLOPER12 cell matrix in a single allocation. See @ref xlkit::XLKIT_VERSION_NAME::xlOperT::MatrixBuilder "MatrixBuilder"
+typedef xlkit::xlMatrixBuilder12 xlMatrixBuilder12;
+
 /// @}
 
 #endif // XLKIT_XLOPERAND_HPP
@@ -0,0 +1,225 @@
+/// @file xlRangeReader.hpp
+///
+/// @brief xlkit::RangeReader class for reading large ranges in blocks of rows
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLRANGEREADER_HPP
+#define XLKIT_XLRANGEREADER_HPP
+
+#include <xlkit/xlkit.hpp>
+
+#include <iterator>
+
+#include <stddef.h>
+
+/// Default maximum number of cells read from Excel at once by RangeReader
+#ifndef XLKIT_RANGE_BLOCK_CELLS
+#define XLKIT_RANGE_BLOCK_CELLS 65536
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// Reads the values of a worksheet range reference in blocks of rows using
+/// xlCoerce, so that a range which is too large to convert at once, such
+/// as a whole column, can be scanned without holding all of its values.
+/// Only the current block is held, and its cells are borrowed from Excel
+/// until the next block is read. The reference is usually a RefOperand12Ptr
+/// parameter. Values given in place of a reference, such as array
+/// constants, are read as a single block.
+///
+/// @code
+/// double XLKIT_API
+/// xlCountNumbers(xlRefOperand12Ptr range)
+/// {
+///     XLKIT_BEGIN_FUNCTION
+///     double count = 0;
+///     xlkit::RangeReader reader(*range);
+///     for (const xlkit::RangeReader::Block& block : reader) {
+///         for (const xlOperand12& x : block.cells())
+///             count += x.isDouble();
+///     }
+///     return count;
+///     XLKIT_END_FUNCTION(double)
+/// }
+/// @endcode
+///
+/// @note The reader keeps a pointer to ref rather than a copy, so it must
+/// not outlive the argument that it was constructed from. A Block, and the
+/// cells returned by Block::cells(), are only valid until the next block is
+/// read or the reader is destroyed.
+/// @note Reading throws if Excel fails to coerce a block, including when it
+/// refers to cells that are not calculated yet (xlretUncalced). The
+/// function then returns an error, which may be shown until Excel calls it
+/// again once those cells are calculated.
+class RangeReader {
+  public:
+
+	/// Values of a block of rows of the range
+	class Block {
+	  public:
+		/// First row of the block, relative to the start of the range
+		int rowBegin() const {
+			return myRowBegin;
+		}
+		/// Row after the last row of the block
+		int rowEnd() const {
+			return myRowEnd;
+		}
+		int rows() const {
+			return myRowEnd - myRowBegin;
+		}
+
+		/// Cells of the block, valid until the next block is read
+		xlConstCellMatrixRef12 cells() const {
+			return myCells->get<xlConstCellMatrixRef12>();
+		}
+
+	  private:
+		friend class RangeReader;
+
+		Block()
+			: myRowBegin(0)
+			, myRowEnd(0)
+			, myCells(&myValues)
+			, myExcelOwned(false) {
+		}
+		Block(const Block&);
+		Block& operator=(const Block&);
+
+		int myRowBegin;
+		int myRowEnd;
+		xlOperand12 myValues;
+		const xlOperand12* myCells;
+		bool myExcelOwned;
+	};
+
+	/// Input iterator reading each block in turn
+	class iterator {
+	  public:
+		typedef std::input_iterator_tag	iterator_category;
+		typedef Block					value_type;
+		typedef ptrdiff_t				difference_type;
+		typedef const Block*			pointer;
+		typedef const Block&			reference;
+
+		iterator()
+			: myReader(NULL), myIndex(0) { }
+
+		const Block& operator*() const {
+			return myReader->read(myIndex);
+		}
+		const Block* operator->() const {
+			return &myReader->read(myIndex);
+		}
+		iterator& operator++() {
+			++myIndex;
+			return *this;
+		}
+		bool operator==(const iterator& other) const {
+			return (myIndex == other.myIndex);
+		}
+		bool operator!=(const iterator& other) const {
+			return (myIndex != other.myIndex);
+		}
+
+	  private:
+		friend class RangeReader;
+
+		iterator(RangeReader* reader, int index)
+			: myReader(reader), myIndex(index) { }
+
+		RangeReader* myReader;
+		int myIndex;
+	};
+
+	/// Read the range referenced by ref in blocks of block_rows rows. When
+	/// block_rows is 0, blocks have as many rows as fit in
+	/// XLKIT_RANGE_BLOCK_CELLS cells.
+	/// @note ref is not copied and must outlive the reader.
+	explicit RangeReader(const xlOperand12& ref, int block_rows = 0);
+	~RangeReader();
+
+	/// Size of the range
+	/// @{
+	int rows() const {
+		return myRows;
+	}
+	int cols() const {
+		return myCols;
+	}
+	/// @}
+
+	/// Number of rows in each block, except possibly the last
+	int blockRows() const {
+		return myBlockRows;
+	}
+	/// Number of blocks
+	int numBlocks() const {
+		return (myRows + myBlockRows - 1) / myBlockRows;
+	}
+
+	/// Read block b, releasing the previously read block. Reading the
+	/// current block again returns it without calling Excel.
+	/// @note The returned Block is reused, so it is only valid until the
+	/// next call.
+	const Block& read(int b);
+
+	/// Range of all blocks
+	/// @{
+	iterator begin() {
+		return iterator(this, 0);
+	}
+	iterator end() {
+		return iterator(this, numBlocks());
+	}
+	/// @}
+
+  private:
+	RangeReader(const RangeReader&);
+	RangeReader& operator=(const RangeReader&);
+
+	void release();
+
+	const xlOperand12* myRef;
+	bool myIsRef;			// whether myRef is a reference rather than values
+	int myRows;
+	int myCols;
+	int myBlockRows;
+	int myBlockIndex;		// index of the block in myBlock, or -1
+	Block myBlock;
+};
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+/// @addtogroup aliases
+/// @{
+
+/// Reader of a large range in blocks of rows. See @ref xlkit::XLKIT_VERSION_NAME::RangeReader "RangeReader"
+typedef xlkit::RangeReader xlRangeReader;
+
+/// @}
+
+#endif // XLKIT_XLRANGEREADER_HPP
@@ -0,0 +1,714 @@
+/// @file xlReduce.hpp
+///
+/// @brief Vectorized, deterministic reductions over numbers
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLREDUCE_HPP
+#define XLKIT_XLREDUCE_HPP
+
+#include <xlkit/xlFpArray.hpp>
+#include <xlkit/xlOperand.hpp>
+#include <xlkit/xlversion.hpp>
+
+#include <functional>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+
+/// Number of worker threads shared by the reductions, where 0 uses one less
+/// than the number of hardware threads since the calling thread also works
+#ifndef XLKIT_REDUCE_THREADS
+#define XLKIT_REDUCE_THREADS 0
+#endif
+
+#if defined(__AVX__)
+#define XLKIT_REDUCE_AVX
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define XLKIT_REDUCE_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// @defgroup reduce Reductions
+/// Reductions over contiguous numbers, xlFpArray's, cell matrices and views.
+///
+/// The results are bit-for-bit reproducible: they do not depend on whether
+/// the AVX, SSE2 or scalar code path is compiled in, nor on num_threads.
+/// This is done by always accumulating into 8 lanes over fixed size chunks,
+/// and combining lanes and chunks in a fixed order. Builds with /arch:AVX2
+/// also define __AVX__ and use the AVX path, as the double precision adds,
+/// multiplies, min and max are all in AVX. AVX2's FMA would change the
+/// results, so it is not used.
+///
+/// For cell matrices of xlOperand or xlOperand12, only number cells
+/// (xltypeNum and xltypeInt) are used, like Excel's SUM() over a range.
+/// Blanks, strings, booleans and errors are skipped.
+///
+/// @note num_threads is the number of threads to use, where 0 means one per
+/// hardware thread. The calling thread works together with a pool of
+/// XLKIT_REDUCE_THREADS threads which is shared by all reductions, so no
+/// threads are started per call. Reproducibility relies on the compiler not
+/// contracting multiplies and adds into FMA instructions, which is the
+/// default for /fp:precise.
+/// @{
+
+/// Count, mean and sum of squared deviations from the mean
+struct Moments {
+	Moments()
+		: count(0), mean(0), m2(0) { }
+
+	/// Population variance
+	double variance() const {
+		return (count > 0) ? m2 / count
+			   : std::numeric_limits<double>::quiet_NaN();
+	}
+	/// Sample variance
+	double sampleVariance() const {
+		return (count > 1) ? m2 / (count - 1)
+			   : std::numeric_limits<double>::quiet_NaN();
+	}
+
+	size_t count;
+	double mean;
+	double m2;
+};
+
+/// Count, minimum and maximum
+struct MinMax {
+	MinMax()
+		: count(0)
+		, min(std::numeric_limits<double>::infinity())
+		, max(-std::numeric_limits<double>::infinity()) { }
+
+	size_t count;
+	double min;
+	double max;
+};
+
+namespace detail {
+
+// Elements per chunk, which is the unit of work for threads
+static const size_t REDUCE_CHUNK = 4096;
+
+// Combine 8 lanes in a fixed order
+inline double
+sumLanes(const double* lanes) {
+	return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5]))
+		   + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+}
+
+// Combine b into a (Chan et al.)
+inline void
+mergeMoments(Moments& a, const Moments& b) {
+	if (b.count == 0)
+		return;
+	if (a.count == 0) {
+		a = b;
+		return;
+	}
+	double na = double(a.count);
+	double nb = double(b.count);
+	double n = na + nb;
+	double delta = b.mean - a.mean;
+	a.mean = a.mean + delta * (nb / n);
+	a.m2 = a.m2 + b.m2 + delta * delta * (na * nb / n);
+	a.count += b.count;
+}
+
+inline void
+mergeMinMax(MinMax& a, const MinMax& b) {
+	a.min = (a.min < b.min) ? a.min : b.min;
+	a.max = (a.max > b.max) ? a.max : b.max;
+	a.count += b.count;
+}
+
+inline double
+sumChunk(const double* x, size_t n) {
+	size_t n8 = n & ~size_t(7);
+	size_t i = 0;
+	double lanes[8];
+#if defined(XLKIT_REDUCE_AVX)
+	__m256d a0 = _mm256_setzero_pd();
+	__m256d a1 = _mm256_setzero_pd();
+	for (; i < n8; i += 8) {
+		a0 = _mm256_add_pd(a0, _mm256_loadu_pd(x + i));
+		a1 = _mm256_add_pd(a1, _mm256_loadu_pd(x + i + 4));
+	}
+	_mm256_storeu_pd(lanes, a0);
+	_mm256_storeu_pd(lanes + 4, a1);
+#elif defined(XLKIT_REDUCE_SSE2)
+	__m128d a0 = _mm_setzero_pd();
+	__m128d a1 = _mm_setzero_pd();
+	__m128d a2 = _mm_setzero_pd();
+	__m128d a3 = _mm_setzero_pd();
+	for (; i < n8; i += 8) {
+		a0 = _mm_add_pd(a0, _mm_loadu_pd(x + i));
+		a1 = _mm_add_pd(a1, _mm_loadu_pd(x + i + 2));
+		a2 = _mm_add_pd(a2, _mm_loadu_pd(x + i + 4));
+		a3 = _mm_add_pd(a3, _mm_loadu_pd(x + i + 6));
+	}
+	_mm_storeu_pd(lanes, a0);
+	_mm_storeu_pd(lanes + 2, a1);
+	_mm_storeu_pd(lanes + 4, a2);
+	_mm_storeu_pd(lanes + 6, a3);
+#else
+	for (int k = 0; k < 8; ++k)
+		lanes[k] = 0;
+	for (; i < n8; i += 8) {
+		for (int k = 0; k < 8; ++k)
+			lanes[k] += x[i + k];
+	}
+#endif
+	double s = sumLanes(lanes);
+	for (; i < n; ++i)
+		s += x[i];
+	return s;
+}
+
+inline double
+dotChunk(const double* x, const double* y, size_t n) {
+	size_t n8 = n & ~size_t(7);
+	size_t i = 0;
+	double lanes[8];
+#if defined(XLKIT_REDUCE_AVX)
+	__m256d a0 = _mm256_setzero_pd();
+	__m256d a1 = _mm256_setzero_pd();
+	for (; i < n8; i += 8) {
+		a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_loadu_pd(x + i),
+											 _mm256_loadu_pd(y + i)));
+		a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4),
+											 _mm256_loadu_pd(y + i + 4)));
+	}
+	_mm256_storeu_pd(lanes, a0);
+	_mm256_storeu_pd(lanes + 4, a1);
+#elif defined(XLKIT_REDUCE_SSE2)
+	__m128d a[4] = { _mm_setzero_pd(), _mm_setzero_pd(),
+					 _mm_setzero_pd(), _mm_setzero_pd()
+				   };
+	for (; i < n8; i += 8) {
+		for (int k = 0; k < 4; ++k)
+			a[k] = _mm_add_pd(a[k], _mm_mul_pd(_mm_loadu_pd(x + i + 2*k),
+											   _mm_loadu_pd(y + i + 2*k)));
+	}
+	for (int k = 0; k < 4; ++k)
+		_mm_storeu_pd(lanes + 2*k, a[k]);
+#else
+	for (int k = 0; k < 8; ++k)
+		lanes[k] = 0;
+	for (; i < n8; i += 8) {
+		for (int k = 0; k < 8; ++k) {
+			double p = x[i + k] * y[i + k];
+			lanes[k] += p;
+		}
+	}
+#endif
+	double s = sumLanes(lanes);
+	for (; i < n; ++i) {
+		double p = x[i] * y[i];
+		s += p;
+	}
+	return s;
+}
+
+// Welford's algorithm in each of 8 lanes
+inline Moments
+momentsChunk(const double* x, size_t n) {
+	size_t n8 = n & ~size_t(7);
+	size_t i = 0;
+	double mean[8];
+	double m2[8];
+#if defined(XLKIT_REDUCE_AVX)
+	__m256d mean0 = _mm256_setzero_pd();
+	__m256d mean1 = _mm256_setzero_pd();
+	__m256d m20 = _mm256_setzero_pd();
+	__m256d m21 = _mm256_setzero_pd();
+	for (double k = 1; i < n8; i += 8, k += 1) {
+		__m256d kk = _mm256_set1_pd(k);
+		__m256d x0 = _mm256_loadu_pd(x + i);
+		__m256d x1 = _mm256_loadu_pd(x + i + 4);
+		__m256d d0 = _mm256_sub_pd(x0, mean0);
+		__m256d d1 = _mm256_sub_pd(x1, mean1);
+		mean0 = _mm256_add_pd(mean0, _mm256_div_pd(d0, kk));
+		mean1 = _mm256_add_pd(mean1, _mm256_div_pd(d1, kk));
+		m20 = _mm256_add_pd(m20, _mm256_mul_pd(d0, _mm256_sub_pd(x0, mean0)));
+		m21 = _mm256_add_pd(m21, _mm256_mul_pd(d1, _mm256_sub_pd(x1, mean1)));
+	}
+	_mm256_storeu_pd(mean, mean0);
+	_mm256_storeu_pd(mean + 4, mean1);
+	_mm256_storeu_pd(m2, m20);
+	_mm256_storeu_pd(m2 + 4, m21);
+#elif defined(XLKIT_REDUCE_SSE2)
+	__m128d vmean[4];
+	__m128d vm2[4];
+	for (int l = 0; l < 4; ++l) {
+		vmean[l] = _mm_setzero_pd();
+		vm2[l] = _mm_setzero_pd();
+	}
+	for (double k = 1; i < n8; i += 8, k += 1) {
+		__m128d kk = _mm_set1_pd(k);
+		for (int l = 0; l < 4; ++l) {
+			__m128d xl = _mm_loadu_pd(x + i + 2*l);
+			__m128d d = _mm_sub_pd(xl, vmean[l]);
+			vmean[l] = _mm_add_pd(vmean[l], _mm_div_pd(d, kk));
+			vm2[l] = _mm_add_pd(vm2[l], _mm_mul_pd(d, _mm_sub_pd(xl, vmean[l])));
+		}
+	}
+	for (int l = 0; l < 4; ++l) {
+		_mm_storeu_pd(mean + 2*l, vmean[l]);
+		_mm_storeu_pd(m2 + 2*l, vm2[l]);
+	}
+#else
+	for (int l = 0; l < 8; ++l) {
+		mean[l] = 0;
+		m2[l] = 0;
+	}
+	for (double k = 1; i < n8; i += 8, k += 1) {
+		for (int l = 0; l < 8; ++l) {
+			double d = x[i + l] - mean[l];
+			mean[l] += d / k;
+			double e = x[i + l] - mean[l];
+			m2[l] += d * e;
+		}
+	}
+#endif
+	// Combine the lanes in the same order as sumLanes()
+	Moments lanes[8];
+	for (int l = 0; l < 8; ++l) {
+		lanes[l].count = n8 / 8;
+		lanes[l].mean = mean[l];
+		lanes[l].m2 = m2[l];
+	}
+	for (int l = 0; l < 4; ++l)
+		mergeMoments(lanes[l], lanes[l + 4]);
+	mergeMoments(lanes[0], lanes[1]);
+	mergeMoments(lanes[2], lanes[3]);
+	mergeMoments(lanes[0], lanes[2]);
+	Moments result = lanes[0];
+	for (; i < n; ++i) {
+		++result.count;
+		double d = x[i] - result.mean;
+		result.mean += d / double(result.count);
+		double e = x[i] - result.mean;
+		result.m2 += d * e;
+	}
+	return result;
+}
+
+inline MinMax
+minMaxChunk(const double* x, size_t n) {
+	size_t n8 = n & ~size_t(7);
+	size_t i = 0;
+	double lo[8];
+	double hi[8];
+#if defined(XLKIT_REDUCE_AVX)
+	__m256d lo0 = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+	__m256d lo1 = lo0;
+	__m256d hi0 = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+	__m256d hi1 = hi0;
+	for (; i < n8; i += 8) {
+		__m256d x0 = _mm256_loadu_pd(x + i);
+		__m256d x1 = _mm256_loadu_pd(x + i + 4);
+		lo0 = _mm256_min_pd(lo0, x0);
+		lo1 = _mm256_min_pd(lo1, x1);
+		hi0 = _mm256_max_pd(hi0, x0);
+		hi1 = _mm256_max_pd(hi1, x1);
+	}
+	_mm256_storeu_pd(lo, lo0);
+	_mm256_storeu_pd(lo + 4, lo1);
+	_mm256_storeu_pd(hi, hi0);
+	_mm256_storeu_pd(hi + 4, hi1);
+#elif defined(XLKIT_REDUCE_SSE2)
+	__m128d vlo[4];
+	__m128d vhi[4];
+	for (int l = 0; l < 4; ++l) {
+		vlo[l] = _mm_set1_pd(std::numeric_limits<double>::infinity());
+		vhi[l] = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+	}
+	for (; i < n8; i += 8) {
+		for (int l = 0; l < 4; ++l) {
+			__m128d xl = _mm_loadu_pd(x + i + 2*l);
+			vlo[l] = _mm_min_pd(vlo[l], xl);
+			vhi[l] = _mm_max_pd(vhi[l], xl);
+		}
+	}
+	for (int l = 0; l < 4; ++l) {
+		_mm_storeu_pd(lo + 2*l, vlo[l]);
+		_mm_storeu_pd(hi + 2*l, vhi[l]);
+	}
+#else
+	for (int l = 0; l < 8; ++l) {
+		lo[l] = std::numeric_limits<double>::infinity();
+		hi[l] = -std::numeric_limits<double>::infinity();
+	}
+	for (; i < n8; i += 8) {
+		// Same operand order as minpd/maxpd
+		for (int l = 0; l < 8; ++l) {
+			lo[l] = (lo[l] < x[i + l]) ? lo[l] : x[i + l];
+			hi[l] = (hi[l] > x[i + l]) ? hi[l] : x[i + l];
+		}
+	}
+#endif
+	MinMax result;
+	for (int l = 0; l < 8; ++l) {
+		result.min = (result.min < lo[l]) ? result.min : lo[l];
+		result.max = (result.max > hi[l]) ? result.max : hi[l];
+	}
+	for (; i < n; ++i) {
+		result.min = (result.min < x[i]) ? result.min : x[i];
+		result.max = (result.max > x[i]) ? result.max : x[i];
+	}
+	result.count = n;
+	return result;
+}
+
+// Run fn(t) for t in [0, num_tasks) using the threads of the shared
+// reduction pool and the calling thread, returning once all are done. fn
+// must not throw. Defined in xlkit.cpp.
+void runParallel(int num_tasks, const std::function<void (int)>& fn);
+
+// Run fn(chunk_index, partial) for num_chunks chunks using num_threads,
+// then merge the partials in chunk order. The result does not depend on
+// num_threads.
+template <typename PARTIAL, typename CHUNK_FN, typename MERGE_FN>
+PARTIAL
+reduceChunks(size_t num_chunks, int num_threads, CHUNK_FN fn, MERGE_FN merge) {
+	if (num_threads <= 0)
+		num_threads = int(std::thread::hardware_concurrency());
+	if (num_threads <= 0)
+		num_threads = 1;
+	if (size_t(num_threads) > num_chunks)
+		num_threads = int(num_chunks);
+
+	std::vector<PARTIAL> partials(num_chunks);
+	if (num_threads <= 1) {
+		for (size_t c = 0; c < num_chunks; ++c)
+			fn(c, partials[c]);
+	} else {
+		runParallel(num_threads, [&](int t) {
+			for (size_t c = t; c < num_chunks; c += num_threads)
+				fn(c, partials[c]);
+		});
+	}
+
+	PARTIAL result = PARTIAL();
+	for (size_t c = 0; c < num_chunks; ++c)
+		merge(result, partials[c]);
+	return result;
+}
+
+inline size_t
+numChunks(size_t n) {
+	return (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+}
+
+// Copy the numbers in cells [begin, begin + n) into x, returning how many
+template <typename OPER>
+inline size_t
+gatherNumbers(const OPER* cells, size_t n, double* x) {
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		const OPER& cell = cells[i];
+		if (cell.isDouble())
+			x[count++] = cell.template get<double>();
+		else if (cell.isInteger())
+			x[count++] = cell.template get<int>();
+	}
+	return count;
+}
+
+// Copy the numbers in the cells of m with row-major indices
+// [begin, begin + n) into x, returning how many
+template <typename OPER>
+inline size_t
+gatherNumbers(const CellMatrixView<const OPER>& m, size_t begin, size_t n, double* x) {
+	if (m.isContiguous())
+		return gatherNumbers(&m(0, 0) + begin, n, x);
+	size_t count = 0;
+	int i = int(begin / m.cols());
+	int j = int(begin % m.cols());
+	for (size_t k = 0; k < n; ++k) {
+		const OPER& cell = m(i, j);
+		if (cell.isDouble())
+			x[count++] = cell.template get<double>();
+		else if (cell.isInteger())
+			x[count++] = cell.template get<int>();
+		if (++j == m.cols()) {
+			j = 0;
+			++i;
+		}
+	}
+	return count;
+}
+
+// Apply chunk_fn to the gathered numbers of each chunk of cells in m
+template <typename PARTIAL, typename OPER, typename CHUNK_FN, typename MERGE_FN>
+PARTIAL
+reduceCells(const CellMatrixView<const OPER>& m, int num_threads, CHUNK_FN chunk_fn,
+			MERGE_FN merge) {
+	size_t n = m.size();
+	if (n == 0)
+		return PARTIAL();
+	return reduceChunks<PARTIAL>(numChunks(n), num_threads,
+	[&](size_t c, PARTIAL& partial) {
+		double x[REDUCE_CHUNK];
+		size_t begin = c * REDUCE_CHUNK;
+		size_t count = (n - begin < REDUCE_CHUNK) ? n - begin : REDUCE_CHUNK;
+		partial = chunk_fn(x, gatherNumbers(m, begin, count, x));
+	}, merge);
+}
+
+struct SumPartial {
+	SumPartial()
+		: sum(0), count(0) { }
+	double sum;
+	size_t count;
+};
+
+inline void
+mergeSum(SumPartial& a, const SumPartial& b) {
+	a.sum += b.sum;
+	a.count += b.count;
+}
+
+inline SumPartial
+sumPartial(const double* x, size_t n) {
+	SumPartial p;
+	p.sum = sumChunk(x, n);
+	p.count = n;
+	return p;
+}
+
+template <typename OPER>
+inline double
+meanCells(const CellMatrixView<const OPER>& m, int num_threads) {
+	SumPartial p = reduceCells<SumPartial>(m, num_threads, sumPartial, mergeSum);
+	if (p.count == 0)
+		return std::numeric_limits<double>::quiet_NaN();
+	return p.sum / p.count;
+}
+
+template <typename OPER>
+inline size_t
+countCells(const CellMatrixView<const OPER>& m) {
+	size_t n = 0;
+	for (int i = 0, rows = m.rows(); i < rows; ++i) {
+		for (const OPER& cell : m.row(i))
+			n += (cell.isDouble() || cell.isInteger());
+	}
+	return n;
+}
+
+} // namespace detail
+
+/// Sum of numbers
+/// @{
+inline double
+sum(const double* x, size_t n, int num_threads = 1) {
+	return detail::reduceChunks<detail::SumPartial>(detail::numChunks(n), num_threads,
+	[&](size_t c, detail::SumPartial& partial) {
+		size_t begin = c * detail::REDUCE_CHUNK;
+		size_t count = (n - begin < detail::REDUCE_CHUNK) ? n - begin : detail::REDUCE_CHUNK;
+		partial = detail::sumPartial(x + begin, count);
+	}, detail::mergeSum).sum;
+}
+template <typename FP_T>
+inline double
+sum(const xlFpArrayT<FP_T>& a, int num_threads = 1) {
+	return sum(a.data(), a.size(), num_threads);
+}
+inline double
+sum(const xlConstCellMatrixView& m, int num_threads = 1) {
+	return detail::reduceCells<detail::SumPartial>(m, num_threads,
+			detail::sumPartial, detail::mergeSum).sum;
+}
+inline double
+sum(xlConstCellMatrixRef m, int num_threads = 1) {
+	return sum(m.view(), num_threads);
+}
+inline double
+sum(const xlConstCellMatrixView12& m, int num_threads = 1) {
+	return detail::reduceCells<detail::SumPartial>(m, num_threads,
+			detail::sumPartial, detail::mergeSum).sum;
+}
+inline double
+sum(xlConstCellMatrixRef12 m, int num_threads = 1) {
+	return sum(m.view(), num_threads);
+}
+/// @}
+
+/// Mean of numbers, NaN if there are none
+/// @{
+inline double
+mean(const double* x, size_t n, int num_threads = 1) {
+	if (n == 0)
+		return std::numeric_limits<double>::quiet_NaN();
+	return sum(x, n, num_threads) / n;
+}
+template <typename FP_T>
+inline double
+mean(const xlFpArrayT<FP_T>& a, int num_threads = 1) {
+	return mean(a.data(), a.size(), num_threads);
+}
+inline double
+mean(const xlConstCellMatrixView& m, int num_threads = 1) {
+	return detail::meanCells(m, num_threads);
+}
+inline double
+mean(xlConstCellMatrixRef m, int num_threads = 1) {
+	return mean(m.view(), num_threads);
+}
+inline double
+mean(const xlConstCellMatrixView12& m, int num_threads = 1) {
+	return detail::meanCells(m, num_threads);
+}
+inline double
+mean(xlConstCellMatrixRef12 m, int num_threads = 1) {
+	return mean(m.view(), num_threads);
+}
+/// @}
+
+/// Count, mean and variance of numbers using Welford's algorithm
+/// @{
+inline Moments
+moments(const double* x, size_t n, int num_threads = 1) {
+	return detail::reduceChunks<Moments>(detail::numChunks(n), num_threads,
+	[&](size_t c, Moments& partial) {
+		size_t begin = c * detail::REDUCE_CHUNK;
+		size_t count = (n - begin < detail::REDUCE_CHUNK) ? n - begin : detail::REDUCE_CHUNK;
+		partial = detail::momentsChunk(x + begin, count);
+	}, detail::mergeMoments);
+}
+template <typename FP_T>
+inline Moments
+moments(const xlFpArrayT<FP_T>& a, int num_threads = 1) {
+	return moments(a.data(), a.size(), num_threads);
+}
+inline Moments
+moments(const xlConstCellMatrixView& m, int num_threads = 1) {
+	return detail::reduceCells<Moments>(m, num_threads,
+										detail::momentsChunk, detail::mergeMoments);
+}
+inline Moments
+moments(xlConstCellMatrixRef m, int num_threads = 1) {
+	return moments(m.view(), num_threads);
+}
+inline Moments
+moments(const xlConstCellMatrixView12& m, int num_threads = 1) {
+	return detail::reduceCells<Moments>(m, num_threads,
+										detail::momentsChunk, detail::mergeMoments);
+}
+inline Moments
+moments(xlConstCellMatrixRef12 m, int num_threads = 1) {
+	return moments(m.view(), num_threads);
+}
+/// @}
+
+/// Minimum and maximum of numbers
+/// @{
+inline MinMax
+minMax(const double* x, size_t n, int num_threads = 1) {
+	return detail::reduceChunks<MinMax>(detail::numChunks(n), num_threads,
+	[&](size_t c, MinMax& partial) {
+		size_t begin = c * detail::REDUCE_CHUNK;
+		size_t count = (n - begin < detail::REDUCE_CHUNK) ? n - begin : detail::REDUCE_CHUNK;
+		partial = detail::minMaxChunk(x + begin, count);
+	}, detail::mergeMinMax);
+}
+template <typename FP_T>
+inline MinMax
+minMax(const xlFpArrayT<FP_T>& a, int num_threads = 1) {
+	return minMax(a.data(), a.size(), num_threads);
+}
+inline MinMax
+minMax(const xlConstCellMatrixView& m, int num_threads = 1) {
+	return detail::reduceCells<MinMax>(m, num_threads,
+									   detail::minMaxChunk, detail::mergeMinMax);
+}
+inline MinMax
+minMax(xlConstCellMatrixRef m, int num_threads = 1) {
+	return minMax(m.view(), num_threads);
+}
+inline MinMax
+minMax(const xlConstCellMatrixView12& m, int num_threads = 1) {
+	return detail::reduceCells<MinMax>(m, num_threads,
+									   detail::minMaxChunk, detail::mergeMinMax);
+}
+inline MinMax
+minMax(xlConstCellMatrixRef12 m, int num_threads = 1) {
+	return minMax(m.view(), num_threads);
+}
+/// @}
+
+/// Number of number cells in a cell matrix
+/// @{
+inline size_t
+count(const xlConstCellMatrixView& m) {
+	return detail::countCells(m);
+}
+inline size_t
+count(xlConstCellMatrixRef m) {
+	return count(m.view());
+}
+inline size_t
+count(const xlConstCellMatrixView12& m) {
+	return detail::countCells(m);
+}
+inline size_t
+count(xlConstCellMatrixRef12 m) {
+	return count(m.view());
+}
+/// @}
+
+/// Dot product of two arrays of n numbers
+/// @{
+inline double
+dot(const double* x, const double* y, size_t n, int num_threads = 1) {
+	return detail::reduceChunks<detail::SumPartial>(detail::numChunks(n), num_threads,
+	[&](size_t c, detail::SumPartial& partial) {
+		size_t begin = c * detail::REDUCE_CHUNK;
+		size_t count = (n - begin < detail::REDUCE_CHUNK) ? n - begin : detail::REDUCE_CHUNK;
+		partial.sum = detail::dotChunk(x + begin, y + begin, count);
+		partial.count = count;
+	}, detail::mergeSum).sum;
+}
+template <typename FP_T>
+inline double
+dot(const xlFpArrayT<FP_T>& a, const xlFpArrayT<FP_T>& b, int num_threads = 1) {
+	if (a.size() != b.size())
+		XLKIT_THROW("Arrays have different sizes");
+	return dot(a.data(), b.data(), a.size(), num_threads);
+}
+/// @}
+
+/// @}
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+#endif // XLKIT_XLREDUCE_HPP
@@ -0,0 +1,123 @@
+/// @file xlTrace.hpp
+///
+/// @brief Timeline tracing of XLL function calls in Chrome trace format
+///
+
+// Copyright (c) 2014 Edward Lam
+//
+// All rights reserved. This software is distributed under the
+// Mozilla Public License, v. 2.0 ( http://www.mozilla.org/MPL/2.0/ ).
+//
+// Redistributions of source code must retain the above copyright
+// and license notice and the following restrictions and disclaimer.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef XLKIT_XLTRACE_HPP
+#define XLKIT_XLTRACE_HPP
+
+#include <xlkit/xlversion.hpp>
+
+#include <chrono>
+#include <ostream>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Number of events kept for each thread, after which the oldest events are
+/// overwritten
+#ifndef XLKIT_TRACE_EVENTS
+#define XLKIT_TRACE_EVENTS 16384
+#endif
+
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+
+/// @defgroup trace Tracing
+/// When XLKIT_USE_TRACE is defined before including xlkit.hpp, every call to
+/// a function using XLKIT_BEGIN_FUNCTION, every Excel callback, status bar
+/// progress scope, asynchronous task and function registration is recorded
+/// with its thread and start and end times. Each thread records into its own
+/// ring buffer of XLKIT_TRACE_EVENTS events.
+///
+/// The events are written as Chrome trace JSON which can be viewed in
+/// chrome://tracing or https://ui.perfetto.dev. They are written on demand
+/// with writeTrace() or the XLKIT.WRITETRACE() worksheet function, and when
+/// the add-in is closed to the file named by the XLKIT_TRACE_FILE
+/// environment variable if it's set.
+/// @{
+
+/// Write the recorded events as Chrome trace JSON, returning the number of
+/// events written
+size_t writeTrace(std::ostream& out);
+
+/// Write the recorded events as Chrome trace JSON to the file at path,
+/// returning the number of events written. Throws if the file could not be
+/// written.
+size_t writeTrace(const char* path);
+
+/// Discard the events recorded so far
+void clearTrace();
+
+/// @}
+
+namespace detail {
+
+// Records events into per-thread ring buffers, see writeTrace()
+class Trace {
+  public:
+	typedef std::chrono::steady_clock Clock;
+
+	// Kinds of events. The name of TRACE_CALLBACK events is derived from the
+	// xlfn value while the others must have names with static storage.
+	enum Kind {
+		TRACE_FUNCTION, TRACE_CALLBACK, TRACE_PROGRESS, TRACE_ASYNC,
+		TRACE_REGISTER
+	};
+
+	static uint64_t now() {
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+							Clock::now().time_since_epoch()).count());
+	}
+
+	// Record an event which started at start and ends now
+	static void record(Kind kind, const char* name, int value, uint64_t start);
+};
+
+// Records the enclosing scope as an event
+class TraceScope {
+  public:
+	TraceScope(Trace::Kind kind, const char* name, int value = 0)
+		: myKind(kind), myName(name), myValue(value), myStart(Trace::now()) {
+	}
+	~TraceScope() {
+		Trace::record(myKind, myName, myValue, myStart);
+	}
+
+  private:
+	TraceScope(const TraceScope&);
+	TraceScope& operator=(const TraceScope&);
+
+	Trace::Kind myKind;
+	const char* myName;
+	int myValue;
+	uint64_t myStart;
+};
+
+} // namespace detail
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+#endif // XLKIT_XLTRACE_HPP
@@ -46,6 +46,20 @@ struct xlPOINT {
 } // namespace XLKIT_VERSION_NAME
 } // namespace xlkit
 
+// Calling conventions only matter to Windows compilers, so they are left
+// out elsewhere, eg. when building against a mock Excel host on Linux
+#ifndef _MSC_VER
+#ifndef __stdcall
+#define __stdcall
+#endif
+#ifndef __cdecl
+#define __cdecl
+#endif
+#ifndef _cdecl
+#define _cdecl
+#endif
+#endif
+
 // If WINDOWS.H has not been included, then define the types needed by XLCALL.H
 #if !defined(_WINDOWS_H_) && !defined(_INC_WINDOWS)
 #define XLCALL_HPP_WINDEFS
@@ -88,7 +88,7 @@ debugExcept(const char* file, int n, const char* func, const std::string& what)
 /// it will allocate a text console and output to it.
 #ifdef _DEBUG
 #define XLDBG(FORMAT, ...) \
-				xlkit::detail::debugOut(__FILE__, __LINE__, __FUNCTION__, FORMAT, __VA_ARGS__) \
+				xlkit::detail::debugOut(__FILE__, __LINE__, __FUNCTION__, FORMAT, ##__VA_ARGS__) \
 				/**/
 #else
 #define XLDBG(FORMAT, ...)
@@ -25,21 +25,41 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <xlkit/xlkit.hpp>
+#include <xlkit/xlRangeReader.hpp>
+#include <xlkit/xlReduce.hpp>
 
 #include <xlkit/xldebug.hpp>
 #include <xlkit/xlutil.hpp>
 
-#include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string/predicate.hpp>
 
+#ifdef _WIN32
 #include <io.h>
+#else
+#include <pthread.h>
+#endif
 #include <stdio.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
 #include <ios>
+#include <mutex>
+#include <thread>
 
 // Include this last to avoid windows.h contaimination
+#ifdef _WIN32
 #include <xlkit/xlwindows.hpp>
+#else
+#define WINAPI
+// Without Excel, the callbacks are provided by a mock XLCALL32 library
+extern "C" int MdCallBack12(int xlfn, int count, LPXLOPER12 opers[],
+							LPXLOPER12 operRes) __attribute__((weak));
+#endif
 
 
 namespace xlkit {
@@ -48,11 +68,14 @@ namespace XLKIT_VERSION_NAME {
 
 namespace detail {
 
+#ifdef _WIN32
 static bool theHasConsole = false;
+#endif
 
 // Implementation for xldebug.hpp
 void
 outputDebugString(const char *msg) {
+#ifdef _WIN32
 	if (::IsDebuggerPresent()) {
 		::OutputDebugStringA(msg);
 	} else {
@@ -66,16 +89,23 @@ outputDebugString(const char *msg) {
 		}
 		fprintf(stderr, "%s", msg);
 	}
+#else
+	fprintf(stderr, "%s", msg);
+#endif
 }
 
 typedef int (__cdecl *ExcelProc4)(int xlfn, LPXLOPER operRes,
 								  int count, ...);
 typedef int (__stdcall *ExcelProc4v)(int xlfn, LPXLOPER operRes,
 									 int count, LPXLOPER opers[]);
+// Excel 2007+ entry point that Excel12v() forwards to, see XLCALL.CPP
+typedef int (__stdcall *ExcelProc12)(int xlfn, int count,
+									 LPXLOPER12 opers[], LPXLOPER12 operRes);
 
 // Global functions to call into Excel
 static ExcelProc4	Excel4_;
 static ExcelProc4v	Excel4v_;
+static ExcelProc12	MdCallBack12_;	// NULL if Excel is older than 2007
 
 XLOPER*
 xloperCast(xlOperand* ptr) {
@@ -89,6 +119,224 @@ xlOperand*
 xlOperandCast(LPXLOPER ptr) {
 	return reinterpret_cast<xlOperand*>(ptr);
 }
+XLOPER12*
+xloperCast(xlOperand12* ptr) {
+	return reinterpret_cast<XLOPER12*>(ptr);
+}
+const XLOPER12*
+xloperCast(const xlOperand12* ptr) {
+	return reinterpret_cast<const XLOPER12*>(ptr);
+}
+xlOperand12*
+xlOperandCast(LPXLOPER12 ptr) {
+	return reinterpret_cast<xlOperand12*>(ptr);
+}
+
+// Worker threads running the tasks of asynchronous functions from a bounded
+// queue. Threads are started by the first task.
+class AsyncPool {
+  public:
+	// Runs a task and returns its result for the handle
+	typedef std::function<void (const XLOPER12& handle,
+								const AsyncHandle::Task& task)> Runner;
+
+	AsyncPool(int num_threads, size_t capacity, const Runner& runner)
+		: myNumThreads(num_threads)
+		, myCapacity(capacity)
+		, myStopping(false)
+		, myRunner(runner) {
+	}
+	~AsyncPool() {
+		stop();
+	}
+
+	// Queue task for handle, blocking while the queue is full
+	void push(const XLOPER12& handle, AsyncHandle::Task&& task) {
+		std::unique_lock<std::mutex> lock(myMutex);
+		if (!myStopping && myThreads.empty())
+			start();
+		myNotFull.wait(lock, [this] {
+			return myQueue.size() < myCapacity || myStopping;
+		});
+		if (myStopping)
+			XLKIT_THROW("Asynchronous functions are shutting down");
+		myQueue.emplace_back(handle, std::move(task));
+		myNotEmpty.notify_one();
+	}
+
+	// Stop all threads after their current task. Tasks that have not
+	// started are dropped since Excel abandons their handles on close.
+	void stop() {
+		std::vector<std::thread> threads;
+		{
+			std::lock_guard<std::mutex> lock(myMutex);
+			myStopping = true;
+			threads.swap(myThreads);
+		}
+		myNotEmpty.notify_all();
+		myNotFull.notify_all();
+		for (std::thread& t : threads)
+			t.join();
+		std::lock_guard<std::mutex> lock(myMutex);
+		myQueue.clear();
+		myStopping = false;
+	}
+
+  private:
+	typedef std::pair<XLOPER12, AsyncHandle::Task> Entry;
+
+	// Called with myMutex locked
+	void start() {
+		int n = myNumThreads;
+		if (n <= 0)
+			n = std::max(1, int(std::thread::hardware_concurrency()));
+		for (int i = 0; i < n; ++i)
+			myThreads.emplace_back([this] { work(); });
+	}
+
+	void work() {
+		for (;;) {
+			std::unique_lock<std::mutex> lock(myMutex);
+			myNotEmpty.wait(lock, [this] {
+				return !myQueue.empty() || myStopping;
+			});
+			if (myStopping)
+				return;
+			Entry entry(std::move(myQueue.front()));
+			myQueue.pop_front();
+			myNotFull.notify_one();
+			lock.unlock();
+			myRunner(entry.first, entry.second);
+		}
+	}
+
+	int							myNumThreads;
+	size_t						myCapacity;
+	bool						myStopping;
+	Runner						myRunner;
+	std::mutex					myMutex;
+	std::condition_variable		myNotEmpty;
+	std::condition_variable		myNotFull;
+	std::deque<Entry>			myQueue;
+	std::vector<std::thread>	myThreads;
+};
+
+// Worker threads shared by the reductions in xlReduce.hpp. A batch of tasks
+// is run by the calling thread together with any idle workers, so a batch
+// completes even when every worker is busy, including with a batch of a
+// reduction that called run() itself. Threads are started by the first
+// batch.
+class ReducePool {
+  public:
+	explicit ReducePool(int num_threads)
+		: myNumThreads(num_threads)
+		, myStopping(false) {
+	}
+	~ReducePool() {
+		stop();
+	}
+
+	// Run fn(t) for t in [0, num_tasks) and return once all are done
+	void run(int num_tasks, const std::function<void (int)>& fn) {
+		Batch batch(num_tasks, fn);
+		{
+			std::lock_guard<std::mutex> lock(myMutex);
+			if (!myStopping) {
+				if (myThreads.empty())
+					start();
+				myQueue.push_back(&batch);
+				myNotEmpty.notify_all();
+			}
+		}
+		batch.work();
+
+		// All tasks have been claimed, so wait for the workers running them
+		std::unique_lock<std::mutex> lock(myMutex);
+		remove(&batch);
+		myIdle.wait(lock, [&batch] {
+			return batch.workers == 0;
+		});
+	}
+
+	// Stop all threads. Batches in progress are finished by their callers.
+	void stop() {
+		std::vector<std::thread> threads;
+		{
+			std::lock_guard<std::mutex> lock(myMutex);
+			myStopping = true;
+			threads.swap(myThreads);
+		}
+		myNotEmpty.notify_all();
+		for (std::thread& t : threads)
+			t.join();
+		std::lock_guard<std::mutex> lock(myMutex);
+		myStopping = false;
+	}
+
+  private:
+	struct Batch {
+		Batch(int num_tasks, const std::function<void (int)>& fn)
+			: numTasks(num_tasks)
+			, fn(fn)
+			, next(0)
+			, workers(0) {
+		}
+		// Run tasks until none are left to claim
+		void work() {
+			for (int t; (t = next.fetch_add(1, std::memory_order_relaxed)) < numTasks; )
+				fn(t);
+		}
+
+		int									numTasks;
+		const std::function<void (int)>&	fn;
+		std::atomic<int>					next;
+		int									workers;	// guarded by myMutex
+	};
+
+	// Called with myMutex locked
+	void start() {
+		int n = myNumThreads;
+		if (n <= 0)
+			n = int(std::thread::hardware_concurrency()) - 1;
+		for (int i = 0; i < n; ++i)
+			myThreads.emplace_back([this] { work(); });
+	}
+
+	// Called with myMutex locked
+	void remove(Batch* batch) {
+		std::deque<Batch*>::iterator it = std::find(myQueue.begin(), myQueue.end(), batch);
+		if (it != myQueue.end())
+			myQueue.erase(it);
+	}
+
+	void work() {
+		std::unique_lock<std::mutex> lock(myMutex);
+		for (;;) {
+			myNotEmpty.wait(lock, [this] {
+				return !myQueue.empty() || myStopping;
+			});
+			if (myStopping)
+				return;
+			Batch* batch = myQueue.front();
+			++batch->workers;
+			lock.unlock();
+			batch->work();
+			lock.lock();
+			// The batch has no tasks left to claim
+			remove(batch);
+			if (--batch->workers == 0)
+				myIdle.notify_all();
+		}
+	}
+
+	int							myNumThreads;
+	bool						myStopping;
+	std::mutex					myMutex;
+	std::condition_variable		myNotEmpty;
+	std::condition_variable		myIdle;
+	std::deque<Batch*>			myQueue;
+	std::vector<std::thread>	myThreads;
+};
 
 class ExcelHost {
 	static const int MAX_XL4_STR_LEN	= 255u;
@@ -101,12 +349,22 @@ class ExcelHost {
 	static const int MAX_XL12_UDF_ARG	= 255;
 
   public:
-	/// Get the singleton instance
+	/// Get the singleton instance. Safe to call concurrently from Excel's
+	/// recalculation threads. The instance is never deleted so that it remains
+	/// valid for callbacks made while the DLL is unloading.
 	static ExcelHost&
 	instance() {
-		if (!theInstance)
-			theInstance = new ExcelHost;
-		return *theInstance;
+		ExcelHost* host = theInstance.load(std::memory_order_acquire);
+		if (!host) {
+			ExcelHost* expected = NULL;
+			host = new ExcelHost;
+			if (!theInstance.compare_exchange_strong(expected, host,
+					std::memory_order_acq_rel)) {
+				delete host;
+				host = expected;
+			}
+		}
+		return *host;
 	}
 
 	/// Set the addin label
@@ -118,7 +376,15 @@ class ExcelHost {
 		return myAddinLabel;
 	}
 
-	/// Result type for call...() functions
+	/// Returns true if the host supports the XLOPER12 API (Excel 2007+)
+	bool hasExcel12() const {
+		return (MdCallBack12_ != NULL);
+	}
+
+	/// Result type for call...() functions. Excel's memory for the result
+	/// is borrowed without copying until it is released with xlFree when
+	/// the result is destroyed, so it may also be passed as an argument to
+	/// further calls.
 	class ExcelResult : public xlOperand  {
 	  public:
 		~ExcelResult() {
@@ -126,93 +392,173 @@ class ExcelHost {
 		}
 	  private:
 	};
+	/// Result type for call...() functions using XLOPER12
+	class ExcelResult12 : public xlOperand12  {
+	  public:
+		~ExcelResult12() {
+			LPXLOPER12 opers[] = { xloperCast(this) };
+			MdCallBack12_(xlFree, /*count*/1, opers, NULL);
+		}
+	  private:
+	};
 
 
 	/// Attach to host
 	void
 	attach() {
-		Progress progress("ExcelHost: Attaching");
-
-		std::vector<xlOperand> args;
+		// xlAutoOpen() is always called on Excel's main thread
+		myMainThread = std::this_thread::get_id();
 
-		xlOperand dll_name;
-		Excel4_(xlGetName, xloperCast(&dll_name), 0);
-
-		const Registry::NameMap& functions = Registry::instance().functions();
-		for (const auto& it : functions) {
-
-			args.clear();
-
-			args.emplace_back(dll_name);			// pxModuleText
-			args.emplace_back(it.first);			// pxProcedure
-			args.emplace_back(it.second.myTypes);	// pxTypeText
-			args.emplace_back(it.second.myFuncName);// pxFunctionText
-			args.emplace_back(it.second.myArgNames);// pxArgumentText
-			args.emplace_back();					// pxMacroType
-													// (default: from anywhere)
-			args.emplace_back(addinLabel());		// pxCategory
-			args.emplace_back();					// pxShortcutText (none)
-			args.emplace_back();					// pxHelpTopic (none)
-			args.emplace_back(it.second.myFuncHelp);// pxFunctionHelp
+		Progress progress("ExcelHost: Attaching");
 
-			// pxArgumentHelp...
-			const std::vector<std::string>& helps = it.second.myParmHelp;
-			for (int j = 0, n = int(helps.size()); j < n; ++j) {
-				// See http://msdn.microsoft.com/en-us/library/bb687841.aspx
-				// for _Argument Description String Truncation in the
-				// Function Wizard_ for why we need to do this.  In
-				// reality, it looks lik Excel actually avoids
-				// truncation by specifically looking for ". ".
-				if (j < n - 1) {
-					args.emplace_back(helps[j]);
-				} else {
-					args.emplace_back(helps[j] + ". ");
-				}
-			}
+		Clock::time_point start = Clock::now();
+		myAttachTiming = AttachTiming();
 
-			ExcelResult func_id;
-			callV(xlfRegister, func_id, args);
-			if (func_id.isError()) {
-				std::string error_str = func_id.get<std::string>();
-				std::string dll = dll_name.get<std::string>();
-				XLDBG("Failed to register %s (%s) in %s: Error %s (%d)",
-					  it.first.c_str(),
-					  it.second.myTypes.c_str(),
-					  dll.c_str(),
-					  error_str.c_str(),
-					  func_id.get<xlError>().num);
+		// The DLL name can't change, so only ask Excel for it once
+		if (myDllName.empty()) {
+			if (hasExcel12()) {
+				ExcelResult12 dll_name;
+				MdCallBack12_(xlGetName, 0, NULL, xloperCast(&dll_name));
+				myDllName = dll_name.get<std::string>();
 			} else {
-				std::string dll = dll_name.get<std::string>();
-				XLDBG("Register %s (%s) in %s as %f",
-					  it.first.c_str(),
-					  it.second.myTypes.c_str(),
-					  dll.c_str(),
-					  func_id.get<double>());
+				ExcelResult dll_name;
+				Excel4_(xlGetName, xloperCast(&dll_name), 0);
+				myDllName = dll_name.get<std::string>();
 			}
 		}
+		myAttachTiming.getNameMs = elapsedMs(start, Clock::now());
+
+		// Register through Excel12 when possible so that the XLOPER12 type
+		// codes are understood by the host.
+		if (hasExcel12())
+			registerFunctions<xlOperand12, ExcelResult12>();
+		else
+			registerFunctions<xlOperand, ExcelResult>();
+
+		myAttachTiming.totalMs = elapsedMs(start, Clock::now());
+		XLDBG("Registered %d functions (%d failed) in %.1f ms: "
+			  "xlGetName %.1f ms, arguments %.1f ms, xlfRegister %.1f ms",
+			  myAttachTiming.numFunctions, myAttachTiming.numFailed,
+			  myAttachTiming.totalMs, myAttachTiming.getNameMs,
+			  myAttachTiming.argumentsMs, myAttachTiming.registerMs);
+	}
+
+	/// Timing of the last attach()
+	const AttachTiming& attachTiming() const {
+		return myAttachTiming;
 	}
 
 	/// Detach from host
 	void
 	detach() {
 		Progress progress("ExcelHost: Detaching");
+		myAsyncPool.stop();
+		myReducePool.stop();
+	}
+
+	/// Run a batch of tasks on the threads shared by the reductions
+	void
+	runParallel(int num_tasks, const std::function<void (int)>& fn) {
+		myReducePool.run(num_tasks, fn);
+	}
+
+	/// Queue the task of an asynchronous function for the given handle
+	void
+	submitAsync(const XLOPER12& handle, AsyncHandle::Task&& task) {
+		if (!hasExcel12())
+			XLKIT_THROW("Asynchronous functions require Excel 2010 or later");
+		myAsyncPool.push(handle, std::move(task));
+	}
+
+	/// Run the task of an asynchronous function on a worker thread and
+	/// return its result, or an error if it throws.
+	void
+	runAsync(const XLOPER12& handle, const AsyncHandle::Task& task) {
+#ifdef XLKIT_USE_TRACE
+		TraceScope trace(Trace::TRACE_ASYNC, "AsyncTask");
+#endif
+		xlOperand12 result(xlError(xlerrValue));
+		try {
+			task(result);
+		} catch (std::exception& err) {
+			XLDBG_EXCEPT(err);
+			result = xlOperand12(err.what());
+		} catch (xlError& err) {
+			XLDBG_EXCEPT(err);
+			result = xlOperand12(err);
+		} catch (...) {
+			XLDBG("Unknown exception caught");
+			result = xlOperand12(xlError(xlerrValue));
+		}
+		asyncReturn(handle, result);
+	}
+
+	/// Return the result of an asynchronous function to Excel. This may be
+	/// called from any thread. It fails harmlessly when Excel has abandoned
+	/// the handle, such as after the calculation was canceled.
+	bool
+	asyncReturn(const XLOPER12& handle, const xlOperand12& result) {
+		if (!hasExcel12())
+			XLKIT_THROW("Asynchronous functions require Excel 2010 or later");
+#ifdef XLKIT_USE_TRACE
+		TraceScope trace(Trace::TRACE_CALLBACK, NULL, xlAsyncReturn);
+#endif
+		XLOPER12 h = handle;
+		LPXLOPER12 opers[] = {
+			&h, const_cast<LPXLOPER12>(xloperCast(&result))
+		};
+		ExcelResult12 unused_result;
+		int xlret = MdCallBack12_(xlAsyncReturn, 2, opers,
+								  xloperCast(&unused_result));
+		checkCallV(xlAsyncReturn, 2, xlret);
+		return (xlret == xlretSuccess);
 	}
 
 	template <typename... PARMS>
 	bool call(int xlfn, const PARMS&... parms) {
-		const size_t n_parms = sizeof...(parms);
-		std::vector<xlOperand> args;
-		args.reserve(n_parms);
-		getArgs(args, parms...);
-		return callV(xlfn, args);
+		ExcelResult unused_result;
+		return evalCall(xlfn, unused_result, parms...);
 	}
 	template <typename... PARMS>
 	bool evalCall(int xlfn, ExcelResult& result, const PARMS&... parms) {
-		const size_t n_parms = sizeof...(parms);
-		std::vector<xlOperand> args;
-		args.reserve(n_parms);
-		getArgs(args, parms...);
-		return callV(xlfn, xloperCast(&result), args);
+		ArgPack<xlOperand, XLOPER, char, sizeof...(PARMS)> args(parms...);
+		return callV(xlfn, result, args.count(), args.opers());
+	}
+	/// Versions of call() and evalCall() using XLOPER12, only available when
+	/// hasExcel12() is true
+	/// @{
+	template <typename... PARMS>
+	bool call12(int xlfn, const PARMS&... parms) {
+		ExcelResult12 unused_result;
+		return evalCall12(xlfn, unused_result, parms...);
+	}
+	template <typename... PARMS>
+	bool evalCall12(int xlfn, ExcelResult12& result, const PARMS&... parms) {
+		ArgPack<xlOperand12, XLOPER12, XCHAR, sizeof...(PARMS)> args(parms...);
+		return callV(xlfn, result, args.count(), args.opers());
+	}
+	/// @}
+
+	/// Coerce the range reference ref into a matrix of values with
+	/// xlCoerce. The result borrows Excel's memory until it is released
+	/// with free12().
+	bool coerce12(const XLOPER12& ref, xlOperand12& result) {
+		XLOPER12 type;
+		type.xltype = xltypeInt;
+		type.val.w = xltypeMulti;
+		LPXLOPER12 opers[] = { const_cast<LPXLOPER12>(&ref), &type };
+		return callV(xlCoerce, result, 2, opers);
+	}
+	/// Release a result which Excel returned into result
+	void free12(xlOperand12& result) {
+		LPXLOPER12 opers[] = { xloperCast(&result) };
+		MdCallBack12_(xlFree, /*count*/1, opers, NULL);
+		opers[0]->xltype = xltypeNil;
+	}
+
+	/// Thread which attached the add-in, which is Excel's main thread
+	std::thread::id mainThread() const {
+		return myMainThread;
 	}
 
 	void setStatusV(const char *fmt, va_list args) {
@@ -224,7 +570,11 @@ class ExcelHost {
 
 	class Progress {
 	  public:
-		Progress(const char *fmt, ...) {
+		Progress(const char *fmt, ...)
+#ifdef XLKIT_USE_TRACE
+			: myTrace(Trace::TRACE_PROGRESS, fmt)
+#endif
+		{
 			va_list args;
 			va_start(args, fmt);
 			ExcelHost::instance().setStatusV(fmt, args);
@@ -233,12 +583,23 @@ class ExcelHost {
 		~Progress() {
 			ExcelHost::instance().clearStatus();
 		}
+#ifdef XLKIT_USE_TRACE
+	  private:
+		TraceScope myTrace;
+#endif
 	};
 
   private:
 
 	ExcelHost()
-		: myAddinLabel("Generic XLKit Addin") {
+		: myAddinLabel("Generic XLKit Addin")
+		, myAsyncPool(XLKIT_ASYNC_THREADS, XLKIT_ASYNC_QUEUE_SIZE,
+					  [this](const XLOPER12& handle,
+							 const AsyncHandle::Task& task) {
+			runAsync(handle, task);
+		})
+		, myReducePool(XLKIT_REDUCE_THREADS) {
+#ifdef _WIN32
 		HMODULE handle = LoadLibraryA("XLCALL32.DLL");
 		if (!handle)
 			XLKIT_THROW("Failed to load XLCALL32.DLL");
@@ -248,10 +609,187 @@ class ExcelHost {
 		Excel4v_ = (ExcelProc4v) ::GetProcAddress(handle, "Excel4v");
 		if (!Excel4v_)
 			XLKIT_THROW("Failed to get Excel4v function address");
+		// Excel 2007+ exports its XLOPER12 entry point from the main module
+		MdCallBack12_ = (ExcelProc12) ::GetProcAddress(
+							::GetModuleHandleA(NULL), "MdCallBack12");
+#else
+		Excel4_ = &::Excel4;
+		Excel4v_ = &::Excel4v;
+		MdCallBack12_ = &::MdCallBack12;
+#endif
+	}
+
+	typedef std::chrono::steady_clock Clock;
+
+	static double elapsedMs(Clock::time_point start, Clock::time_point end) {
+		return std::chrono::duration<double, std::milli>(end - start).count();
+	}
+
+	// Register all functions in the Registry using operand type OPER.
+	// The arguments shared by all functions are built once, and those of
+	// each function are built in the CallArena on the stack so that
+	// registration does not touch the heap.
+	template <typename OPER, typename RESULT>
+	void
+	registerFunctions() {
+		typedef decltype(xloperCast((OPER*)NULL)) LPOPER;
+		enum {
+			NUM_FIXED_ARGS = 10,
+			MAX_ARGS = NUM_FIXED_ARGS + MAX_XL12_UDF_ARG
+		};
+
+		const OPER dll_name(myDllName.c_str());
+		const OPER category(myAddinLabel.c_str());
+		const OPER missing;
+
+		// Excel strings are limited to 255 characters
+		char arg_names[256];
+		char last_help[256];
+
+		OPER args[MAX_ARGS];
+		LPOPER parms[MAX_ARGS];
+
+		for (const FunctionInfo* info : Registry::instance().functionInfos()) {
+
+#ifdef XLKIT_USE_TRACE
+			TraceScope trace(Trace::TRACE_REGISTER, info->excelName);
+#endif
+			Clock::time_point start = Clock::now();
+
+			// Rewinds the arena, reusing the memory of the previous function
+			CallArenaScope arena;
+
+			// Comma separated list of argument names, leaving out hidden
+			// arguments such as the async handle
+			size_t len = 0;
+			int last_visible = -1;
+			arg_names[0] = '\0';
+			for (int j = 0; j < info->numArgs; ++j) {
+				const char* name = info->argNames[j]();
+				if (!name)
+					continue;
+				if (len < sizeof(arg_names)) {
+					len += strnprintf(arg_names + len, sizeof(arg_names) - len,
+									  (last_visible >= 0 ? ", %s" : "%s"), name);
+				}
+				last_visible = j;
+			}
+
+			args[1].set(info->procedure);
+			args[2].set(info->types);
+			args[3].set(info->excelName);
+			args[4].set(arg_names);
+			args[9].set(info->help);
+
+			int n = 0;
+			parms[n++] = const_cast<LPOPER>(xloperCast(&dll_name));	// pxModuleText
+			parms[n++] = xloperCast(&args[1]);	// pxProcedure
+			parms[n++] = xloperCast(&args[2]);	// pxTypeText
+			parms[n++] = xloperCast(&args[3]);	// pxFunctionText
+			parms[n++] = xloperCast(&args[4]);	// pxArgumentText
+			parms[n++] = const_cast<LPOPER>(xloperCast(&missing));	// pxMacroType
+																	// (default: from anywhere)
+			parms[n++] = const_cast<LPOPER>(xloperCast(&category));	// pxCategory
+			parms[n++] = const_cast<LPOPER>(xloperCast(&missing));	// pxShortcutText (none)
+			parms[n++] = const_cast<LPOPER>(xloperCast(&missing));	// pxHelpTopic (none)
+			parms[n++] = xloperCast(&args[9]);	// pxFunctionHelp
+
+			// pxArgumentHelp...
+			for (int j = 0; j <= last_visible && n < MAX_ARGS; ++j) {
+				if (!info->argNames[j]())
+					continue;
+				// See http://msdn.microsoft.com/en-us/library/bb687841.aspx
+				// for _Argument Description String Truncation in the
+				// Function Wizard_ for why we need to do this.  In
+				// reality, it looks lik Excel actually avoids
+				// truncation by specifically looking for ". ".
+				if (j < last_visible) {
+					args[n].set(info->argHelp[j]());
+				} else {
+					strnprintf(last_help, sizeof(last_help), "%s. ",
+							   info->argHelp[j]());
+					args[n].set(last_help);
+				}
+				parms[n] = xloperCast(&args[n]);
+				++n;
+			}
+
+			Clock::time_point built = Clock::now();
+
+			RESULT func_id;
+			callV(xlfRegister, func_id, n, parms);
+
+			Clock::time_point registered = Clock::now();
+			myAttachTiming.argumentsMs += elapsedMs(start, built);
+			myAttachTiming.registerMs += elapsedMs(built, registered);
+			++myAttachTiming.numFunctions;
+
+			if (func_id.isError()) {
+				++myAttachTiming.numFailed;
+				XLDBG("Failed to register %s (%s) in %s: Error %s (%d)",
+					  info->procedure,
+					  info->types,
+					  myDllName.c_str(),
+					  func_id.template get<std::string>().c_str(),
+					  func_id.template get<xlError>().num);
+			} else {
+				XLDBG("Register %s (%s) in %s as %f",
+					  info->procedure,
+					  info->types,
+					  myDllName.c_str(),
+					  func_id.template get<double>());
+			}
+		}
 	}
 
 	bool
-	callV(int xlfn, xlOperand& result, const std::vector<xlOperand>& args) {
+	callV(int xlfn, xlOperand& result, int count, LPXLOPER parms[]) {
+		static_assert(sizeof(XLOPER) == sizeof(xlOperand),
+					  "Operand has the wrong size!");
+#ifdef XLKIT_USE_TRACE
+		TraceScope trace(Trace::TRACE_CALLBACK, NULL, xlfn);
+#endif
+		checkThreadSafeCall(xlfn);
+#ifdef XLKIT_USE_CALL_METRICS
+		CallMetrics::Clock::time_point start = CallMetrics::Clock::now();
+#endif
+		int xlret = Excel4v_(xlfn, xloperCast(&result), count, parms);
+#ifdef XLKIT_USE_CALL_METRICS
+		recordCallback(xlfn, start, xlret);
+#endif
+		checkCallV(xlfn, count, xlret);
+		return (xlret == xlretSuccess);
+	}
+	bool
+	callV(int xlfn, xlOperand12& result, int count, LPXLOPER12 parms[]) {
+		static_assert(sizeof(XLOPER12) == sizeof(xlOperand12),
+					  "Operand has the wrong size!");
+		if (!hasExcel12())
+			XLKIT_THROW("Excel12 is not supported by this version of Excel");
+#ifdef XLKIT_USE_TRACE
+		TraceScope trace(Trace::TRACE_CALLBACK, NULL, xlfn);
+#endif
+		checkThreadSafeCall(xlfn);
+#ifdef XLKIT_USE_CALL_METRICS
+		CallMetrics::Clock::time_point start = CallMetrics::Clock::now();
+#endif
+		int xlret = MdCallBack12_(xlfn, count, parms, xloperCast(&result));
+#ifdef XLKIT_USE_CALL_METRICS
+		recordCallback(xlfn, start, xlret);
+#endif
+		checkCallV(xlfn, count, xlret);
+		return (xlret == xlretSuccess);
+	}
+#ifdef XLKIT_USE_CALL_METRICS
+	// Count a callV() call in the CallStats of xlfn
+	static void recordCallback(int xlfn, CallMetrics::Clock::time_point start, int xlret) {
+		int id = CallMetrics::callbackId(xlfn);
+		if (id >= 0)
+			CallMetrics::record(id, start, xlret != xlretSuccess, 0);
+	}
+#endif
+	// Report failed callV() results in debug builds
+	void checkCallV(int xlfn, int n_args, int xlret) {
 #ifdef _DEBUG
 		const char *xlfn_type = "<unknown xlfn type>";
 		if (xlfn & xlCommand)
@@ -262,18 +800,8 @@ class ExcelHost {
 			xlfn_type = "xlIntl";
 		else if (xlfn & xlPrompt)
 			xlfn_type = "xlPrompt";
-		//XLDBG("callV %s %d with %d args", xlfn_type, xlfn & 0x0FFF, args.size());
-#endif
-		static_assert(sizeof(XLOPER) == sizeof(xlOperand),
-					  "Operand has the wrong size!");
-		std::vector<LPXLOPER> parms;
-		parms.reserve(args.size());
-		for (int i = 0, n = int(args.size()); i < n; i++)
-			parms.push_back(const_cast<LPXLOPER>(xloperCast(&args[i])));
-		int xlret = Excel4v_(xlfn, xloperCast(&result), int(parms.size()), parms.data());
-#ifdef _DEBUG
 		if (xlret != xlretSuccess) {
-			XLDBG("callV %s %d with %d args", xlfn_type, xlfn & 0x0FFF, args.size());
+			XLDBG("callV %s %d with %d args", xlfn_type, xlfn & 0x0FFF, n_args);
 			// Multiple error bits might be on
 			const char *xlret_type = "<unknown xlret type>";
 			if (xlret & xlretAbort)
@@ -290,108 +818,1313 @@ class ExcelHost {
 				xlret_type = "xlretFailed";
 			if (xlret & xlretUncalced)
 				xlret_type = "xlretUncalced";
+			if (xlret & xlretNotThreadSafe)
+				xlret_type = "xlretNotThreadSafe";
 			XLDBG("-> FAILED with %s", xlret_type);
 		}
+#else
+		(void)xlfn;
+		(void)n_args;
+		(void)xlret;
 #endif
-		return (xlret == xlretSuccess);
 	}
-	bool callV(int xlfn, const std::vector<xlOperand>& args) {
-		ExcelResult unused_result;
-		return callV(xlfn, unused_result, args);
+	// Report callbacks that Excel does not allow from a multithreaded
+	// recalculation thread in debug builds. Only the main thread may run
+	// commands, register functions or use most of the special functions.
+	void checkThreadSafeCall(int xlfn) {
+#ifdef _DEBUG
+		if (myMainThread == std::thread::id()
+			|| myMainThread == std::this_thread::get_id())
+			return;
+		bool legal = true;
+		if (xlfn & xlCommand) {
+			legal = false;
+		} else if (xlfn & xlSpecial) {
+			switch (xlfn) {
+				case xlFree:
+				case xlCoerce:
+				case xlSheetId:
+				case xlSheetNm:
+				case xlAbort:
+				case xlGetInst:
+				case xlGetHwnd:
+				case xlGetBinaryName:
+				case xlDefineBinaryName:
+				case xlAsyncReturn:
+					break;
+				default:
+					legal = false;
+					break;
+			}
+		} else if (xlfn == xlfRegister || xlfn == xlfUnregister) {
+			legal = false;
+		}
+		if (!legal) {
+			XLDBG("Excel callback %d is not allowed from a multithreaded "
+				  "recalculation thread", xlfn);
+		}
+#else
+		(void)xlfn;
+#endif
 	}
 
-	void getArgs(std::vector<xlOperand>&) {
-	}
-	template <typename T>
-	void getArgs(std::vector<xlOperand>& args, const T& parm) {
-		args.push_back(xlOperand(parm));
-	}
-	template <typename T, typename... REST>
-	void getArgs(std::vector<xlOperand>& args, const T& parm, const REST&... rest) {
-		args.push_back(xlOperand(parm));
-		getArgs(args, rest...);
-	}
+	// Arguments of a callback into Excel, built on the stack from the N
+	// parameters. Operands are passed in place without copying, strings are
+	// copied into a stack buffer and other values are converted into
+	// operands held by the pack.
+	template <typename OPER, typename XLOPER_T, typename CHAR_T, size_t N>
+	class ArgPack {
+	  public:
+		template <typename... PARMS>
+		explicit ArgPack(const PARMS&... parms)
+			: myCharsUsed(0) {
+			add(0, parms...);
+		}
+
+		int count() const {
+			return int(N);
+		}
+		XLOPER_T** opers() {
+			return myOpers;
+		}
+
+	  private:
+		ArgPack(const ArgPack&);
+		ArgPack& operator=(const ArgPack&);
+
+		enum { SIZE = (N > 0 ? N : 1) };
+
+		void add(size_t) {
+		}
+		template <typename T, typename... REST>
+		void add(size_t i, const T& parm, const REST&... rest) {
+			set(i, parm, std::is_base_of<OPER, T>());
+			add(i + 1, rest...);
+		}
+
+		// Operands, including results of earlier calls, are passed as is
+		template <typename T>
+		void set(size_t i, const T& x, std::true_type) {
+			myOpers[i] = const_cast<XLOPER_T*>(xloperCast(&x));
+		}
+		template <typename T>
+		void set(size_t i, const T& v, std::false_type) {
+			myArgs[i] = OPER(v);
+			myOpers[i] = xloperCast(&myArgs[i]);
+		}
+		void set(size_t i, const char* v, std::false_type) {
+			setString(i, v, ::strlen(v));
+		}
+		void set(size_t i, const std::string& v, std::false_type) {
+			setString(i, v.data(), v.size());
+		}
+
+		// Counted string in myChars, which the operand doesn't own so it is
+		// left alone when the operand is reset
+		template <typename FROM_T>
+		void setString(size_t i, const FROM_T* v, size_t len) {
+			const size_t max_len = (sizeof(CHAR_T) == 1 ? 255 : 32767);
+			if (len > max_len)
+				len = max_len;
+			if (len + 1 > size_t(XLKIT_CALL_STRING_CHARS) - myCharsUsed) {
+				myArgs[i] = OPER(std::basic_string<FROM_T>(v, len));
+				myOpers[i] = xloperCast(&myArgs[i]);
+				return;
+			}
+			CHAR_T* str = myChars + myCharsUsed;
+			myCharsUsed += len + 1;
+			str[0] = CHAR_T(len);
+			for (size_t j = 0; j < len; ++j)
+				str[j + 1] = CHAR_T(typename std::make_unsigned<FROM_T>::type(v[j]));
+			XLOPER_T* x = xloperCast(&myArgs[i]);
+			x->xltype = xltypeStr;
+			x->val.str = str;
+			myOpers[i] = x;
+		}
+
+		OPER myArgs[SIZE];
+		XLOPER_T* myOpers[SIZE];
+		CHAR_T myChars[XLKIT_CALL_STRING_CHARS];
+		size_t myCharsUsed;
+	};
 
   private:
 	std::string myAddinLabel;
-
-	static ExcelHost* theInstance;
+	std::string myDllName;
+	AttachTiming myAttachTiming;
+	std::thread::id myMainThread;
+	AsyncPool myAsyncPool;
+	ReducePool myReducePool;
+
+	// Default constructed so that it is zero initialized before any dynamic
+	// initializer can call instance()
+	static std::atomic<ExcelHost*> theInstance;
 };
 
 //
 // Initialize global data for namespace xlkit::detail
 //
-ExcelHost* ExcelHost::theInstance = NULL;
+std::atomic<ExcelHost*> ExcelHost::theInstance;
+
+// Implementation for xlReduce.hpp
+void
+runParallel(int num_tasks, const std::function<void (int)>& fn) {
+	ExcelHost::instance().runParallel(num_tasks, fn);
+}
 
 } // namespace detail
 
 //
 // ResultOperandPtr
 //
-__declspec(thread) static XLOPER theTLSOperand;
+static XLKIT_THREAD_LOCAL XLOPER theTLSOperand;
 ResultOperandPtr::ResultOperandPtr()
 	: myOperand(detail::xlOperandCast(&theTLSOperand)) {
 	// Reset it to default error
 	theTLSOperand.xltype = xltypeErr;
 	theTLSOperand.val.err = xlerrValue;
+#ifdef XLKIT_USE_CALL_METRICS
+	detail::CallMetrics::noteResult(detail::CallMetrics::RESULT_OPER, &theTLSOperand);
+#endif
 }
 ResultOperandPtr::ResultOperandPtr(const xlOperand& copy)
 	: myOperand(detail::xlOperandCast(&theTLSOperand)) {
 	// Reset it to default error
 	theTLSOperand.xltype = xltypeErr;
 	theTLSOperand.val.err = xlerrValue;
+#ifdef XLKIT_USE_CALL_METRICS
+	detail::CallMetrics::noteResult(detail::CallMetrics::RESULT_OPER, &theTLSOperand);
+#endif
 	// Copy
 	*myOperand = copy;
 }
 
 //
-// Registry
+// ResultOperand12Ptr
 //
-Registry* Registry::theInstance = NULL;
-
-void
-Registry::setAddinLabel(const char* label) {
-	detail::ExcelHost::instance().setAddinLabel(label);
+static XLKIT_THREAD_LOCAL XLOPER12 theTLSOperand12;
+ResultOperand12Ptr::ResultOperand12Ptr()
+	: myOperand(detail::xlOperandCast(&theTLSOperand12)) {
+	// Reset it to default error
+	theTLSOperand12.xltype = xltypeErr;
+	theTLSOperand12.val.err = xlerrValue;
+#ifdef XLKIT_USE_CALL_METRICS
+	detail::CallMetrics::noteResult(detail::CallMetrics::RESULT_OPER12, &theTLSOperand12);
+#endif
+}
+ResultOperand12Ptr::ResultOperand12Ptr(const xlOperand12& copy)
+	: myOperand(detail::xlOperandCast(&theTLSOperand12)) {
+	// Reset it to default error
+	theTLSOperand12.xltype = xltypeErr;
+	theTLSOperand12.val.err = xlerrValue;
+#ifdef XLKIT_USE_CALL_METRICS
+	detail::CallMetrics::noteResult(detail::CallMetrics::RESULT_OPER12, &theTLSOperand12);
+#endif
+	// Copy
+	*myOperand = copy;
 }
-
-} // namespace XLKIT_VERSION_NAME
-} // namespace xlkit
-
 
 //
-// Define public entry points for .xll
+// getCaller
 //
+namespace detail {
 
-LPXLOPER WINAPI
-xlAddInManagerInfo(LPXLOPER xAction) {
+template <typename XLOPER_T, typename XLREF_T>
+static bool
+callerFromRef(const XLOPER_T& x, CallerId& caller) {
+	const XLREF_T* ref;
+	switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+		case xltypeSRef:
+			caller.sheet = 0;
+			ref = &x.val.sref.ref;
+			break;
+		case xltypeRef:
+			if (!x.val.mref.lpmref || x.val.mref.lpmref->count < 1)
+				return false;
+			caller.sheet = uintptr_t(x.val.mref.idSheet);
+			ref = &x.val.mref.lpmref->reftbl[0];
+			break;
+		default:
+			return false;
+	}
+	caller.rowFirst = int(ref->rwFirst);
+	caller.rowLast = int(ref->rwLast);
+	caller.colFirst = int(ref->colFirst);
+	caller.colLast = int(ref->colLast);
+	return true;
+}
 
-	XLKIT_PRAGMA_DLL_EXPORT
+} // namespace detail
 
-	using namespace xlkit;
-	using namespace xlkit::detail;
+const AttachTiming&
+attachTiming() {
+	return detail::ExcelHost::instance().attachTiming();
+}
 
-	ResultOperandPtr result; // default value is error
+bool
+getCaller(CallerId& caller) {
+	using namespace detail;
+	ExcelHost& host = ExcelHost::instance();
+	if (host.hasExcel12()) {
+		ExcelHost::ExcelResult12 result;
+		if (!host.evalCall12(xlfCaller, result))
+			return false;
+		return callerFromRef<XLOPER12, XLREF12>(*xloperCast(&result), caller);
+	} else {
+		ExcelHost::ExcelResult result;
+		if (!host.evalCall(xlfCaller, result))
+			return false;
+		return callerFromRef<XLOPER, XLREF>(*xloperCast(&result), caller);
+	}
+}
 
-	try {
-		if (xlOperandCast(xAction)->get<int>() == 1)
-			result->set(ExcelHost::instance().addinLabel());
-	} catch(std::exception &err) {
-		XLDBG_EXCEPT(err);
-	} catch(...) {
-		XLDBG("Unknown EXCEPTION!");
+//
+// RangeReader
+//
+RangeReader::RangeReader(const xlOperand12& ref, int block_rows)
+	: myRef(&ref)
+	, myIsRef(false)
+	, myRows(0)
+	, myCols(0)
+	, myBlockRows(1)
+	, myBlockIndex(-1) {
+	using namespace detail;
+	const XLOPER12& x = *xloperCast(&ref);
+	const XLREF12* area = NULL;
+	switch (x.xltype & ~(xlbitXLFree | xlbitDLLFree)) {
+		case xltypeSRef:
+			area = &x.val.sref.ref;
+			break;
+		case xltypeRef:
+			if (!x.val.mref.lpmref || x.val.mref.lpmref->count != 1)
+				XLKIT_THROW("RangeReader only supports references to a single area");
+			area = &x.val.mref.lpmref->reftbl[0];
+			break;
 	}
 
-	return xloperCast(result);
-}
+	if (area) {
+		myIsRef = true;
+		myRows = int(area->rwLast - area->rwFirst) + 1;
+		myCols = int(area->colLast - area->colFirst) + 1;
+		if (block_rows <= 0)
+			block_rows = int(XLKIT_RANGE_BLOCK_CELLS) / myCols;
+		myBlockRows = std::max(1, block_rows);
+		return;
+	}
 
-int WINAPI
-xlAutoOpen() {
+	// Values are read as a single block
+	if (ref.isCellMatrix()) {
+		xlConstCellMatrixRef12 cells = ref.get<xlConstCellMatrixRef12>();
+		myRows = cells.rows();
+		myCols = cells.cols();
+		myBlock.myCells = &ref;
+	} else {
+		// A single value is a 1x1 range
+		myBlock.myValues.setMatrix(1, 1)(0, 0) = ref;
+		myRows = 1;
+		myCols = 1;
+	}
+	myBlockRows = std::max(1, myRows);
+}
 
-	XLKIT_PRAGMA_DLL_EXPORT
+RangeReader::~RangeReader() {
+	release();
+}
 
-	using namespace xlkit::detail;
+const RangeReader::Block&
+RangeReader::read(int b) {
+	using namespace detail;
+	if (b < 0 || b >= numBlocks())
+		XLKIT_THROW("Block index is out of range");
+	if (b == myBlockIndex)
+		return myBlock;
+
+	myBlock.myRowBegin = b * myBlockRows;
+	myBlock.myRowEnd = std::min(myRows, myBlock.myRowBegin + myBlockRows);
+	if (!myIsRef) {
+		myBlockIndex = b;
+		return myBlock;
+	}
+	release();
+
+	// Reference to the rows of the block
+	XLOPER12 block_ref = *xloperCast(myRef);
+	XLMREF12 mref;
+	XLREF12* area;
+	block_ref.xltype &= ~(xlbitXLFree | xlbitDLLFree);
+	if (block_ref.xltype == xltypeSRef) {
+		area = &block_ref.val.sref.ref;
+	} else {
+		mref = *block_ref.val.mref.lpmref;
+		block_ref.val.mref.lpmref = &mref;
+		area = &mref.reftbl[0];
+	}
+	RW first_row = area->rwFirst;
+	area->rwFirst = first_row + myBlock.myRowBegin;
+	area->rwLast = first_row + myBlock.myRowEnd - 1;
+
+	ExcelHost& host = ExcelHost::instance();
+	myBlock.myValues = xlOperand12();
+	if (!host.coerce12(block_ref, myBlock.myValues))
+		XLKIT_THROW("Could not read the values of the range");
+	myBlock.myExcelOwned = true;
+	myBlock.myCells = &myBlock.myValues;
+	if (!myBlock.myValues.isCellMatrix()) {
+		xlOperand12 value(myBlock.myValues);
+		release();
+		myBlock.myValues.setMatrix(1, 1)(0, 0) = value;
+	}
+	myBlockIndex = b;
+	return myBlock;
+}
 
-	try {
+void
+RangeReader::release() {
+	if (myBlock.myExcelOwned) {
+		detail::ExcelHost::instance().free12(myBlock.myValues);
+		myBlock.myExcelOwned = false;
+	}
+	myBlockIndex = -1;
+}
+
+//
+// AsyncHandle
+//
+void
+AsyncHandle::submitTask(Task task) const {
+	detail::ExcelHost::instance().submitAsync(
+		*detail::xloperCast(myHandle), std::move(task));
+}
+void
+AsyncHandle::complete(const xlOperand12& result) const {
+	detail::ExcelHost::instance().asyncReturn(
+		*detail::xloperCast(myHandle), result);
+}
+
+//
+// ResultFpArrayPtr
+//
+namespace detail {
+
+// Resize the thread-local FP_T buffer to hold a rows x cols array
+template <typename FP_T>
+static FP_T*
+resizeTLSFpArray(FP_T*& buffer, size_t& capacity, int rows, int cols) {
+	if (rows < 0 || cols < 0)
+		XLKIT_THROW("Invalid array size");
+	size_t bytes = xlFpArrayT<FP_T>::byteSize(rows, cols);
+	if (bytes > capacity) {
+		void* p = ::realloc(buffer, bytes);
+		if (!p)
+			throw std::bad_alloc();
+		buffer = reinterpret_cast<FP_T*>(p);
+		capacity = bytes;
+	}
+	buffer->rows = rows;
+	buffer->columns = cols;
+	return buffer;
+}
+
+} // namespace detail
+
+static XLKIT_THREAD_LOCAL FP* theTLSFpArray;
+static XLKIT_THREAD_LOCAL size_t theTLSFpArrayCapacity;
+ResultFpArrayPtr::ResultFpArrayPtr(int rows, int cols) {
+	if (rows > 0xFFFF || cols > 0xFFFF)
+		XLKIT_THROW("Array is too large for FP, use FP12 instead");
+	myArray = xlFpArray(detail::resizeTLSFpArray(
+							theTLSFpArray, theTLSFpArrayCapacity, rows, cols));
+#ifdef XLKIT_USE_CALL_METRICS
+	detail::CallMetrics::noteResult(detail::CallMetrics::RESULT_FP, &theTLSFpArray);
+#endif
+}
+
+static XLKIT_THREAD_LOCAL FP12* theTLSFpArray12;
+static XLKIT_THREAD_LOCAL size_t theTLSFpArray12Capacity;
+ResultFpArray12Ptr::ResultFpArray12Ptr(int rows, int cols) {
+	myArray = xlFpArray12(detail::resizeTLSFpArray(
+							  theTLSFpArray12, theTLSFpArray12Capacity, rows, cols));
+#ifdef XLKIT_USE_CALL_METRICS
+	detail::CallMetrics::noteResult(detail::CallMetrics::RESULT_FP12, &theTLSFpArray12);
+#endif
+}
+
+//
+// CallArena
+//
+namespace detail {
+
+// Chunk of memory owned by the arena, data follows immediately after
+struct ArenaBlock {
+	ArenaBlock*	next;
+	size_t		size;
+};
+
+// Per-thread arena state. This must be POD for XLKIT_THREAD_LOCAL.
+struct ArenaState {
+	ArenaBlock*	head;		// current block, older blocks follow
+	char*		cur;		// next free byte in head
+	char*		end;		// end of head
+	size_t		used;		// bytes used in blocks other than head
+	int			depth;		// nesting depth of CallArenaScope
+	int			paused;		// nesting depth of CallArena::Pause
+};
+
+static const size_t ARENA_ALIGN = 16;
+static const size_t ARENA_MIN_BLOCK_SIZE = 64 * 1024;
+
+static XLKIT_THREAD_LOCAL ArenaState theTLSArena;
+
+static char*
+arenaBlockData(ArenaBlock* block) {
+	return reinterpret_cast<char*>(block) + sizeof(ArenaBlock);
+}
+
+// Free all blocks of the arena
+static void
+arenaRelease(ArenaState& arena) {
+	for (ArenaBlock* block = arena.head; block; ) {
+		ArenaBlock* next = block->next;
+		::free(block);
+		block = next;
+	}
+	arena.head = NULL;
+	arena.cur = NULL;
+	arena.end = NULL;
+	arena.used = 0;
+}
+
+// XLKIT_THREAD_LOCAL variables can't have destructors, so the blocks are
+// freed at thread exit through a fiber/thread-specific value which points to
+// the thread's ArenaState. It is set whenever the arena gets its first block.
+// The key is deleted when the XLL is unloaded so that no callback into the
+// unloaded code remains.
+#ifdef _WIN32
+static void WINAPI
+arenaThreadExit(void* arena) {
+	if (arena)
+		arenaRelease(*static_cast<ArenaState*>(arena));
+}
+
+class ArenaKey {
+  public:
+	ArenaKey() : myIndex(::FlsAlloc(&arenaThreadExit)) { }
+	~ArenaKey() {
+		if (myIndex != FLS_OUT_OF_INDEXES)
+			::FlsFree(myIndex);
+	}
+	void watch(ArenaState& arena) {
+		if (myIndex != FLS_OUT_OF_INDEXES)
+			::FlsSetValue(myIndex, &arena);
+	}
+  private:
+	DWORD	myIndex;
+};
+#else
+static void
+arenaThreadExit(void* arena) {
+	arenaRelease(*static_cast<ArenaState*>(arena));
+}
+
+class ArenaKey {
+  public:
+	ArenaKey() : myValid(::pthread_key_create(&myKey, &arenaThreadExit) == 0) { }
+	~ArenaKey() {
+		if (myValid)
+			::pthread_key_delete(myKey);
+	}
+	void watch(ArenaState& arena) {
+		if (myValid)
+			::pthread_setspecific(myKey, &arena);
+	}
+  private:
+	pthread_key_t	myKey;
+	bool			myValid;
+};
+#endif
+
+static ArenaKey theArenaKey;
+
+// Start a new head block that can hold at least the given number of bytes
+static void
+arenaGrow(ArenaState& arena, size_t bytes) {
+	size_t size = ARENA_MIN_BLOCK_SIZE;
+	if (arena.head && arena.head->size * 2 > size)
+		size = arena.head->size * 2;
+	if (bytes > size)
+		size = bytes;
+	ArenaBlock* block = reinterpret_cast<ArenaBlock*>(
+							::malloc(sizeof(ArenaBlock) + size));
+	if (!block)
+		throw std::bad_alloc();
+	if (arena.head)
+		arena.used += size_t(arena.cur - arenaBlockData(arena.head));
+	else
+		theArenaKey.watch(arena);
+	block->next = arena.head;
+	block->size = size;
+	arena.head = block;
+	arena.cur = arenaBlockData(block);
+	arena.end = arena.cur + size;
+}
+
+// Allocate bytes from the current block, growing the arena if needed
+static void*
+arenaBump(ArenaState& arena, size_t bytes) {
+	bytes = (bytes + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (!arena.head || size_t(arena.end - arena.cur) < bytes)
+		arenaGrow(arena, bytes);
+	void* p = arena.cur;
+	arena.cur += bytes;
+	return p;
+}
+
+// Release everything allocated so far. If the previous call needed more
+// than one block, they are coalesced into a single one for the next call,
+// but no more than XLKIT_ARENA_MAX_RETAINED_BYTES are kept between calls.
+static void
+arenaRewind(ArenaState& arena) {
+	if (arena.head && (arena.head->next
+					   || arena.head->size > XLKIT_ARENA_MAX_RETAINED_BYTES)) {
+		size_t total = 0;
+		for (ArenaBlock* block = arena.head; block; block = block->next)
+			total += block->size;
+		arenaRelease(arena);
+		if (total > XLKIT_ARENA_MAX_RETAINED_BYTES)
+			total = XLKIT_ARENA_MAX_RETAINED_BYTES;
+		if (total > 0)
+			arenaGrow(arena, total);
+	}
+	if (arena.head)
+		arena.cur = arenaBlockData(arena.head);
+	arena.used = 0;
+}
+
+CallArenaScope::CallArenaScope() {
+	ArenaState& arena = theTLSArena;
+	if (arena.depth++ == 0)
+		arenaRewind(arena);
+}
+CallArenaScope::~CallArenaScope() {
+	--theTLSArena.depth;
+}
+
+} // namespace detail
+
+bool
+CallArena::active() {
+	const detail::ArenaState& arena = detail::theTLSArena;
+	return (arena.depth > 0 && arena.paused == 0);
+}
+
+void*
+CallArena::allocate(size_t bytes) {
+	using namespace detail;
+	ArenaState& arena = theTLSArena;
+	if (arena.depth == 0 || arena.paused > 0)
+		return NULL;
+	return arenaBump(arena, bytes);
+}
+
+void*
+CallArena::allocateFor(const void* owner, size_t bytes) {
+	if (!owns(owner))
+		return NULL;
+	return detail::arenaBump(detail::theTLSArena, bytes);
+}
+
+bool
+CallArena::owns(const void* p) {
+	using namespace detail;
+	const char* c = reinterpret_cast<const char*>(p);
+	for (ArenaBlock* block = theTLSArena.head; block; block = block->next) {
+		const char* data = arenaBlockData(block);
+		if (c >= data && c < data + block->size)
+			return true;
+	}
+	return false;
+}
+
+size_t
+CallArena::bytesUsed() {
+	using namespace detail;
+	const ArenaState& arena = theTLSArena;
+	if (!arena.head)
+		return 0;
+	return arena.used + size_t(arena.cur - arenaBlockData(arena.head));
+}
+
+CallArena::Pause::Pause() {
+	++detail::theTLSArena.paused;
+}
+CallArena::Pause::~Pause() {
+	--detail::theTLSArena.paused;
+}
+
+//
+// CallMetrics
+//
+namespace detail {
+
+enum {
+	METRICS_BLOCK_SIZE = 64,
+	METRICS_NUM_BLOCKS = (XLKIT_METRICS_FUNCTIONS + METRICS_BLOCK_SIZE - 1)
+						 / METRICS_BLOCK_SIZE
+};
+
+// Counters of one function on one thread. They are only written by the
+// owning thread so they can be updated without atomic read-modify-writes.
+struct CallCounters {
+	std::atomic<uint64_t> calls;
+	std::atomic<uint64_t> failures;
+	std::atomic<uint64_t> totalNs;
+	std::atomic<uint64_t> maxNs;
+	std::atomic<uint64_t> resultCells;
+	std::atomic<uint64_t> histogram[CallStats::NUM_BUCKETS];
+};
+
+// Counters of all functions on one thread, allocated in blocks as functions
+// are first called. Shards are kept after their thread exits so that their
+// counts remain in the totals.
+struct CallMetricsShard {
+	std::atomic<CallCounters*> blocks[METRICS_NUM_BLOCKS];
+	std::atomic<unsigned> generation;
+};
+
+struct CallMetricsState {
+	std::mutex mutex;
+	std::vector<std::string> names;
+	std::vector<bool> callbacks;
+	std::vector<CallMetricsShard*> shards;
+	std::atomic<unsigned> generation;
+
+	~CallMetricsState() {
+		for (CallMetricsShard* shard : shards) {
+			for (int i = 0; i < METRICS_NUM_BLOCKS; ++i)
+				delete[] shard->blocks[i].load(std::memory_order_relaxed);
+			delete shard;
+		}
+	}
+};
+
+static CallMetricsState theCallMetrics;
+
+// Slots for the ids of Excel callbacks indexed by command, special function
+// and worksheet function numbers
+static std::atomic<int> theCallbackSlots[3][0x1000];
+
+static XLKIT_THREAD_LOCAL CallMetricsShard* theTLSMetricsShard;
+static XLKIT_THREAD_LOCAL int theTLSResultKind;
+static XLKIT_THREAD_LOCAL const void* theTLSResult;
+
+static int
+addFunctionId(std::atomic<int>& slot, const char* name, bool callback) {
+	CallMetricsState& state = theCallMetrics;
+	std::lock_guard<std::mutex> lock(state.mutex);
+	int id = slot.load(std::memory_order_relaxed);
+	if (id != 0)
+		return id - 1;
+	if (state.names.size() >= size_t(XLKIT_METRICS_FUNCTIONS)) {
+		slot.store(-1, std::memory_order_relaxed);
+		return -2;
+	}
+	state.names.push_back(name);
+	state.callbacks.push_back(callback);
+	id = int(state.names.size());
+	slot.store(id, std::memory_order_relaxed);
+	return id - 1;
+}
+
+static const char*
+callbackName(int xlfn, char* buffer, size_t size) {
+	switch (xlfn) {
+#define XLKIT_CALLBACK_NAME(XLFN) case XLFN: return "Excel:" #XLFN;
+		XLKIT_CALLBACK_NAME(xlFree)
+		XLKIT_CALLBACK_NAME(xlStack)
+		XLKIT_CALLBACK_NAME(xlCoerce)
+		XLKIT_CALLBACK_NAME(xlSet)
+		XLKIT_CALLBACK_NAME(xlSheetId)
+		XLKIT_CALLBACK_NAME(xlSheetNm)
+		XLKIT_CALLBACK_NAME(xlAbort)
+		XLKIT_CALLBACK_NAME(xlGetInst)
+		XLKIT_CALLBACK_NAME(xlGetHwnd)
+		XLKIT_CALLBACK_NAME(xlGetName)
+		XLKIT_CALLBACK_NAME(xlDefineBinaryName)
+		XLKIT_CALLBACK_NAME(xlGetBinaryName)
+		XLKIT_CALLBACK_NAME(xlAsyncReturn)
+		XLKIT_CALLBACK_NAME(xlfCaller)
+		XLKIT_CALLBACK_NAME(xlfEvaluate)
+		XLKIT_CALLBACK_NAME(xlfRegister)
+		XLKIT_CALLBACK_NAME(xlfUnregister)
+		XLKIT_CALLBACK_NAME(xlcMessage)
+#undef XLKIT_CALLBACK_NAME
+	}
+	strnprintf(buffer, size, "Excel:%s%d",
+			   (xlfn & xlCommand) ? "xlc" : (xlfn & xlSpecial) ? "xl" : "xlf",
+			   xlfn & 0x0FFF);
+	return buffer;
+}
+
+static CallMetricsShard&
+metricsShard() {
+	CallMetricsShard* shard = theTLSMetricsShard;
+	if (!shard) {
+		shard = new CallMetricsShard();
+		for (int i = 0; i < METRICS_NUM_BLOCKS; ++i)
+			shard->blocks[i].store(NULL, std::memory_order_relaxed);
+		CallMetricsState& state = theCallMetrics;
+		std::lock_guard<std::mutex> lock(state.mutex);
+		shard->generation.store(state.generation.load(std::memory_order_relaxed),
+								std::memory_order_relaxed);
+		state.shards.push_back(shard);
+		theTLSMetricsShard = shard;
+	}
+	return *shard;
+}
+
+static void
+zeroCounters(CallCounters& c) {
+	c.calls.store(0, std::memory_order_relaxed);
+	c.failures.store(0, std::memory_order_relaxed);
+	c.totalNs.store(0, std::memory_order_relaxed);
+	c.maxNs.store(0, std::memory_order_relaxed);
+	c.resultCells.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < CallStats::NUM_BUCKETS; ++i)
+		c.histogram[i].store(0, std::memory_order_relaxed);
+}
+
+// Add v to a counter that only this thread writes
+static inline void
+addCounter(std::atomic<uint64_t>& c, uint64_t v) {
+	c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+static inline int
+latencyBucket(uint64_t ns) {
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+	while (us && bucket < CallStats::NUM_BUCKETS - 1) {
+		us >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+} // namespace detail
+
+int
+detail::CallMetrics::functionId(std::atomic<int>& slot, const char* name) {
+	return addFunctionId(slot, name, false);
+}
+
+int
+detail::CallMetrics::callbackId(int xlfn) {
+	int kind = (xlfn & xlCommand) ? 0 : (xlfn & xlSpecial) ? 1 : 2;
+	std::atomic<int>& slot = theCallbackSlots[kind][xlfn & 0x0FFF];
+	int id = slot.load(std::memory_order_relaxed);
+	if (id != 0)
+		return id - 1;
+	char buffer[32];
+	return addFunctionId(slot, callbackName(xlfn, buffer, sizeof(buffer)), true);
+}
+
+void
+detail::CallMetrics::noteResult(ResultKind kind, const void* result) {
+	theTLSResultKind = kind;
+	theTLSResult = result;
+}
+
+uint64_t
+detail::CallMetrics::takeResultCells() {
+	uint64_t cells = 1;
+	const void* result = theTLSResult;
+	switch (theTLSResultKind) {
+		case RESULT_OPER: {
+			const XLOPER* x = reinterpret_cast<const XLOPER*>(result);
+			if (x->xltype & xltypeMulti)
+				cells = uint64_t(x->val.array.rows) * x->val.array.columns;
+			break;
+		}
+		case RESULT_OPER12: {
+			const XLOPER12* x = reinterpret_cast<const XLOPER12*>(result);
+			if (x->xltype & xltypeMulti)
+				cells = uint64_t(x->val.array.rows) * x->val.array.columns;
+			break;
+		}
+		case RESULT_FP: {
+			const FP* fp = *reinterpret_cast<FP* const*>(result);
+			cells = uint64_t(fp->rows) * fp->columns;
+			break;
+		}
+		case RESULT_FP12: {
+			const FP12* fp = *reinterpret_cast<FP12* const*>(result);
+			cells = uint64_t(fp->rows) * fp->columns;
+			break;
+		}
+	}
+	theTLSResultKind = RESULT_NONE;
+	return cells;
+}
+
+void
+detail::CallMetrics::record(int id, Clock::time_point start, bool failed,
+							uint64_t cells) {
+	uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+							   Clock::now() - start).count());
+	CallMetricsShard& shard = metricsShard();
+
+	// Restart this thread's counts after resetCallStats()
+	unsigned generation = theCallMetrics.generation.load(std::memory_order_relaxed);
+	if (shard.generation.load(std::memory_order_relaxed) != generation) {
+		for (int i = 0; i < METRICS_NUM_BLOCKS; ++i) {
+			CallCounters* block = shard.blocks[i].load(std::memory_order_relaxed);
+			for (int j = 0; block && j < METRICS_BLOCK_SIZE; ++j)
+				zeroCounters(block[j]);
+		}
+		shard.generation.store(generation, std::memory_order_release);
+	}
+
+	std::atomic<CallCounters*>& block = shard.blocks[id / METRICS_BLOCK_SIZE];
+	CallCounters* counters = block.load(std::memory_order_relaxed);
+	if (!counters) {
+		counters = new CallCounters[METRICS_BLOCK_SIZE];
+		for (int j = 0; j < METRICS_BLOCK_SIZE; ++j)
+			zeroCounters(counters[j]);
+		block.store(counters, std::memory_order_release);
+	}
+
+	CallCounters& c = counters[id % METRICS_BLOCK_SIZE];
+	addCounter(c.calls, 1);
+	if (failed)
+		addCounter(c.failures, 1);
+	addCounter(c.totalNs, ns);
+	if (ns > c.maxNs.load(std::memory_order_relaxed))
+		c.maxNs.store(ns, std::memory_order_relaxed);
+	addCounter(c.resultCells, cells);
+	addCounter(c.histogram[latencyBucket(ns)], 1);
+}
+
+double
+CallStats::percentileMs(double fraction) const {
+	uint64_t target = uint64_t(fraction * double(calls) + 0.5);
+	uint64_t count = 0;
+	for (int i = 0; i < NUM_BUCKETS - 1; ++i) {
+		count += histogram[i];
+		if (count >= target && count > 0)
+			return std::min(1e-3 * double(uint64_t(1) << i), 1e-6 * double(maxNs));
+	}
+	return 1e-6 * double(maxNs);
+}
+
+std::vector<CallStats>
+callStats() {
+	using namespace detail;
+	CallMetricsState& state = theCallMetrics;
+	std::lock_guard<std::mutex> lock(state.mutex);
+	unsigned generation = state.generation.load(std::memory_order_relaxed);
+
+	std::vector<CallStats> stats(state.names.size());
+	for (size_t id = 0; id < stats.size(); ++id) {
+		CallStats& s = stats[id];
+		s.name = state.names[id];
+		s.callback = state.callbacks[id];
+		s.calls = s.failures = s.totalNs = s.maxNs = s.resultCells = 0;
+		std::fill(s.histogram, s.histogram + CallStats::NUM_BUCKETS, uint64_t(0));
+	}
+	for (CallMetricsShard* shard : state.shards) {
+		// Shards which haven't restarted since resetCallStats() only hold
+		// older counts
+		if (shard->generation.load(std::memory_order_acquire) != generation)
+			continue;
+		for (size_t id = 0; id < stats.size(); ++id) {
+			const CallCounters* block = shard->blocks[id / METRICS_BLOCK_SIZE]
+										.load(std::memory_order_acquire);
+			if (!block)
+				continue;
+			const CallCounters& c = block[id % METRICS_BLOCK_SIZE];
+			CallStats& s = stats[id];
+			s.calls += c.calls.load(std::memory_order_relaxed);
+			s.failures += c.failures.load(std::memory_order_relaxed);
+			s.totalNs += c.totalNs.load(std::memory_order_relaxed);
+			s.maxNs = std::max(s.maxNs, c.maxNs.load(std::memory_order_relaxed));
+			s.resultCells += c.resultCells.load(std::memory_order_relaxed);
+			for (int i = 0; i < CallStats::NUM_BUCKETS; ++i)
+				s.histogram[i] += c.histogram[i].load(std::memory_order_relaxed);
+		}
+	}
+
+	stats.erase(std::remove_if(stats.begin(), stats.end(),
+							   [](const CallStats& s) { return s.calls == 0; }),
+				stats.end());
+	std::stable_sort(stats.begin(), stats.end(),
+					 [](const CallStats& a, const CallStats& b) {
+						 return a.totalNs > b.totalNs;
+					 });
+	return stats;
+}
+
+void
+resetCallStats() {
+	detail::theCallMetrics.generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+//
+// Trace
+//
+namespace detail {
+
+struct TraceEvent {
+	const char* name;
+	uint64_t start;
+	uint64_t duration;
+	int kind;
+	int value;
+};
+
+// Ring buffer of the events of one thread. Only the owning thread writes
+// the events, publishing each one by incrementing count. Buffers are kept
+// after their thread exits so that their events can still be written.
+struct TraceBuffer {
+	TraceEvent events[XLKIT_TRACE_EVENTS];
+	std::atomic<uint64_t> count;
+	std::atomic<unsigned> generation;
+	std::thread::id thread;
+	int index;
+};
+
+struct TraceState {
+	std::mutex mutex;
+	std::vector<TraceBuffer*> buffers;
+	std::atomic<unsigned> generation;
+
+	~TraceState() {
+		for (TraceBuffer* buffer : buffers)
+			delete buffer;
+	}
+};
+
+static TraceState theTrace;
+
+static XLKIT_THREAD_LOCAL TraceBuffer* theTLSTraceBuffer;
+
+static TraceBuffer&
+traceBuffer() {
+	TraceBuffer* buffer = theTLSTraceBuffer;
+	if (!buffer) {
+		buffer = new TraceBuffer;
+		buffer->count.store(0, std::memory_order_relaxed);
+		buffer->thread = std::this_thread::get_id();
+		TraceState& state = theTrace;
+		std::lock_guard<std::mutex> lock(state.mutex);
+		buffer->generation.store(state.generation.load(std::memory_order_relaxed),
+								 std::memory_order_relaxed);
+		buffer->index = int(state.buffers.size()) + 1;
+		state.buffers.push_back(buffer);
+		theTLSTraceBuffer = buffer;
+	}
+	return *buffer;
+}
+
+// Write s as a JSON string
+static void
+writeJsonString(std::ostream& out, const char* s) {
+	out << '"';
+	for (; *s; ++s) {
+		unsigned char c = static_cast<unsigned char>(*s);
+		if (c == '"' || c == '\\')
+			out << '\\' << char(c);
+		else if (c < 0x20)
+			out << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xF];
+		else
+			out << char(c);
+	}
+	out << '"';
+}
+
+} // namespace detail
+
+void
+detail::Trace::record(Kind kind, const char* name, int value, uint64_t start) {
+	uint64_t end = now();
+	TraceBuffer& buffer = traceBuffer();
+
+	// Restart this thread's events after clearTrace()
+	unsigned generation = theTrace.generation.load(std::memory_order_relaxed);
+	if (buffer.generation.load(std::memory_order_relaxed) != generation) {
+		buffer.count.store(0, std::memory_order_relaxed);
+		buffer.generation.store(generation, std::memory_order_release);
+	}
+
+	uint64_t count = buffer.count.load(std::memory_order_relaxed);
+	TraceEvent& event = buffer.events[count % XLKIT_TRACE_EVENTS];
+	event.name = name;
+	event.start = start;
+	event.duration = end - start;
+	event.kind = kind;
+	event.value = value;
+	buffer.count.store(count + 1, std::memory_order_release);
+}
+
+size_t
+writeTrace(std::ostream& out) {
+	using namespace detail;
+	static const char* const theCategories[] = {
+		"function", "callback", "progress", "async", "register"
+	};
+
+	TraceState& state = theTrace;
+	std::lock_guard<std::mutex> lock(state.mutex);
+	unsigned generation = state.generation.load(std::memory_order_relaxed);
+	std::thread::id main_thread = ExcelHost::instance().mainThread();
+
+	// Copy the events first, dropping those which were overwritten while
+	// they were being copied
+	std::vector<std::pair<int, TraceEvent>> events;
+	for (TraceBuffer* buffer : state.buffers) {
+		if (buffer->generation.load(std::memory_order_acquire) != generation)
+			continue;
+		uint64_t last = buffer->count.load(std::memory_order_acquire);
+		uint64_t first = (last > XLKIT_TRACE_EVENTS ? last - XLKIT_TRACE_EVENTS : 0);
+		size_t begin = events.size();
+		for (uint64_t i = first; i < last; ++i)
+			events.push_back(std::make_pair(buffer->index,
+											buffer->events[i % XLKIT_TRACE_EVENTS]));
+		uint64_t now = buffer->count.load(std::memory_order_acquire);
+		uint64_t overwritten = (now > XLKIT_TRACE_EVENTS + first
+								? now - XLKIT_TRACE_EVENTS - first : 0);
+		events.erase(events.begin() + begin,
+					 events.begin() + begin + size_t(std::min(overwritten, last - first)));
+	}
+
+	uint64_t origin = UINT64_MAX;
+	for (const std::pair<int, TraceEvent>& e : events)
+		origin = std::min(origin, e.second.start);
+
+	char number[64];
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	bool first = true;
+	for (TraceBuffer* buffer : state.buffers) {
+		out << (first ? "" : ",\n")
+			<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+			<< buffer->index << ",\"args\":{\"name\":\"";
+		if (buffer->thread == main_thread)
+			out << "Excel main thread";
+		else
+			out << "Thread " << buffer->index;
+		out << "\"}}";
+		first = false;
+	}
+	for (const std::pair<int, TraceEvent>& e : events) {
+		const TraceEvent& event = e.second;
+		const char* name = event.name;
+		if (event.kind == Trace::TRACE_CALLBACK)
+			name = callbackName(event.value, number, sizeof(number));
+		out << (first ? "" : ",\n") << "{\"name\":";
+		writeJsonString(out, name ? name : "");
+		strnprintf(number, sizeof(number), "%.3f,\"dur\":%.3f",
+				   1e-3 * double(event.start - origin), 1e-3 * double(event.duration));
+		out << ",\"cat\":\"" << theCategories[event.kind]
+			<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.first
+			<< ",\"ts\":" << number << "}";
+		first = false;
+	}
+	out << "\n]}\n";
+	return events.size();
+}
+
+size_t
+writeTrace(const char* path) {
+	std::ofstream out(path, std::ios::out | std::ios::trunc);
+	if (!out)
+		XLKIT_THROW("Failed to open trace file");
+	size_t n = writeTrace(out);
+	out.close();
+	if (!out)
+		XLKIT_THROW("Failed to write trace file");
+	return n;
+}
+
+void
+clearTrace() {
+	detail::theTrace.generation.fetch_add(1, std::memory_order_relaxed);
+}
+
+//
+// Registry
+//
+Registry Registry::theInstance;
+
+// Bounds of the table of registered functions. The linker sorts the MSVC
+// sections by name, so the entries in "xlkit$f" fall between the two
+// markers. GCC/ld provides __start_/__stop_ symbols for the section.
+#if defined(_MSC_VER)
+__declspec(allocate("xlkit$a")) static const FunctionInfo* const
+	theFunctionsBegin = NULL;
+__declspec(allocate("xlkit$z")) static const FunctionInfo* const
+	theFunctionsEnd = NULL;
+#else
+extern "C" {
+extern const FunctionInfo* const __start_xlkit_functions[]
+	__attribute__((weak));
+extern const FunctionInfo* const __stop_xlkit_functions[]
+	__attribute__((weak));
+}
+#endif
+
+namespace detail {
+
+// Function added by Registry::addFunction(), owning the strings of its info
+struct RuntimeFunction {
+	std::string		procedure;
+	std::string		excelName;
+	std::string		help;
+	FunctionInfo	info;
+};
+
+// Functions added by Registry::addFunction(). The deque keeps the address of
+// each info stable for the list of pointers.
+struct RuntimeFunctions {
+	std::deque<RuntimeFunction>		functions;
+	Registry::RuntimeFunctionList	infos;
+};
+
+// Constructed on first use as addFunction() may be called by the static
+// initializers of other translation units
+static RuntimeFunctions&
+runtimeFunctions() {
+	static RuntimeFunctions theFunctions;
+	return theFunctions;
+}
+
+} // namespace detail
+
+Registry::FunctionRange
+Registry::functionInfos() const {
+#if defined(_MSC_VER)
+	const FunctionInfo* const* first = &theFunctionsBegin + 1;
+	const FunctionInfo* const* last = &theFunctionsEnd;
+#else
+	const FunctionInfo* const* first = __start_xlkit_functions;
+	const FunctionInfo* const* last = __stop_xlkit_functions;
+#endif
+	return boost::range::join(
+			   StaticFunctionRange(FunctionIterator(first, last),
+								   FunctionIterator(last, last)),
+			   detail::runtimeFunctions().infos);
+}
+
+void
+Registry::addInfo(const std::string& procedure, const std::string& excel_name,
+				  const char* help, const char* types, int num_args,
+				  const FunctionInfo::TextFn* arg_names,
+				  const FunctionInfo::TextFn* arg_help) {
+	detail::RuntimeFunctions& runtime = detail::runtimeFunctions();
+	detail::RuntimeFunction* func = NULL;
+	for (detail::RuntimeFunction& f : runtime.functions) {
+		if (f.procedure == procedure)
+			func = &f;
+	}
+	if (!func) {
+		runtime.functions.push_back(detail::RuntimeFunction());
+		func = &runtime.functions.back();
+		runtime.infos.push_back(&func->info);
+	}
+	func->procedure = procedure;
+	func->excelName = excel_name;
+	func->help = help;
+	FunctionInfo info = {
+		func->procedure.c_str(), func->excelName.c_str(), func->help.c_str(),
+		types, num_args, arg_names, arg_help
+	};
+	func->info = info;
+}
+
+Registry::NameMap
+Registry::functions() const {
+	NameMap map;
+	for (const FunctionInfo* info : functionInfos()) {
+		std::string arg_names;
+		std::vector<std::string> parm_help;
+		for (int j = 0; j < info->numArgs; ++j) {
+			// Skip hidden arguments such as the async handle
+			if (!info->argNames[j]())
+				continue;
+			if (!arg_names.empty())
+				arg_names += ", ";
+			arg_names += info->argNames[j]();
+			parm_help.push_back(info->argHelp[j]());
+		}
+		map[info->procedure] = Wrapper(info->excelName, info->types, info->help,
+									   arg_names, parm_help);
+	}
+	return map;
+}
+
+void
+Registry::setAddinLabel(const char* label) {
+	detail::ExcelHost::instance().setAddinLabel(label);
+}
+
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+
+//
+// Define public entry points for .xll
+//
+
+LPXLOPER WINAPI
+xlAddInManagerInfo(LPXLOPER xAction) {
+
+	XLKIT_PRAGMA_DLL_EXPORT
+
+	using namespace xlkit;
+	using namespace xlkit::detail;
+
+	ResultOperandPtr result; // default value is error
+
+	try {
+		if (xlOperandCast(xAction)->get<int>() == 1)
+			result->set(ExcelHost::instance().addinLabel());
+	} catch(std::exception &err) {
+		XLDBG_EXCEPT(err);
+	} catch(...) {
+		XLDBG("Unknown EXCEPTION!");
+	}
+
+	return xloperCast(result);
+}
+
+LPXLOPER12 WINAPI
+xlAddInManagerInfo12(LPXLOPER12 xAction) {
+
+	XLKIT_PRAGMA_DLL_EXPORT
+
+	using namespace xlkit;
+	using namespace xlkit::detail;
+
+	ResultOperand12Ptr result; // default value is error
+
+	try {
+		if (xlOperandCast(xAction)->get<int>() == 1)
+			result->set(ExcelHost::instance().addinLabel());
+	} catch(std::exception &err) {
+		XLDBG_EXCEPT(err);
+	} catch(...) {
+		XLDBG("Unknown EXCEPTION!");
+	}
+
+	return xloperCast(result);
+}
+
+int WINAPI
+xlAutoOpen() {
+
+	XLKIT_PRAGMA_DLL_EXPORT
+
+	using namespace xlkit::detail;
+
+	try {
 		// Register our hooks
 		ExcelHost::instance().attach();
 		XLDBG("Opened.");
@@ -414,6 +2147,12 @@ xlAutoClose() {
 
 	try {
 
+#ifdef XLKIT_USE_TRACE
+		const char* trace_file = getenv("XLKIT_TRACE_FILE");
+		if (trace_file && *trace_file)
+			xlkit::writeTrace(trace_file);
+#endif
+
 		if (theAutoRemoveCalled) {
 			// we can safely unregister the functions here as the user has
 			// unloaded the xll and so won't expect to be able to use the
@@ -458,3 +2197,100 @@ xlAutoFree(LPXLOPER pxFree) {
 	xlOperandCast(pxFree)->reset();
 }
 
+void WINAPI
+xlAutoFree12(LPXLOPER12 pxFree) {
+	XLKIT_PRAGMA_DLL_EXPORT
+	using namespace xlkit::detail;
+	xlOperandCast(pxFree)->reset();
+}
+
+#ifdef XLKIT_USE_CALL_METRICS
+
+//
+// XLKIT.STATS() worksheet function reporting the CallStats
+//
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+namespace detail {
+struct HELP_FOR_StatsRefresh { };
+template <> struct ParmHelp<HELP_FOR_StatsRefresh> {
+	static const char* name() { return "Refresh"; }
+	static const char* help() { return "Any value, change it to update the table"; }
+};
+} // namespace detail
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+xlOperand12* XLKIT_API
+xlkitStats(xlParm<const xlOperand12*, xlkit::detail::HELP_FOR_StatsRefresh>)
+{
+	XLKIT_BEGIN_FUNCTION
+
+	static const char* const theHeadings[] = {
+		"Function", "Calls", "Failures", "Mean ms", "P50 ms", "P95 ms",
+		"P99 ms", "Max ms", "Total ms", "Result Cells"
+	};
+	enum { NUM_COLUMNS = sizeof(theHeadings) / sizeof(theHeadings[0]) };
+
+	std::vector<xlkit::CallStats> stats = xlkit::callStats();
+
+	xlResultOperand12Ptr result;
+	xlCellMatrixRef12 mat(result->setMatrix(int(stats.size()) + 1, NUM_COLUMNS));
+	for (int j = 0; j < NUM_COLUMNS; ++j)
+		mat(0, j).set(theHeadings[j]);
+	for (int i = 0, n = int(stats.size()); i < n; ++i) {
+		const xlkit::CallStats& s = stats[i];
+		mat(i + 1, 0).set(s.name);
+		mat(i + 1, 1).set(double(s.calls));
+		mat(i + 1, 2).set(double(s.failures));
+		mat(i + 1, 3).set(s.meanMs());
+		mat(i + 1, 4).set(s.percentileMs(0.50));
+		mat(i + 1, 5).set(s.percentileMs(0.95));
+		mat(i + 1, 6).set(s.percentileMs(0.99));
+		mat(i + 1, 7).set(1e-6 * double(s.maxNs));
+		mat(i + 1, 8).set(1e-6 * double(s.totalNs));
+		mat(i + 1, 9).set(double(s.resultCells));
+	}
+	return result;
+
+	XLKIT_END_FUNCTION(xlResultOperand12Ptr)
+}
+XLKIT_REGISTER_THREADSAFE_AS("XLKIT.STATS", xlkitStats,
+	"Calls, failures and latency of the add-in's functions and its callbacks "
+	"into Excel, slowest in total first")
+
+#endif // XLKIT_USE_CALL_METRICS
+
+#ifdef XLKIT_USE_TRACE
+
+//
+// XLKIT.WRITETRACE() worksheet function writing the trace events
+//
+namespace xlkit {
+XLKIT_USE_VERSION_NAMESPACE
+namespace XLKIT_VERSION_NAME {
+namespace detail {
+struct HELP_FOR_TracePath { };
+template <> struct ParmHelp<HELP_FOR_TracePath> {
+	static const char* name() { return "Path"; }
+	static const char* help() { return "File to write the Chrome trace JSON to"; }
+};
+} // namespace detail
+} // namespace XLKIT_VERSION_NAME
+} // namespace xlkit
+
+double XLKIT_API
+xlkitWriteTrace(xlParm<const char*, xlkit::detail::HELP_FOR_TracePath> path)
+{
+	XLKIT_BEGIN_FUNCTION
+
+	return double(xlkit::writeTrace(path.value()));
+
+	XLKIT_END_FUNCTION(double)
+}
+XLKIT_REGISTER_AS("XLKIT.WRITETRACE", xlkitWriteTrace,
+	"Write the timeline of function calls as Chrome trace JSON, returning "
+	"the number of events written")
+
+#endif // XLKIT_USE_TRACE
@@ -26,20 +26,22 @@
 #ifndef XLKIT_HPP
 #define XLKIT_HPP
 
+#include <xlkit/xlArena.hpp>
 #include <xlkit/xldebug.hpp>
 #include <xlkit/xlException.hpp>
+#include <xlkit/xlFpArray.hpp>
+#include <xlkit/xlMetrics.hpp>
+#include <xlkit/xlTrace.hpp>
 #include <xlkit/xlOperand.hpp>
 #include <xlkit/xlversion.hpp>
 
-#define BOOST_FT_CC_STDCALL callable_builtin
-#include <boost/function_types/components.hpp>
-#include <boost/function_types/is_nonmember_callable_builtin.hpp>
-
-#include <boost/mpl/begin_end.hpp>
-#include <boost/mpl/deref.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/iterator/filter_iterator.hpp>
+#include <boost/range/iterator_range.hpp>
+#include <boost/range/join.hpp>
 #include <boost/unordered_map.hpp>
-#include <boost/utility/enable_if.hpp>
 
+#include <functional>
 #include <string>
 #include <vector>
 #include <stdio.h>
@@ -48,9 +50,6 @@ namespace xlkit {
 XLKIT_USE_VERSION_NAMESPACE
 namespace XLKIT_VERSION_NAME {
 
-namespace mpl = boost::mpl;
-namespace ft = boost::function_types;
-
 /// Return value for XLL functions
 class ResultOperandPtr {
   public:
@@ -77,35 +76,293 @@ class ResultOperandPtr {
 	xlOperand* myOperand;
 };
 
+/// Return value for XLL functions using XLOPER12 (Excel 2007+)
+class ResultOperand12Ptr {
+  public:
+
+	/// Get pointer to TLS copy and default initialize it
+	ResultOperand12Ptr();
+
+	/// Get pointer to TLS copy and default initialize it with given
+	/// xlOperand12.
+	ResultOperand12Ptr(const xlOperand12& copy);
+
+	operator xlOperand12*()	{
+		return myOperand;
+	}
+
+	xlOperand12* operator->() {
+		return myOperand;
+	}
+	xlOperand12& operator*()  {
+		return *myOperand;
+	}
+
+  private:
+	xlOperand12* myOperand;
+};
+
+/// XLOPER12 parameter that is passed as a range reference when the
+/// function is called with one, instead of being converted into values.
+class RefOperand12Ptr {
+  public:
+	operator const xlOperand12*() const {
+		return myOperand;
+	}
+
+	const xlOperand12* operator->() const {
+		return myOperand;
+	}
+	const xlOperand12& operator*() const {
+		return *myOperand;
+	}
+
+  private:
+	const xlOperand12* myOperand;
+};
+
+/// Worksheet cells calling a function, see getCaller()
+struct CallerId {
+	uintptr_t	sheet;		///< Sheet id, or 0 if not given by Excel
+	int			rowFirst;	///< First row of the calling cells
+	int			rowLast;	///< Last row of the calling cells
+	int			colFirst;	///< First column of the calling cells
+	int			colLast;	///< Last column of the calling cells
+
+	bool operator==(const CallerId& other) const {
+		return (sheet == other.sheet
+				&& rowFirst == other.rowFirst && rowLast == other.rowLast
+				&& colFirst == other.colFirst && colLast == other.colLast);
+	}
+	bool operator!=(const CallerId& other) const {
+		return !(*this == other);
+	}
+};
+
+inline size_t
+hash_value(const CallerId& caller) {
+	size_t seed = 0;
+	boost::hash_combine(seed, caller.sheet);
+	boost::hash_combine(seed, caller.rowFirst);
+	boost::hash_combine(seed, caller.rowLast);
+	boost::hash_combine(seed, caller.colFirst);
+	boost::hash_combine(seed, caller.colLast);
+	return seed;
+}
+
+/// Get the worksheet cells calling the current function with xlfCaller.
+/// Returns false if it was not called from worksheet cells.
+bool getCaller(CallerId& caller);
+
+/// Time spent registering functions when the add-in was last opened
+struct AttachTiming {
+	int		numFunctions = 0;	///< Number of functions registered
+	int		numFailed = 0;		///< Number of failed registrations
+	double	getNameMs = 0;		///< Time resolving the DLL name with xlGetName
+	double	argumentsMs = 0;	///< Time building xlfRegister arguments
+	double	registerMs = 0;		///< Time inside xlfRegister calls
+	double	totalMs = 0;		///< Total time for the registration
+};
+
+/// Get the timing of the last registration of the add-in's functions
+const AttachTiming& attachTiming();
+
+/// Number of worker threads running asynchronous functions, where 0 uses
+/// one per hardware thread
+#ifndef XLKIT_ASYNC_THREADS
+#define XLKIT_ASYNC_THREADS 0
+#endif
+
+/// Maximum number of asynchronous tasks waiting for a worker thread
+#ifndef XLKIT_ASYNC_QUEUE_SIZE
+#define XLKIT_ASYNC_QUEUE_SIZE 1024
+#endif
+
+/// Characters of string arguments that a callback into Excel copies into a
+/// buffer on the stack. Longer strings are copied to the heap instead.
+#ifndef XLKIT_CALL_STRING_CHARS
+#define XLKIT_CALL_STRING_CHARS 256
+#endif
+
+/// Async handle parameter of an asynchronous XLL function (Excel 2010+).
+/// Such functions return void and take an AsyncHandle parameter. Excel then
+/// shows the cell as pending until the result is returned for the handle,
+/// and continues calculating other cells in the meantime.
+/// @note Each handle must be completed exactly once, either by submit() or
+/// by complete(). Use XLKIT_END_ASYNC_FUNCTION() to complete it on errors.
+class AsyncHandle {
+  public:
+	/// Task computing the result of an asynchronous function
+	typedef std::function<void (xlOperand12& result)> Task;
+
+	/// Queue the task to run on the xlkit worker pool, which returns its
+	/// result to Excel when done. If the task throws, an error is returned
+	/// instead. Blocks while the queue already has XLKIT_ASYNC_QUEUE_SIZE
+	/// pending tasks.
+	/// @note The task runs after the function returns, so it must capture
+	/// its inputs by value. The task is copied under a CallArena::Pause, so
+	/// operands captured by value no longer reference the call arena, but
+	/// operands the task reaches through pointers must be promote()d.
+	template <typename F>
+	void submit(const F& task) const {
+		CallArena::Pause pause;
+		submitTask(Task(task));
+	}
+
+	/// Return the result to Excel now
+	void complete(const xlOperand12& result) const;
+
+	/// Return an error to Excel now
+	/// @{
+	void fail() const {
+		complete(xlOperand12(xlError(xlerrValue)));
+	}
+	template <typename S>
+	void fail(S s) const {
+		complete(xlOperand12(s));
+	}
+	/// @}
+
+  private:
+	void submitTask(Task task) const;
+
+	const xlOperand12* myHandle;
+};
+
+/// Return value for XLL functions returning an array of numbers, declared
+/// with an FP* return type. The array lives in thread-local storage which is
+/// reused by the next call on the same thread.
+class ResultFpArrayPtr {
+  public:
+
+	/// Construct a NULL array, which Excel treats as an error
+	ResultFpArrayPtr() { }
+
+	/// Get pointer to TLS array resized to rows x cols. The element values
+	/// are left uninitialized.
+	ResultFpArrayPtr(int rows, int cols);
+
+	operator FP*() {
+		return myArray.fp();
+	}
+
+	xlFpArray* operator->() {
+		return &myArray;
+	}
+	xlFpArray& operator*() {
+		return myArray;
+	}
+
+  private:
+	xlFpArray myArray;
+};
+
+/// Return value for XLL functions returning an array of numbers, declared
+/// with an FP12* return type (Excel 2007+). See ResultFpArrayPtr.
+class ResultFpArray12Ptr {
+  public:
+
+	/// Construct a NULL array, which Excel treats as an error
+	ResultFpArray12Ptr() { }
+
+	/// Get pointer to TLS array resized to rows x cols. The element values
+	/// are left uninitialized.
+	ResultFpArray12Ptr(int rows, int cols);
+
+	operator FP12*() {
+		return myArray.fp();
+	}
+
+	xlFpArray12* operator->() {
+		return &myArray;
+	}
+	xlFpArray12& operator*() {
+		return myArray;
+	}
+
+  private:
+	xlFpArray12 myArray;
+};
+
 namespace detail {
 
 // Empty help
 struct empty_ { };
 
+// Compile-time string of the characters C
+template <char... C>
+struct Chars {
+	static const char value[sizeof...(C) + 1];
+};
+template <char... C>
+const char Chars<C...>::value[sizeof...(C) + 1] = { C..., '\0' };
+
+template <typename A, typename B>
+struct ConcatChars;
+template <char... A, char... B>
+struct ConcatChars< Chars<A...>, Chars<B...> > {
+	typedef Chars<A..., B...> type;
+};
+
 // Info for type T
 template <typename T>
 struct TypeInfo;
 
+#define XLKIT_TYPEINFO_CHARS(...) __VA_ARGS__
 #define XLKIT_TYPEINFO(TYPE, CODE, HELP) \
 			template <> \
 			struct TypeInfo<TYPE> { \
+				typedef Chars<XLKIT_TYPEINFO_CHARS CODE> Code; \
 				static size_t		size()	{ return sizeof(TYPE); } \
-				static char			code()	{ return CODE; } \
+				static const char*	code()	{ return Code::value; } \
 				static const char*	name()	{ return #TYPE; } \
 				static const char*	help()	{ return HELP; } \
 			}; \
 			/**/
 
-XLKIT_TYPEINFO(double,				'B', "Number")
-XLKIT_TYPEINFO(const char*,			'C', "String")
-XLKIT_TYPEINFO(uint16_t,			'H', "Unsigned Integer")
-XLKIT_TYPEINFO(int16_t,				'I', "Signed Integer")
-XLKIT_TYPEINFO(int32_t,				'J', "Signed Integer")
-XLKIT_TYPEINFO(xlOperand*,			'P', "Cell or Cell Range")
-XLKIT_TYPEINFO(const xlOperand*,	'P', "Cell or Cell Range")
-XLKIT_TYPEINFO(ResultOperandPtr,	'P', "Cell or Cell Range")
+XLKIT_TYPEINFO(double,				('B'),		"Number")
+XLKIT_TYPEINFO(const char*,			('C'),		"String")
+XLKIT_TYPEINFO(const XCHAR*,		('C','%'),	"String")
+XLKIT_TYPEINFO(uint16_t,			('H'),		"Unsigned Integer")
+XLKIT_TYPEINFO(int16_t,				('I'),		"Signed Integer")
+XLKIT_TYPEINFO(int32_t,				('J'),		"Signed Integer")
+XLKIT_TYPEINFO(xlOperand*,			('P'),		"Cell or Cell Range")
+XLKIT_TYPEINFO(const xlOperand*,	('P'),		"Cell or Cell Range")
+XLKIT_TYPEINFO(ResultOperandPtr,	('P'),		"Cell or Cell Range")
+XLKIT_TYPEINFO(xlOperand12*,		('Q'),		"Cell or Cell Range")
+XLKIT_TYPEINFO(const xlOperand12*,	('Q'),		"Cell or Cell Range")
+XLKIT_TYPEINFO(ResultOperand12Ptr,	('Q'),		"Cell or Cell Range")
+XLKIT_TYPEINFO(RefOperand12Ptr,		('U'),		"Cell Range Reference")
+XLKIT_TYPEINFO(FP*,					('K'),		"Array of Numbers")
+XLKIT_TYPEINFO(xlFpArray,			('K'),		"Array of Numbers")
+XLKIT_TYPEINFO(ResultFpArrayPtr,	('K'),		"Array of Numbers")
+XLKIT_TYPEINFO(FP12*,				('K','%'),	"Array of Numbers")
+XLKIT_TYPEINFO(xlFpArray12,			('K','%'),	"Array of Numbers")
+XLKIT_TYPEINFO(ResultFpArray12Ptr,	('K','%'),	"Array of Numbers")
 
 #undef XLKIT_TYPEINFO
+#undef XLKIT_TYPEINFO_CHARS
+
+// Return type of asynchronous functions
+template <>
+struct TypeInfo<void> {
+	typedef Chars<'>'> Code;
+	static size_t		size()	{ return 0; }
+	static const char*	code()	{ return Code::value; }
+	static const char*	name()	{ return "void"; }
+	static const char*	help()	{ return ""; }
+};
+
+// The async handle is not shown to the user, which is indicated by a NULL
+// name so that it is left out of the argument names and help.
+template <>
+struct TypeInfo<AsyncHandle> {
+	typedef Chars<'X'> Code;
+	static size_t		size()	{ return sizeof(AsyncHandle); }
+	static const char*	code()	{ return Code::value; }
+	static const char*	name()	{ return NULL; }
+	static const char*	help()	{ return NULL; }
+};
 
 // Error result for type T
 template <typename T>
@@ -128,6 +385,36 @@ struct ErrorResult<ResultOperandPtr> {
 		return ResultOperandPtr(xlOperand(s));
 	}
 };
+template <>
+struct ErrorResult<ResultOperand12Ptr> {
+	static ResultOperand12Ptr value() {
+		return ResultOperand12Ptr();
+	}
+	template <typename S>
+	static ResultOperand12Ptr value(S s) {
+		return ResultOperand12Ptr(xlOperand12(s));
+	}
+};
+template <>
+struct ErrorResult<ResultFpArrayPtr> {
+	static ResultFpArrayPtr value() {
+		return ResultFpArrayPtr();
+	}
+	template <typename S>
+	static ResultFpArrayPtr value(S s) {
+		return ResultFpArrayPtr();
+	}
+};
+template <>
+struct ErrorResult<ResultFpArray12Ptr> {
+	static ResultFpArray12Ptr value() {
+		return ResultFpArray12Ptr();
+	}
+	template <typename S>
+	static ResultFpArray12Ptr value(S s) {
+		return ResultFpArray12Ptr();
+	}
+};
 
 // Label for type T, defaults to nothing for unknown types.
 template <typename T>
@@ -179,10 +466,11 @@ namespace detail {
 
 template <typename T, typename PARM_HELP>
 struct TypeInfo< Parm<T, PARM_HELP> > {
+	typedef typename TypeInfo<T>::Code Code;
 	static size_t size() {
 		return TypeInfo<T>::size();
 	}
-	static char code() {
+	static const char* code() {
 		return TypeInfo<T>::code();
 	}
 	static const char* name() {
@@ -201,47 +489,115 @@ struct TypeInfo< Parm<T, PARM_HELP> > {
 
 } // namespace detail
 
-/// Stores all registry of functions for the XLL
+/// Static description of a function registered by XLKIT_REGISTER(). These
+/// are constant data placed in a table by the linker, so no code runs to
+/// build them.
+struct FunctionInfo {
+	typedef const char* (*TextFn)();
+
+	const char*		procedure;	///< Exported name of the C++ function
+	const char*		excelName;	///< Name of the function in Excel
+	const char*		help;		///< Help for the function
+	const char*		types;		///< Excel type string, return type first
+	int				numArgs;	///< Number of arguments
+	const TextFn*	argNames;	///< Name of each argument
+	const TextFn*	argHelp;	///< Help for each argument
+};
+
+namespace detail {
+
+// Excel type string of types T as Chars
+template <typename... T>
+struct TypeCodes;
+template <>
+struct TypeCodes<> {
+	typedef Chars<> type;
+};
+template <typename T, typename... REST>
+struct TypeCodes<T, REST...> {
+	typedef typename ConcatChars< typename TypeInfo<T>::Code,
+			typename TypeCodes<REST...>::type >::type type;
+};
+
+// Compile-time signature of a registered function of type F
+template <typename F>
+struct Signature;
+template <typename R, typename... ARGS>
+struct Signature<R (__stdcall *)(ARGS...)> {
+	typedef R Result;
+	typedef typename TypeCodes<R, ARGS...>::type Types;
+	/// Types with the '$' suffix which lets Excel call the function from
+	/// multiple recalculation threads
+	typedef typename ConcatChars<Types, Chars<'$'> >::type ThreadSafeTypes;
+	enum { NUM_ARGS = sizeof...(ARGS) };
+	static const FunctionInfo::TextFn theArgNames[sizeof...(ARGS) + 1];
+	static const FunctionInfo::TextFn theArgHelp[sizeof...(ARGS) + 1];
+};
+template <typename R, typename... ARGS>
+const FunctionInfo::TextFn Signature<R (__stdcall *)(ARGS...)>::theArgNames[] = {
+	&TypeInfo<ARGS>::name..., NULL
+};
+template <typename R, typename... ARGS>
+const FunctionInfo::TextFn Signature<R (__stdcall *)(ARGS...)>::theArgHelp[] = {
+	&TypeInfo<ARGS>::help..., NULL
+};
+
+// The linker may pad the function table with NULL entries
+struct IsFunctionEntry {
+	bool operator()(const FunctionInfo* info) const {
+		return (info != NULL);
+	}
+};
+
+} // namespace detail
+
+/// Access to the functions registered for the XLL
 class Registry {
 
   public:
 
-	/// Get the singleton instance
+	/// Get the singleton instance. It is safe to call from any thread and
+	/// during static initialization.
 	static Registry& instance() {
-		if (!theInstance)
-			theInstance = new Registry;
-		return *theInstance;
+		return theInstance;
 	}
 
 	void setAddinLabel(const char* label);
 
-	/// Register a new function.
+	/// Register a new function at runtime. XLKIT_REGISTER() should be
+	/// preferred as it adds the function to the static table without running
+	/// any code. Registering the same C++ function name again replaces it.
+	/// @note Only call these during static initialization or from
+	/// xlAutoOpen, before the functions are registered with Excel.
 	/// @{
 	/// Name of the Excel function is the same as the C++ function name
 	template <typename F>
 	void addFunction(const std::string& name, F f, const char* help) {
-		myFunctions[name] = makeWrapper<F>(name, f, help);
+		addFunction(name, name, f, help);
 	}
 	/// Name of the Excel function is different from the the C++ function name
 	template <typename F>
 	void addFunction(const std::string& excel_name,
-			const std::string& name, F f, const char* help) {
-		myFunctions[name] = makeWrapper<F>(excel_name, f, help);
+			const std::string& name, F, const char* help) {
+		typedef detail::Signature<F> Sig;
+		addInfo(name, excel_name, help, Sig::Types::value, Sig::NUM_ARGS,
+				Sig::theArgNames, Sig::theArgHelp);
 	}
 	/// @}
 
-	/// Print a list of all registered functions for debugging
-	void dump() {
-		for (const auto& i : myFunctions) {
-			printf("'%s' -> '%s' [", i.first.c_str(), i.second.myTypes.c_str());
-			for (int j = 0, n = int(i.second.myParmHelp.size()); j < n; ++j) {
-				if (j > 0)
-					printf(",");
-				printf("%s", i.second.myParmHelp[j].c_str());
-			}
-			printf("]\n");
-		}
-	}
+	/// Range of const FunctionInfo* for all registered functions
+	/// @{
+	typedef boost::filter_iterator<detail::IsFunctionEntry,
+			const FunctionInfo* const*> FunctionIterator;
+	typedef boost::iterator_range<FunctionIterator> StaticFunctionRange;
+	typedef std::vector<const FunctionInfo*> RuntimeFunctionList;
+	typedef boost::range::joined_range<const StaticFunctionRange,
+			const RuntimeFunctionList> FunctionRange;
+	/// @}
+
+	/// All registered functions: the static table built by XLKIT_REGISTER()
+	/// followed by those added with addFunction()
+	FunctionRange functionInfos() const;
 
 	/// Information for a registered function
 	struct Wrapper {
@@ -268,53 +624,37 @@ class Registry {
 
 	typedef boost::unordered_map<std::string, Wrapper> NameMap;
 
-	/// List of registered functions
-	const NameMap& functions() const {
-		return myFunctions;
-	}
-
-  private:
-
-	Registry() {}
-
-	// Make a wrapper object for function F
-	template <typename F>
-	Wrapper
-	makeWrapper(const std::string&name, F f, const char* func_help,
-				typename boost::enable_if< ft::is_nonmember_callable_builtin<F, ft::stdcall_cc>
-				>::type *dummy = 0) {
-
-		typedef Func<F> FuncT;
-
-		std::string types;
-		Func<F>::getTypes(types);
-
-		// Skip first type, which is the return type
-		typedef typename mpl::next<mpl::begin< ft::components<F> >::type>::type Second;
-		typedef typename mpl::end< ft::components<F> >::type End;
-
-		std::string arg_names;
-		Func<F, Second, End>::getArgNames(arg_names);
+	/// Map from C++ function name to the information for each registered
+	/// function. It is built on every call, so use functionInfos() instead
+	/// where speed matters.
+	NameMap functions() const;
 
-		std::vector<std::string> parm_help;
-		Func<F, Second, End>::getParmHelp(parm_help);
-
-		return Wrapper(name, types, func_help, arg_names, parm_help);
+	/// Print a list of all registered functions for debugging
+	void dump() {
+		for (const FunctionInfo* info : functionInfos()) {
+			printf("'%s' -> '%s' [", info->procedure, info->types);
+			const char* sep = "";
+			for (int j = 0; j < info->numArgs; ++j) {
+				if (info->argHelp[j]()) {
+					printf("%s%s", sep, info->argHelp[j]());
+					sep = ",";
+				}
+			}
+			printf("]\n");
+		}
 	}
 
-	// Get the information for function F (first arg is return type)
-	template
-	< typename F
-	  , class Beg = typename mpl::begin< ft::components<F> >::type
-	  , class End = typename mpl::end< ft::components<F> >::type
-	  >
-	struct Func;
-
   private:
 
-	NameMap myFunctions;
+	Registry() = default;
+
+	// Add a function to the runtime list, copying the strings
+	void addInfo(const std::string& procedure, const std::string& excel_name,
+				 const char* help, const char* types, int num_args,
+				 const FunctionInfo::TextFn* arg_names,
+				 const FunctionInfo::TextFn* arg_help);
 
-	static Registry* theInstance;
+	static Registry theInstance;
 };
 
 inline void
@@ -322,46 +662,6 @@ dumpRegistry() {
 	Registry::instance().dump();
 }
 
-//
-// Specializations for function introspection
-//
-template <typename F, typename Curr, typename End>
-struct Registry::Func {
-	// Type string signature
-	static void getTypes(std::string& types) {
-		typedef typename mpl::next<Curr>::type Next;
-		typedef typename mpl::deref<Curr>::type Type;
-
-		types += detail::TypeInfo<Type>::code();
-		Func<F, Next, End>::getTypes(types);
-	}
-	// Names of the arguments
-	static void getArgNames(std::string& arg_names) {
-		typedef typename mpl::next<Curr>::type Next;
-		typedef typename mpl::deref<Curr>::type Type;
-
-		if (arg_names.size() > 0)
-			arg_names += ", ";
-		arg_names += detail::TypeInfo<Type>::name();
-		Func<F, Next, End>::getArgNames(arg_names);
-	}
-	// Help description for individual arguments
-	static void getParmHelp(std::vector<std::string>& parm_help) {
-		typedef typename mpl::next<Curr>::type Next;
-		typedef typename mpl::deref<Curr>::type Type;
-
-		parm_help.push_back(detail::TypeInfo<Type>::help());
-		Func<F, Next, End>::getParmHelp(parm_help);
-	}
-};
-
-template <typename F, typename End>
-struct Registry::Func<F, End, End> {
-	static void getTypes(std::string&) { }
-	static void getArgNames(std::string&) { }
-	static void getParmHelp(std::vector<std::string>&) { }
-};
-
 } // namespace XLKIT_VERSION_NAME
 } // namespace xlkit
 
@@ -378,6 +678,26 @@ using xlParm = xlkit::Parm<T, PARM_HELP>;
 /// See @ref xlkit::XLKIT_VERSION_NAME::ResultOperandPtr "xlResultOperandPtr".
 typedef xlkit::ResultOperandPtr xlResultOperandPtr;
 
+/// Return value for XLL functions using XLOPER12.
+/// See @ref xlkit::XLKIT_VERSION_NAME::ResultOperand12Ptr "xlResultOperand12Ptr".
+typedef xlkit::ResultOperand12Ptr xlResultOperand12Ptr;
+
+/// Return value for XLL functions returning FP*.
+/// See @ref xlkit::XLKIT_VERSION_NAME::ResultFpArrayPtr "xlResultFpArrayPtr".
+typedef xlkit::ResultFpArrayPtr xlResultFpArrayPtr;
+
+/// Return value for XLL functions returning FP12*.
+/// See @ref xlkit::XLKIT_VERSION_NAME::ResultFpArray12Ptr "xlResultFpArray12Ptr".
+typedef xlkit::ResultFpArray12Ptr xlResultFpArray12Ptr;
+
+/// XLOPER12 parameter that accepts range references.
+/// See @ref xlkit::XLKIT_VERSION_NAME::RefOperand12Ptr "xlRefOperand12Ptr".
+typedef xlkit::RefOperand12Ptr xlRefOperand12Ptr;
+
+/// Async handle parameter for asynchronous XLL functions.
+/// See @ref xlkit::XLKIT_VERSION_NAME::AsyncHandle "xlAsyncHandle".
+typedef xlkit::AsyncHandle xlAsyncHandle;
+
 /// @}
 
 /// @addtogroup macros Main Macros
@@ -412,37 +732,136 @@ typedef xlkit::ResultOperandPtr xlResultOperandPtr;
 			typedef xlParm<VALUE_TYPE, HELP_FOR_##NAME> xlParm##NAME;
 			/**/
 
+/// @def XLKIT_FUNCTION_ENTRY
+/// Places the following pointer into the linker section holding the table
+/// of registered functions
+#if defined(_MSC_VER)
+#pragma section("xlkit$a", read)
+#pragma section("xlkit$f", read)
+#pragma section("xlkit$z", read)
+#define XLKIT_FUNCTION_ENTRY	__declspec(allocate("xlkit$f"))
+#else
+#define XLKIT_FUNCTION_ENTRY	__attribute__((used, section("xlkit_functions")))
+#endif
+
+/// @def XLKIT_REGISTER_HOOK
+/// Expanded by every registration macro with the function and its
+/// FunctionInfo, so that tools can generate code for each registered
+/// function. It's empty unless defined before including xlkit.hpp, as
+/// bench/xlInvoke.hpp does for the load generator.
+#ifndef XLKIT_REGISTER_HOOK
+#define XLKIT_REGISTER_HOOK(FUNC, INFO)
+#endif
+
+/// Adds the FunctionInfo for FUNC, exported as PROC, with the given TYPES to
+/// the function table
+#define XLKIT_REGISTER_INFO(XLNAME, FUNC, PROC, HELP, TYPES) \
+			static const xlkit::FunctionInfo the##FUNC##Info = { \
+				PROC, XLNAME, HELP, \
+				xlkit::detail::Signature<decltype(&FUNC)>::TYPES::value, \
+				xlkit::detail::Signature<decltype(&FUNC)>::NUM_ARGS, \
+				xlkit::detail::Signature<decltype(&FUNC)>::theArgNames, \
+				xlkit::detail::Signature<decltype(&FUNC)>::theArgHelp \
+			}; \
+			extern XLKIT_FUNCTION_ENTRY const xlkit::FunctionInfo* const \
+				xlkit_function_##FUNC = &the##FUNC##Info; \
+			XLKIT_REGISTER_HOOK(FUNC, the##FUNC##Info) \
+			/**/
+
 /// Macro to register the given function with xlkit
 #define XLKIT_REGISTER(FUNC, HELP) \
-			struct FUNC##Registrar { \
-				FUNC##Registrar() { \
-					xlkit::Registry::instance().addFunction(#FUNC,FUNC,HELP); \
-				} \
-			}; \
-			static FUNC##Registrar the##FUNC##Registrar; \
+			XLKIT_REGISTER_AS(#FUNC, FUNC, HELP) \
 			/**/
 
 /// Macro to register the given function with xlkit with a different name from
 /// the C++ function name.
 #define XLKIT_REGISTER_AS(XLNAME, FUNC, HELP) \
-			struct FUNC##Registrar { \
-				FUNC##Registrar() { \
-					xlkit::Registry::instance().addFunction(XLNAME,#FUNC,FUNC,HELP); \
-				} \
-			}; \
-			static FUNC##Registrar the##FUNC##Registrar; \
+			XLKIT_REGISTER_INFO(XLNAME, FUNC, #FUNC, HELP, Types) \
+			/**/
+
+/// Macro to register the given function with xlkit as thread-safe, so that
+/// Excel may call it concurrently during multithreaded recalculation. The
+/// function must not call back into Excel with commands or other callbacks
+/// that are illegal outside of the main thread, and must only share state
+/// through thread-safe means such as ResultOperandPtr.
+#define XLKIT_REGISTER_THREADSAFE(FUNC, HELP) \
+			XLKIT_REGISTER_THREADSAFE_AS(#FUNC, FUNC, HELP) \
+			/**/
+
+/// Macro to register the given thread-safe function with xlkit with a
+/// different name from the C++ function name.
+#define XLKIT_REGISTER_THREADSAFE_AS(XLNAME, FUNC, HELP) \
+			XLKIT_REGISTER_INFO(XLNAME, FUNC, #FUNC, HELP, ThreadSafeTypes) \
 			/**/
 
 /// All registered functions must have this calling convention
 #define XLKIT_API	__stdcall
 
+/// @def XLKIT_PRAGMA_DLL_EXPORT
 /// Macro to export the enclosed function for Excel to use
+/// @def XLKIT_PRAGMA_DLL_EXPORT_AS(NAME)
+/// Macro to export the enclosing function for Excel under the given NAME
+#ifdef _MSC_VER
 #define XLKIT_PRAGMA_DLL_EXPORT \
 			__pragma(comment(linker, "/EXPORT:" __FUNCTION__ "=" __FUNCDNAME__))
+#define XLKIT_PRAGMA_DLL_EXPORT_AS(NAME) \
+			__pragma(comment(linker, "/EXPORT:" NAME "=" __FUNCDNAME__))
+#else
+// Other platforms have no Excel to export to, only mock hosts which call the
+// functions directly
+#define XLKIT_PRAGMA_DLL_EXPORT
+#define XLKIT_PRAGMA_DLL_EXPORT_AS(NAME)
+#endif
+
+/// @def XLKIT_CALL_ARENA_SCOPE
+/// Activates the CallArena for the enclosing function when
+/// XLKIT_USE_CALL_ARENA is defined, otherwise expands to nothing.
+#ifdef XLKIT_USE_CALL_ARENA
+#define XLKIT_CALL_ARENA_SCOPE \
+			xlkit::detail::CallArenaScope xlkit_call_arena_scope_; \
+			/**/
+#else
+#define XLKIT_CALL_ARENA_SCOPE
+#endif
+
+/// @def XLKIT_CALL_METRICS_SCOPE(NAME)
+/// Counts the calls to the enclosing function under NAME when
+/// XLKIT_USE_CALL_METRICS is defined, otherwise expands to nothing.
+/// See CallStats.
+/// @def XLKIT_CALL_METRICS_FAIL
+/// Marks the call counted by XLKIT_CALL_METRICS_SCOPE() as failed
+#ifdef XLKIT_USE_CALL_METRICS
+#define XLKIT_CALL_METRICS_SCOPE(NAME) \
+			static std::atomic<int> xlkit_call_metrics_slot_(0); \
+			xlkit::detail::CallMetricsScope xlkit_call_metrics_scope_( \
+				xlkit_call_metrics_slot_, NAME); \
+			/**/
+#define XLKIT_CALL_METRICS_FAIL \
+			xlkit_call_metrics_scope_.fail(); \
+			/**/
+#else
+#define XLKIT_CALL_METRICS_SCOPE(NAME)
+#define XLKIT_CALL_METRICS_FAIL
+#endif
+
+/// @def XLKIT_TRACE_SCOPE(NAME)
+/// Records the enclosing function call under NAME when XLKIT_USE_TRACE is
+/// defined, otherwise expands to nothing. See writeTrace().
+#ifdef XLKIT_USE_TRACE
+#define XLKIT_TRACE_SCOPE(NAME) \
+			xlkit::detail::TraceScope xlkit_trace_scope_( \
+				xlkit::detail::Trace::TRACE_FUNCTION, NAME); \
+			/**/
+#else
+#define XLKIT_TRACE_SCOPE(NAME)
+#endif
 
 /// All Excel functions begin with this macro
 #define XLKIT_BEGIN_FUNCTION \
 			XLKIT_PRAGMA_DLL_EXPORT \
+			XLKIT_TRACE_SCOPE(__FUNCTION__) \
+			XLKIT_CALL_METRICS_SCOPE(__FUNCTION__) \
+			XLKIT_CALL_ARENA_SCOPE \
 			try { \
 			/**/
 
@@ -451,19 +870,45 @@ typedef xlkit::ResultOperandPtr xlResultOperandPtr;
 #define XLKIT_END_FUNCTION(RESULT_T) \
 			} catch (xlkit::xlException& err) { \
 				XLDBG_EXCEPT(err); \
+				XLKIT_CALL_METRICS_FAIL \
 				return xlkit::detail::ErrorResult<RESULT_T>::value(); \
 			} catch (std::exception& err){ \
 				XLDBG_EXCEPT(err); \
+				XLKIT_CALL_METRICS_FAIL \
 				return xlkit::detail::ErrorResult<RESULT_T>::value(err.what()); \
 			} catch (xlkit::xlError& err){ \
 				XLDBG_EXCEPT(err); \
+				XLKIT_CALL_METRICS_FAIL \
 				return xlkit::detail::ErrorResult<RESULT_T>::value(err); \
 			} catch (...) { \
 				XLDBG("Unknown exception caught"); \
+				XLKIT_CALL_METRICS_FAIL \
 				return xlkit::detail::ErrorResult<RESULT_T>::value(); \
 			} \
 			/**/
 
+/// Asynchronous Excel functions end with this macro instead of
+/// XLKIT_END_FUNCTION(), which returns errors through the given AsyncHandle.
+#define XLKIT_END_ASYNC_FUNCTION(HANDLE) \
+			} catch (xlkit::xlException& err) { \
+				XLDBG_EXCEPT(err); \
+				XLKIT_CALL_METRICS_FAIL \
+				(HANDLE).fail(); \
+			} catch (std::exception& err){ \
+				XLDBG_EXCEPT(err); \
+				XLKIT_CALL_METRICS_FAIL \
+				(HANDLE).fail(err.what()); \
+			} catch (xlkit::xlError& err){ \
+				XLDBG_EXCEPT(err); \
+				XLKIT_CALL_METRICS_FAIL \
+				(HANDLE).fail(err); \
+			} catch (...) { \
+				XLDBG("Unknown exception caught"); \
+				XLKIT_CALL_METRICS_FAIL \
+				(HANDLE).fail(); \
+			} \
+			/**/
+
 /// @}
 
 #endif // XLKIT_HPP
@@ -32,6 +32,8 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
 
 namespace xlkit {
 XLKIT_USE_VERSION_NAMESPACE
@@ -50,6 +52,22 @@ namespace XLKIT_VERSION_NAME {
 #define XLKIT_POP_DISABLE_WARN_DEPRECATION 
 #endif
 
+/// @def XLKIT_THREAD_LOCAL
+/// Storage class for thread-local variables, which must be POD
+#ifdef _MSC_VER
+#define XLKIT_THREAD_LOCAL	__declspec(thread)
+#else
+#define XLKIT_THREAD_LOCAL	__thread
+#endif
+
+/// @def XLKIT_NOEXCEPT
+/// noexcept specifier, which Visual C++ only supports from 2015
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#define XLKIT_NOEXCEPT	throw()
+#else
+#define XLKIT_NOEXCEPT	noexcept
+#endif
+
 /// vsprintf() analog that returns an std::string
 inline std::string
 strprintfV(const char *fmt, va_list args) {
@@ -77,6 +95,71 @@ strprintf(const char *fmt, ...) {
 	return str;
 }
 
+/// snprintf() analog, as Visual C++ only has a conforming snprintf() from
+/// 2015. buf is always null-terminated, and the number of characters written
+/// is returned, which is less than the full length if it was truncated.
+inline int
+strnprintf(char* buf, size_t size, const char* fmt, ...) {
+	if (size == 0)
+		return 0;
+	va_list args;
+	va_start(args, fmt);
+	XLKIT_PUSH_DISABLE_WARN_DEPRECATION
+	int n = vsnprintf(buf, size, fmt, args);
+	XLKIT_POP_DISABLE_WARN_DEPRECATION
+	va_end(args);
+	if (n < 0 || size_t(n) >= size) {
+		n = int(size - 1);
+		buf[n] = '\0';
+	}
+	return n;
+}
+
+namespace detail {
+
+inline uint64_t
+rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+// Mix the 8-byte word k into the running hash h, as in MurmurHash3
+inline uint64_t
+hashMix(uint64_t h, uint64_t k) {
+	h ^= rotl64(k * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+	return rotl64(h, 27) * 5 + 0x52dce729;
+}
+
+// Final avalanche of the running hash h
+inline uint64_t
+hashFinish(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// 64-bit hash of n bytes, processing 8 bytes at a time
+inline uint64_t
+hashBytes(const void* data, size_t n, uint64_t seed = 0) {
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	uint64_t h = seed ^ (uint64_t(n) * 0x9e3779b97f4a7c15ULL);
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t k;
+		::memcpy(&k, p, 8);
+		h = hashMix(h, k);
+	}
+	if (n > 0) {
+		uint64_t k = 0;
+		::memcpy(&k, p, n);
+		h = hashMix(h, k);
+	}
+	return hashFinish(h);
+}
+
+} // namespace detail
+
 } // namespace XLKIT_VERSION_NAME
 } // namespace xlkit
 